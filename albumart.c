@@ -29,6 +29,7 @@
 #include <libgen.h>
 #include <setjmp.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <jpeglib.h>
 
@@ -39,6 +40,10 @@
 #include "image_utils.h"
 #include "log.h"
 
+/* Scanner workers looking at files of the same folder may resize the
+ * same cover at once. */
+static pthread_mutex_t art_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int
 art_cache_exists(const char *orig_path, char **cache_file)
 {
@@ -61,8 +66,12 @@ save_resized_album_art(image_s *imsrc, const char *path)
 	if( !imsrc )
 		return NULL;
 
+	pthread_mutex_lock(&art_lock);
 	if( art_cache_exists(path, &cache_file) )
+	{
+		pthread_mutex_unlock(&art_lock);
 		return cache_file;
+	}
 
 	strncpyt(cache_dir, cache_file, sizeof(cache_dir));
 	make_dir(dirname(cache_dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
@@ -80,11 +89,13 @@ save_resized_album_art(image_s *imsrc, const char *path)
 	imdst = image_resize(imsrc, dstw, dsth);
 	if( !imdst )
 	{
+		pthread_mutex_unlock(&art_lock);
 		free(cache_file);
 		return NULL;
 	}
 
 	cache_file = image_save_to_jpeg_file(imdst, cache_file);
+	pthread_mutex_unlock(&art_lock);
 	image_free(imdst);
 	
 	return cache_file;
@@ -166,9 +177,10 @@ check_embedded_art(const char *path, uint8_t *image_data, int image_size)
 	char *cache_dir;
 	FILE *dstfile;
 	image_s *imsrc;
-	static char last_path[PATH_MAX];
-	static unsigned int last_hash = 0;
-	static int last_success = 0;
+	/* per scanner worker */
+	static __thread char last_path[PATH_MAX];
+	static __thread unsigned int last_hash = 0;
+	static __thread int last_success = 0;
 	unsigned int hash;
 
 	if( !image_data || !image_size || !path )
@@ -345,22 +357,43 @@ found_file:
 	return NULL;
 }
 
-int64_t
-find_album_art(const char *path, uint8_t *image_data, int image_size)
+/* The cached art file for path, without touching the database, so that
+ * scanner workers can look for it. */
+char *
+find_album_art_file(const char *path, uint8_t *image_data, int image_size)
 {
 	char *album_art = NULL;
-	int64_t ret = 0;
 
-	if( (image_size && (album_art = check_embedded_art(path, image_data, image_size))) ||
-	    (album_art = check_for_album_file(path)) )
+	if( image_size && (album_art = check_embedded_art(path, image_data, image_size)) )
+		return album_art;
+
+	return check_for_album_file(path);
+}
+
+int64_t
+get_album_art_id(const char *album_art)
+{
+	int64_t ret;
+
+	ret = sql_get_int_param(db, "SELECT ID from ALBUM_ART where PATH = ?", "s", album_art);
+	if( !ret )
 	{
-		ret = sql_get_int_field(db, "SELECT ID from ALBUM_ART where PATH = '%q'", album_art);
-		if( !ret )
-		{
-			if( sql_exec(db, "INSERT into ALBUM_ART (PATH) VALUES ('%q')", album_art) == SQLITE_OK )
-				ret = sqlite3_last_insert_rowid(db);
-		}
+		if( sql_exec(db, "INSERT into ALBUM_ART (PATH) VALUES ('%q')", album_art) == SQLITE_OK )
+			ret = sqlite3_last_insert_rowid(db);
 	}
+
+	return ret;
+}
+
+int64_t
+find_album_art(const char *path, uint8_t *image_data, int image_size)
+{
+	char *album_art;
+	int64_t ret = 0;
+
+	album_art = find_album_art_file(path, image_data, image_size);
+	if( album_art )
+		ret = get_album_art_id(album_art);
 	free(album_art);
 
 	return ret;
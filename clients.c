@@ -16,14 +16,17 @@
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <time.h>
 
 #include "clients.h"
 #include "getifaddr.h"
 #include "log.h"
 
-struct client_type_s client_types[] =
+static struct client_type_s builtin_client_types[] =
 {
 	{ 0,
 	  0,
@@ -264,39 +267,447 @@ struct client_type_s client_types[] =
 	{ 0, 0, NULL, NULL, 0, NULL }
 };
 
-struct client_cache_s clients[CLIENT_CACHE_SLOTS];
+/* The built-in table, followed by the profiles of client_profiles once
+ * LoadClientProfiles() has run.  Built-in entries keep their index. */
+struct client_type_s *client_types = builtin_client_types;
+static int builtin_count = sizeof(builtin_client_types) / sizeof(builtin_client_types[0]) - 1;
+static int profile_count = 0;
+
+static const struct {
+	const char *name;
+	uint32_t flag;
+} client_flags[] = {
+	{ "dlna", FLAG_DLNA },
+	{ "mime_avi_divx", FLAG_MIME_AVI_DIVX },
+	{ "mime_avi_avi", FLAG_MIME_AVI_AVI },
+	{ "mime_flac_flac", FLAG_MIME_FLAC_FLAC },
+	{ "mime_wav_wav", FLAG_MIME_WAV_WAV },
+	{ "resize_thumbs", FLAG_RESIZE_THUMBS },
+	{ "no_resize", FLAG_NO_RESIZE },
+	{ "ms_pfs", FLAG_MS_PFS },
+	{ "samsung", FLAG_SAMSUNG },
+	{ "samsung_dcm10", FLAG_SAMSUNG_DCM10 },
+	{ "audio_only", FLAG_AUDIO_ONLY },
+	{ "force_sort", FLAG_FORCE_SORT },
+	{ "caption_res", FLAG_CAPTION_RES },
+	{ NULL, 0 }
+};
 
-struct client_cache_s *
-SearchClientCache(struct in_addr addr, int quiet)
+static const struct {
+	const char *name;
+	enum match_types type;
+} client_match_keys[] = {
+	{ "user_agent", EUserAgent },
+	{ "x_av_client_info", EXAVClientInfo },
+	{ "friendly_name", EFriendlyName },
+	{ "model_name", EModelName },
+	{ "friendly_name_ssdp", EFriendlyNameSSDP },
+	{ NULL, 0 }
+};
+
+static int
+profile_check(struct client_type_s *profile, const char *path)
 {
-	int i;
+	if (!profile->name)
+		return 0;
+	if (!profile->match)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Client profile \"%s\" in %s has nothing to match, ignoring it\n",
+			profile->name, path);
+		return 0;
+	}
+	return 1;
+}
 
-	for (i = 0; i < CLIENT_CACHE_SLOTS; i++)
+/* Read the profiles in path: each starts with name=, followed by one match
+ * (user_agent=, x_av_client_info=, friendly_name=, model_name= or
+ * friendly_name_ssdp=), and optionally like= the name of the built-in client
+ * it behaves as (by default "Generic DLNA 1.5") and flags= a comma separated
+ * list replacing the flags of that client.  Profiles are tried before the
+ * built-in clients.  Must run before the client cache is used. */
+int
+LoadClientProfiles(const char *path)
+{
+	struct client_type_s *table, *profile = NULL;
+	char buf[512], *key, *value, *word, *saveptr;
+	int size, n = builtin_count, i, linenum = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Failed to open client profiles %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	size = builtin_count + 16;
+	table = calloc(size + 1, sizeof(struct client_type_s));
+	if (!table)
 	{
-		if (clients[i].addr.s_addr == addr.s_addr)
+		fclose(f);
+		return -1;
+	}
+	memcpy(table, builtin_client_types, builtin_count * sizeof(struct client_type_s));
+
+	while (fgets(buf, sizeof(buf), f))
+	{
+		linenum++;
+		key = buf;
+		while (isspace(*key))
+			key++;
+		if (*key == '#' || *key == '\0')
+			continue;
+		value = strchr(key, '=');
+		if (!value)
 		{
-			/* Invalidate this client cache if it's older than 1 hour */
-			if ((time(NULL) - clients[i].age) > 3600)
+			DPRINTF(E_ERROR, L_GENERAL, "Parsing error at %s:%d\n", path, linenum);
+			continue;
+		}
+		*value++ = '\0';
+		value[strcspn(value, "\r\n")] = '\0';
+
+		if (strcmp(key, "name") == 0)
+		{
+			if (profile && profile_check(profile, path))
+				n++;
+			if (n >= size)
+			{
+				struct client_type_s *bigger = realloc(table, (size * 2 + 1) * sizeof(struct client_type_s));
+				if (!bigger)
+					break;
+				table = bigger;
+				size *= 2;
+			}
+			profile = &table[n];
+			memset(profile, 0, sizeof(*profile));
+			profile->name = strdup(value);
+			for (i = 0; i < builtin_count; i++)
 			{
-				unsigned char mac[6];
-				if (get_remote_mac(addr, mac) == 0 &&
-				    memcmp(mac, clients[i].mac, 6) == 0)
+				if (builtin_client_types[i].type != EStandardDLNA150)
+					continue;
+				profile->type = builtin_client_types[i].type;
+				profile->flags = builtin_client_types[i].flags;
+				break;
+			}
+			continue;
+		}
+		if (!profile)
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "%s:%d: profiles must start with name=\n", path, linenum);
+			continue;
+		}
+		if (strcmp(key, "like") == 0)
+		{
+			for (i = 1; i < builtin_count; i++)
+			{
+				if (strcmp(builtin_client_types[i].name, value) != 0)
+					continue;
+				profile->type = builtin_client_types[i].type;
+				profile->flags = builtin_client_types[i].flags;
+				break;
+			}
+			if (i == builtin_count)
+				DPRINTF(E_ERROR, L_GENERAL, "%s:%d: unknown client \"%s\"\n", path, linenum, value);
+		}
+		else if (strcmp(key, "flags") == 0)
+		{
+			profile->flags = 0;
+			for (word = strtok_r(value, ", ", &saveptr); word; word = strtok_r(NULL, ", ", &saveptr))
+			{
+				for (i = 0; client_flags[i].name; i++)
 				{
-					/* Same MAC as last time when we were able to identify the client,
-					 * so extend the timeout by another hour. */
-					clients[i].age = time(NULL);
+					if (strcmp(client_flags[i].name, word) == 0)
+						break;
 				}
+				if (client_flags[i].name)
+					profile->flags |= client_flags[i].flag;
 				else
-				{
-					memset(&clients[i], 0, sizeof(struct client_cache_s));
-					return NULL;
-				}
+					DPRINTF(E_ERROR, L_GENERAL, "%s:%d: unknown flag \"%s\"\n", path, linenum, word);
 			}
-			if (!quiet)
-				DPRINTF(E_DEBUG, L_HTTP, "Client found in cache. [%s/entry %d]\n",
-					clients[i].type->name, i);
-			return &clients[i];
 		}
+		else
+		{
+			for (i = 0; client_match_keys[i].name; i++)
+			{
+				if (strcmp(client_match_keys[i].name, key) == 0)
+					break;
+			}
+			if (!client_match_keys[i].name || !*value)
+			{
+				DPRINTF(E_ERROR, L_GENERAL, "Parsing error at %s:%d\n", path, linenum);
+				continue;
+			}
+			free((char *)profile->match);
+			profile->match = strdup(value);
+			profile->match_type = client_match_keys[i].type;
+		}
+	}
+	fclose(f);
+	if (profile && profile_check(profile, path))
+		n++;
+
+	profile_count = n - builtin_count;
+	memset(&table[n], 0, sizeof(struct client_type_s));
+	client_types = table;
+	DPRINTF(E_INFO, L_GENERAL, "Loaded %d client profile%s from %s\n",
+		profile_count, profile_count == 1 ? "" : "s", path);
+
+	return 0;
+}
+
+/* Client detection runs a single pass over each header, through an
+ * Aho-Corasick automaton per match type built from the table.  When
+ * several entries match, the first one of the table wins, as it did with
+ * the strstr() loops it replaces; profiles come before all of them. */
+struct ac_node {
+	int child;		/* first child, -1 if none */
+	int sibling;		/* next child of the parent */
+	int fail;
+	int out;		/* best rank matching here, -1 if none */
+	unsigned char c;
+};
+
+struct ac_matcher {
+	struct ac_node *nodes;
+	int count;
+	int *index;		/* client_types index of each rank */
+	int ranks;
+};
+
+static struct ac_matcher matchers[EFriendlyNameSSDP + 1];
+
+static int
+ac_child(const struct ac_matcher *m, int state, unsigned char c)
+{
+	int n;
+
+	for (n = m->nodes[state].child; n >= 0; n = m->nodes[n].sibling)
+	{
+		if (m->nodes[n].c == c)
+			return n;
+	}
+
+	return -1;
+}
+
+static int
+ac_add(struct ac_matcher *m, const char *pattern, int rank)
+{
+	const unsigned char *p;
+	int state = 0, next;
+
+	for (p = (const unsigned char *)pattern; *p; p++)
+	{
+		next = ac_child(m, state, *p);
+		if (next < 0)
+		{
+			next = m->count++;
+			m->nodes[next].child = -1;
+			m->nodes[next].sibling = m->nodes[state].child;
+			m->nodes[next].fail = 0;
+			m->nodes[next].out = -1;
+			m->nodes[next].c = *p;
+			m->nodes[state].child = next;
+		}
+		state = next;
+	}
+	if (m->nodes[state].out < 0 || rank < m->nodes[state].out)
+		m->nodes[state].out = rank;
+
+	return 0;
+}
+
+static int
+ac_build(struct ac_matcher *m, enum match_types type)
+{
+	int i, rank, len = 1, head = 0, tail = 0;
+	int *queue;
+
+	for (i = 1; client_types[i].name; i++)
+	{
+		if (client_types[i].match_type == type)
+			len += strlen(client_types[i].match);
+	}
+	m->nodes = calloc(len, sizeof(struct ac_node));
+	m->index = calloc(len, sizeof(int));
+	queue = calloc(len, sizeof(int));
+	if (!m->nodes || !m->index || !queue)
+	{
+		free(queue);
+		return -1;
+	}
+	m->nodes[0].child = -1;
+	m->nodes[0].out = -1;
+	m->count = 1;
+
+	/* profiles first, then the built-in table in order */
+	rank = 0;
+	for (i = builtin_count; i < builtin_count + profile_count; i++)
+	{
+		if (client_types[i].match_type != type)
+			continue;
+		m->index[rank] = i;
+		ac_add(m, client_types[i].match, rank++);
+	}
+	for (i = 1; i < builtin_count; i++)
+	{
+		if (client_types[i].match_type != type)
+			continue;
+		m->index[rank] = i;
+		ac_add(m, client_types[i].match, rank++);
+	}
+	m->ranks = rank;
+
+	/* breadth first, so fail links always point to finished states */
+	for (i = m->nodes[0].child; i >= 0; i = m->nodes[i].sibling)
+		queue[tail++] = i;
+	while (head < tail)
+	{
+		int state = queue[head++], child, f;
+
+		for (child = m->nodes[state].child; child >= 0; child = m->nodes[child].sibling)
+		{
+			queue[tail++] = child;
+			f = m->nodes[state].fail;
+			while (f && ac_child(m, f, m->nodes[child].c) < 0)
+				f = m->nodes[f].fail;
+			f = ac_child(m, f, m->nodes[child].c);
+			m->nodes[child].fail = (f >= 0 && f != child) ? f : 0;
+			f = m->nodes[m->nodes[child].fail].out;
+			if (f >= 0 && (m->nodes[child].out < 0 || f < m->nodes[child].out))
+				m->nodes[child].out = f;
+		}
+	}
+	free(queue);
+
+	return 0;
+}
+
+int
+InitClientMatcher(void)
+{
+	int type;
+
+	for (type = EUserAgent; type <= EModelName; type++)
+	{
+		if (ac_build(&matchers[type], type) != 0)
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "Failed to build the client matcher\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Returns the client_types index of the best entry of type matching str,
+ * which ends at the first end character or NUL, or 0 if none does.
+ * EFriendlyNameSSDP entries must match str exactly. */
+int
+MatchClient(enum match_types type, const char *str, char end)
+{
+	const struct ac_matcher *m;
+	const unsigned char *p;
+	int state = 0, next, best = -1, i;
+
+	if (type == EFriendlyNameSSDP)
+	{
+		for (i = builtin_count; i < builtin_count + profile_count; i++)
+		{
+			if (client_types[i].match_type == type && strcmp(str, client_types[i].match) == 0)
+				return i;
+		}
+		for (i = 1; i < builtin_count; i++)
+		{
+			if (client_types[i].match_type == type && strcmp(str, client_types[i].match) == 0)
+				return i;
+		}
+		return 0;
+	}
+	if (type < EUserAgent || type > EModelName)
+		return 0;
+	m = &matchers[type];
+	if (!m->ranks)
+		return 0;
+
+	for (p = (const unsigned char *)str; *p && *p != (unsigned char)end; p++)
+	{
+		while ((next = ac_child(m, state, *p)) < 0 && state)
+			state = m->nodes[state].fail;
+		state = (next < 0) ? 0 : next;
+		if (m->nodes[state].out >= 0 && (best < 0 || m->nodes[state].out < best))
+		{
+			best = m->nodes[state].out;
+			if (best == 0)
+				break;
+		}
+	}
+
+	return (best < 0) ? 0 : m->index[best];
+}
+
+/* Clients are looked up on every HTTP request, so the cache is hashed by
+ * IP address.  When every slot is taken, the least recently seen client
+ * without an open connection makes room.  Entries stay at a fixed place,
+ * as connections keep pointers to them. */
+#define CLIENT_HASH_SIZE 128
+
+struct client_cache_s clients[CLIENT_CACHE_SLOTS];
+static struct client_cache_s *client_hash[CLIENT_HASH_SIZE];
+static unsigned long client_tick = 0;
+
+static inline unsigned int
+client_hash_key(struct in_addr addr)
+{
+	return (ntohl(addr.s_addr) * 2654435761u) >> 25;
+}
+
+static void
+client_unlink(struct client_cache_s *client)
+{
+	struct client_cache_s **c;
+
+	for (c = &client_hash[client_hash_key(client->addr)]; *c; c = &(*c)->next)
+	{
+		if (*c == client)
+		{
+			*c = client->next;
+			break;
+		}
+	}
+	memset(client, 0, sizeof(struct client_cache_s));
+}
+
+struct client_cache_s *
+SearchClientCache(struct in_addr addr, int quiet)
+{
+	struct client_cache_s *c;
+
+	for (c = client_hash[client_hash_key(addr)]; c; c = c->next)
+	{
+		if (c->addr.s_addr != addr.s_addr)
+			continue;
+		/* Invalidate this client cache if it's older than 1 hour */
+		if ((time(NULL) - c->age) > 3600)
+		{
+			unsigned char mac[6];
+			if (get_remote_mac(addr, mac) == 0 &&
+			    memcmp(mac, c->mac, 6) == 0)
+			{
+				/* Same MAC as last time when we were able to identify the client,
+				 * so extend the timeout by another hour. */
+				c->age = time(NULL);
+			}
+			else
+			{
+				client_unlink(c);
+				return NULL;
+			}
+		}
+		c->used = ++client_tick;
+		if (!quiet)
+			DPRINTF(E_DEBUG, L_HTTP, "Client found in cache. [%s/entry %d]\n",
+				c->type->name, (int)(c - clients));
+		return c;
 	}
 
 	return NULL;
@@ -305,23 +716,47 @@ SearchClientCache(struct in_addr addr, int quiet)
 struct client_cache_s *
 AddClientCache(struct in_addr addr, int type)
 {
+	struct client_cache_s *c = NULL;
+	unsigned int key;
 	int i;
 
 	for (i = 0; i < CLIENT_CACHE_SLOTS; i++)
 	{
-		if (clients[i].addr.s_addr)
-			continue;
-		get_remote_mac(addr, clients[i].mac);
-		clients[i].addr = addr;
-		clients[i].type = &client_types[type];
-		clients[i].age = time(NULL);
-		DPRINTF(E_DEBUG, L_HTTP, "Added client [%s/%s/%02X:%02X:%02X:%02X:%02X:%02X] to cache slot %d.\n",
-					client_types[type].name, inet_ntoa(clients[i].addr),
-					clients[i].mac[0], clients[i].mac[1], clients[i].mac[2],
-					clients[i].mac[3], clients[i].mac[4], clients[i].mac[5], i);
-		return &clients[i];
+		if (!clients[i].addr.s_addr)
+		{
+			c = &clients[i];
+			break;
+		}
+		if (clients[i].connections <= 0 && (!c || clients[i].used < c->used))
+			c = &clients[i];
 	}
-
-	return NULL;
+	if (!c)
+		return NULL;
+	if (c->addr.s_addr)
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Evicting client [%s/%s] from cache slot %d.\n",
+			c->type->name, inet_ntoa(c->addr), (int)(c - clients));
+		client_unlink(c);
+	}
+	get_remote_mac(addr, c->mac);
+	c->addr = addr;
+	c->type = &client_types[type];
+	c->age = time(NULL);
+	c->used = ++client_tick;
+	key = client_hash_key(addr);
+	c->next = client_hash[key];
+	client_hash[key] = c;
+	DPRINTF(E_DEBUG, L_HTTP, "Added client [%s/%s/%02X:%02X:%02X:%02X:%02X:%02X] to cache slot %d.\n",
+				client_types[type].name, inet_ntoa(c->addr),
+				c->mac[0], c->mac[1], c->mac[2],
+				c->mac[3], c->mac[4], c->mac[5], (int)(c - clients));
+
+	return c;
 }
 
+void
+ClearClientCache(void)
+{
+	memset(clients, 0, sizeof(clients));
+	memset(client_hash, 0, sizeof(client_hash));
+}
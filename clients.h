@@ -21,7 +21,7 @@
 #include <sys/time.h>
 #include <netinet/in.h>
 
-#define CLIENT_CACHE_SLOTS 25
+#define CLIENT_CACHE_SLOTS 512
 
 /* Client capability/quirk flags */
 #define FLAG_DLNA               0x00000001
@@ -83,6 +83,13 @@ struct transcode_list_format_s {
 	struct transcode_list_format_s * next;
 };
 
+/* What a transcoder declares in its ".profile" sidecar */
+struct transcode_profile_s {
+	char *mime;
+	char *dlna_pn;
+	int segments;          /* splits its output into cache segments itself */
+};
+
 struct transcode_info_s {
 	char *audio_transcoder;
 	char *video_transcoder;
@@ -91,6 +98,10 @@ struct transcode_info_s {
 	struct transcode_list_format_s *video_codecs;
 	struct transcode_list_format_s *video_containers;
 	struct transcode_list_format_s *image_formats;
+	/* read once at startup, NULL when a transcoder has no profile */
+	struct transcode_profile_s *audio_profile;
+	struct transcode_profile_s *video_profile;
+	struct transcode_profile_s *image_profile;
 };
 
 struct client_type_s {
@@ -108,12 +119,18 @@ struct client_cache_s {
 	struct client_type_s *type;
 	time_t age;
 	int connections;
+	struct client_cache_s *next;	/* hash chain */
+	unsigned long used;		/* for LRU eviction */
 };
 
-extern struct client_type_s client_types[];
+extern struct client_type_s *client_types;
 extern struct client_cache_s clients[CLIENT_CACHE_SLOTS];
 
 struct client_cache_s *SearchClientCache(struct in_addr addr, int quiet);
 struct client_cache_s *AddClientCache(struct in_addr addr, int type);
+void ClearClientCache(void);
+int LoadClientProfiles(const char *path);
+int InitClientMatcher(void);
+int MatchClient(enum match_types type, const char *str, char end);
 
 #endif
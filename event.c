@@ -0,0 +1,351 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+#include "event.h"
+#include "log.h"
+
+/* The main loop's reactor.  On Linux every socket and timer is registered
+ * with epoll once, timers being timerfds, so a wakeup only costs the events
+ * that fired.  Elsewhere the same interface is kept on top of select(),
+ * which rebuilds its sets from the registered events and runs the timers
+ * itself. */
+
+#ifdef USE_EPOLL
+
+#define EVENT_MAX 64
+#define EVENT_TIMERS 16
+
+static int epfd = -1;
+/* the timerfds, so that forked children can let go of them */
+static struct event *timers[EVENT_TIMERS];
+static int ntimers = 0;
+
+int
+event_init(void)
+{
+	epfd = epoll_create(EVENT_MAX);
+	if (epfd < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "epoll_create(): %s\n", strerror(errno));
+		return -1;
+	}
+	/* no use to the transcoders and other children that exec */
+	fcntl(epfd, F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+void
+event_fini(void)
+{
+	if (epfd >= 0)
+		close(epfd);
+	epfd = -1;
+}
+
+static int
+event_ctl(struct event *ev, int op)
+{
+	struct epoll_event e;
+
+	memset(&e, 0, sizeof(e));
+	e.events = (ev->rdwr == EVENT_READ) ? EPOLLIN : EPOLLOUT;
+	e.data.ptr = ev;
+
+	return epoll_ctl(epfd, op, ev->fd, &e);
+}
+
+int
+event_add(struct event *ev)
+{
+	ev->index = -1;
+	if (event_ctl(ev, EPOLL_CTL_ADD) != 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "epoll_ctl(add %d): %s\n", ev->fd, strerror(errno));
+		return -1;
+	}
+	ev->index = 0;
+
+	return 0;
+}
+
+int
+event_mod(struct event *ev, enum event_rdwr rdwr)
+{
+	ev->rdwr = rdwr;
+
+	return event_ctl(ev, EPOLL_CTL_MOD);
+}
+
+void
+event_del(struct event *ev)
+{
+	int i;
+
+	if (ev->index < 0)
+		return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, ev->fd, NULL);
+	ev->index = -1;
+	if (ev->interval)
+	{
+		for (i = 0; i < ntimers; i++)
+		{
+			if (timers[i] != ev)
+				continue;
+			timers[i] = timers[--ntimers];
+			break;
+		}
+		close(ev->fd);
+		ev->fd = -1;
+	}
+}
+
+/* A forked child shares the epoll instance and the timerfds with the main
+ * process; deleting its events from them would change the parent's set. */
+void
+event_fork_child(void)
+{
+	int i;
+
+	if (epfd >= 0)
+		close(epfd);
+	epfd = -1;
+	for (i = 0; i < ntimers; i++)
+	{
+		close(timers[i]->fd);
+		timers[i]->fd = -1;
+		timers[i]->index = -1;
+	}
+	ntimers = 0;
+}
+
+int
+event_timer_set(struct event *ev, int interval)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = interval;
+	its.it_interval.tv_sec = interval;
+	ev->interval = interval;
+
+	return timerfd_settime(ev->fd, 0, &its, NULL);
+}
+
+int
+event_timer_add(struct event *ev, int interval)
+{
+	/* an untracked timerfd would leak into every forked child */
+	if (ntimers >= EVENT_TIMERS)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Too many timers, at most %d are supported\n", EVENT_TIMERS);
+		ev->fd = -1;
+		ev->index = -1;
+		return -1;
+	}
+	ev->fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (ev->fd < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "timerfd_create(): %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(ev->fd, F_SETFL, O_NONBLOCK);
+	fcntl(ev->fd, F_SETFD, FD_CLOEXEC);
+	ev->rdwr = EVENT_READ;
+	if (event_timer_set(ev, interval) != 0 || event_add(ev) != 0)
+	{
+		close(ev->fd);
+		ev->fd = -1;
+		return -1;
+	}
+	timers[ntimers++] = ev;
+
+	return 0;
+}
+
+int
+event_process(void)
+{
+	struct epoll_event events[EVENT_MAX];
+	struct event *ev;
+	uint64_t expirations;
+	int n, i;
+
+	n = epoll_wait(epfd, events, EVENT_MAX, -1);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	for (i = 0; i < n; i++)
+	{
+		ev = events[i].data.ptr;
+		if (ev->interval && read(ev->fd, &expirations, sizeof(expirations)) < 0)
+			continue;
+		ev->process(ev);
+	}
+
+	return 0;
+}
+
+#else /* select() */
+
+static struct event *events[FD_SETSIZE];
+static int nevents = 0;
+
+int
+event_init(void)
+{
+	return 0;
+}
+
+void
+event_fini(void)
+{
+	nevents = 0;
+}
+
+int
+event_add(struct event *ev)
+{
+	if (nevents >= FD_SETSIZE || ev->fd >= FD_SETSIZE)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Too many open descriptors for select()\n");
+		ev->index = -1;
+		return -1;
+	}
+	ev->index = nevents;
+	events[nevents++] = ev;
+
+	return 0;
+}
+
+int
+event_mod(struct event *ev, enum event_rdwr rdwr)
+{
+	ev->rdwr = rdwr;
+
+	return 0;
+}
+
+void
+event_del(struct event *ev)
+{
+	if (ev->index < 0)
+		return;
+	/* the last event takes the free slot */
+	events[ev->index] = events[--nevents];
+	events[ev->index]->index = ev->index;
+	ev->index = -1;
+}
+
+/* Nothing is shared with children here */
+void
+event_fork_child(void)
+{
+}
+
+int
+event_timer_set(struct event *ev, int interval)
+{
+	ev->interval = interval;
+	ev->expires = time(NULL) + interval;
+
+	return 0;
+}
+
+int
+event_timer_add(struct event *ev, int interval)
+{
+	ev->fd = -1;
+	event_timer_set(ev, interval);
+
+	return event_add(ev);
+}
+
+int
+event_process(void)
+{
+	fd_set readset, writeset;
+	struct timeval timeout, *tv = NULL;
+	struct event *ev;
+	time_t now = time(NULL);
+	int max_fd = -1, n, i;
+
+	FD_ZERO(&readset);
+	FD_ZERO(&writeset);
+	for (i = 0; i < nevents; i++)
+	{
+		ev = events[i];
+		if (ev->interval)
+		{
+			if (!tv || ev->expires - now < timeout.tv_sec)
+			{
+				timeout.tv_sec = (ev->expires > now) ? ev->expires - now : 0;
+				timeout.tv_usec = 0;
+				tv = &timeout;
+			}
+			continue;
+		}
+		FD_SET(ev->fd, (ev->rdwr == EVENT_READ) ? &readset : &writeset);
+		if (ev->fd > max_fd)
+			max_fd = ev->fd;
+	}
+
+	n = select(max_fd + 1, &readset, &writeset, NULL, tv);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	/* walking backwards, an event deleting itself only moves one that
+	 * was already handled, and events added meanwhile wait for the next
+	 * round */
+	now = time(NULL);
+	for (i = nevents - 1; i >= 0; i--)
+	{
+		if (i >= nevents)
+			continue;
+		ev = events[i];
+		if (ev->interval)
+		{
+			if (ev->expires > now)
+				continue;
+			ev->expires = now + ev->interval;
+		}
+		else if (!FD_ISSET(ev->fd, (ev->rdwr == EVENT_READ) ? &readset : &writeset))
+			continue;
+		ev->process(ev);
+	}
+
+	return 0;
+}
+
+#endif
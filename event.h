@@ -0,0 +1,52 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include <time.h>
+
+enum event_rdwr {
+	EVENT_READ,
+	EVENT_WRITE
+};
+
+struct event;
+typedef void event_process_t(struct event *);
+
+/* A descriptor, or a periodic timer, watched by the main loop.  Events
+ * are registered once and stay registered until they are deleted. */
+struct event {
+	int fd;
+	enum event_rdwr rdwr;
+	event_process_t *process;
+	void *data;
+	int index;		/* registration slot, -1 when not registered */
+	int interval;		/* seconds between runs of a timer */
+	time_t expires;		/* next run of a timer without timerfd */
+};
+
+int event_init(void);
+void event_fini(void);
+int event_add(struct event *ev);
+int event_mod(struct event *ev, enum event_rdwr rdwr);
+void event_del(struct event *ev);
+void event_fork_child(void);
+int event_timer_add(struct event *ev, int interval);
+int event_timer_set(struct event *ev, int interval);
+int event_process(void);
+
+#endif
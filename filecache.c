@@ -0,0 +1,156 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "filecache.h"
+#include "log.h"
+
+/* Small LRU cache of the file details looked up for media requests, keyed
+ * by detail ID and client type.  The main loop fills it, while the inotify
+ * thread invalidates entries for removed files, hence the lock.  Entries
+ * also carry the file's mtime, so a file changed while inotify is disabled
+ * is looked up again instead of being served from stale details. */
+struct file_cache_entry_s {
+	struct dlna_file_s file;
+	unsigned long used;
+};
+
+static struct file_cache_entry_s *cache = NULL;
+static int cache_size = 0;
+static unsigned long cache_tick = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long file_cache_hits = 0;
+unsigned long file_cache_misses = 0;
+
+int
+file_cache_init(int size)
+{
+	if (size <= 0)
+		return 0;
+	cache = calloc(size, sizeof(struct file_cache_entry_s));
+	if (!cache)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Failed to allocate file cache of %d entries\n", size);
+		return -1;
+	}
+	cache_size = size;
+
+	return 0;
+}
+
+int
+file_cache_get(int64_t id, enum client_types client, struct dlna_file_s *file)
+{
+	struct stat st;
+	int i, ret = -1;
+
+	/* empty slots have id 0 */
+	if (!id || !cache_size)
+		return -1;
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < cache_size; i++)
+	{
+		if (cache[i].file.id != id || cache[i].file.client != client)
+			continue;
+		cache[i].used = ++cache_tick;
+		memcpy(file, &cache[i].file, sizeof(*file));
+		ret = 0;
+		break;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if (ret == 0 && (stat(file->path, &st) != 0 || st.st_mtime != file->mtime))
+	{
+		/* drop just this entry, unless it was replaced meanwhile */
+		pthread_mutex_lock(&cache_lock);
+		if (cache[i].file.id == id && cache[i].file.client == client &&
+		    cache[i].file.mtime == file->mtime)
+		{
+			cache[i].file.id = 0;
+			cache[i].used = 0;
+		}
+		pthread_mutex_unlock(&cache_lock);
+		ret = -1;
+	}
+	pthread_mutex_lock(&cache_lock);
+	if (ret == 0)
+		file_cache_hits++;
+	else
+		file_cache_misses++;
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+void
+file_cache_put(const struct dlna_file_s *file)
+{
+	struct file_cache_entry_s *victim = NULL;
+	struct stat st;
+	int i;
+
+	if (!cache_size || !file->id)
+		return;
+	if (stat(file->path, &st) != 0)
+		return;
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < cache_size; i++)
+	{
+		if (cache[i].file.id == file->id && cache[i].file.client == file->client)
+		{
+			victim = &cache[i];
+			break;
+		}
+		if (!victim || cache[i].used < victim->used)
+			victim = &cache[i];
+	}
+	memcpy(&victim->file, file, sizeof(*file));
+	victim->file.mtime = st.st_mtime;
+	victim->used = ++cache_tick;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* Drop all entries for a detail ID, or every entry if id is 0. */
+void
+file_cache_invalidate(int64_t id)
+{
+	int i;
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < cache_size; i++)
+	{
+		if (id && cache[i].file.id != id)
+			continue;
+		cache[i].file.id = 0;
+		cache[i].used = 0;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void
+file_cache_free(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	free(cache);
+	cache = NULL;
+	cache_size = 0;
+	pthread_mutex_unlock(&cache_lock);
+}
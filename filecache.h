@@ -0,0 +1,48 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __FILECACHE_H__
+#define __FILECACHE_H__
+
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include "clients.h"
+
+/* What SendResp_dlnafile needs to know about a media file for a client */
+struct dlna_file_s {
+	int64_t id;
+	enum client_types client;
+	char path[PATH_MAX];
+	char mime[32];
+	char dlna_pn[64];
+	char dlna[96];
+	int duration;
+	int transcode;		/* -1 while undecided */
+	time_t mtime;		/* of path when the entry was stored */
+	char *transcoder;
+};
+
+extern unsigned long file_cache_hits;
+extern unsigned long file_cache_misses;
+
+int file_cache_init(int size);
+int file_cache_get(int64_t id, enum client_types client, struct dlna_file_s *file);
+void file_cache_put(const struct dlna_file_s *file);
+void file_cache_invalidate(int64_t id);
+void file_cache_free(void);
+
+#endif
@@ -59,6 +59,7 @@
 #ifdef HAVE_NETLINK
 # include <linux/rtnetlink.h>
 # include <linux/netlink.h>
+# include <linux/neighbour.h>
 #endif
 #include "upnpglobalvars.h"
 #include "getifaddr.h"
@@ -269,6 +270,110 @@ getsyshwaddr(char *buf, int len)
 	return ret;
 }
 
+#ifdef HAVE_NETLINK
+/* A copy of the kernel's IPv4 neighbour table, filled by a dump when the
+ * monitor socket is opened and then kept current by its notifications, so
+ * that looking up a client's MAC does not mean reading /proc/net/arp. */
+#define NEIGH_HASH_SIZE 256
+
+struct neigh_s {
+	struct neigh_s *next;
+	struct in_addr addr;
+	unsigned char mac[6];
+};
+
+static struct neigh_s *neighs[NEIGH_HASH_SIZE];
+static int neigh_synced = 0;
+static int neigh_dumping = 0;	/* a dump was requested and is not done */
+static int neigh_lost = 0;	/* part of that dump did not fit the buffer */
+
+static inline unsigned int
+neigh_hash(struct in_addr addr)
+{
+	return (ntohl(addr.s_addr) * 2654435761u) >> 24;
+}
+
+static struct neigh_s **
+neigh_find(struct in_addr addr)
+{
+	struct neigh_s **n;
+
+	for (n = &neighs[neigh_hash(addr)]; *n; n = &(*n)->next)
+	{
+		if ((*n)->addr.s_addr == addr.s_addr)
+			break;
+	}
+
+	return n;
+}
+
+static void
+neigh_update(struct nlmsghdr *nlh)
+{
+	struct ndmsg *ndm = NLMSG_DATA(nlh);
+	struct rtattr *rta = (struct rtattr *)((char *)ndm + NLMSG_ALIGN(sizeof(struct ndmsg)));
+	int len = NLMSG_PAYLOAD(nlh, sizeof(struct ndmsg));
+	struct in_addr addr = { 0 };
+	unsigned char *mac = NULL;
+	struct neigh_s **n, *del;
+
+	if (ndm->ndm_family != AF_INET)
+		return;
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+	{
+		if (rta->rta_type == NDA_DST && RTA_PAYLOAD(rta) == sizeof(addr))
+			memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+		else if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == 6)
+			mac = RTA_DATA(rta);
+	}
+	if (!addr.s_addr)
+		return;
+
+	n = neigh_find(addr);
+	if (nlh->nlmsg_type == RTM_DELNEIGH || !mac ||
+	    (ndm->ndm_state & (NUD_FAILED | NUD_INCOMPLETE)))
+	{
+		if ((del = *n))
+		{
+			*n = del->next;
+			free(del);
+		}
+		return;
+	}
+	if (!*n)
+	{
+		*n = calloc(1, sizeof(struct neigh_s));
+		if (!*n)
+			return;
+		(*n)->addr = addr;
+	}
+	memcpy((*n)->mac, mac, 6);
+}
+
+static void
+neigh_request_dump(int s)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct ndmsg ndm;
+	} req;
+	struct sockaddr_nl kernel;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+	req.nlh.nlmsg_type = RTM_GETNEIGH;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.ndm.ndm_family = AF_INET;
+	memset(&kernel, 0, sizeof(kernel));
+	kernel.nl_family = AF_NETLINK;
+
+	if (sendto(s, &req, req.nlh.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0)
+		DPRINTF(E_WARN, L_GENERAL, "Failed to request the neighbour table: %s\n", strerror(errno));
+	else
+		neigh_dumping = 1;
+}
+#endif
+
 int
 get_remote_mac(struct in_addr ip_addr, unsigned char *mac)
 {
@@ -276,6 +381,16 @@ get_remote_mac(struct in_addr ip_addr, unsigned char *mac)
 	FILE * arp;
 	char remote_ip[16];
 	int matches, hwtype, flags;
+#ifdef HAVE_NETLINK
+	struct neigh_s *n;
+
+	/* a miss may still be a notification we have not read yet */
+	if (neigh_synced && (n = *neigh_find(ip_addr)))
+	{
+		memcpy(mac, n->mac, 6);
+		return 0;
+	}
+#endif
 	memset(mac, 0xFF, 6);
 
 	arp = fopen("/proc/net/arp", "r");
@@ -360,7 +475,7 @@ OpenAndConfMonitorSocket(void)
 
 	memset(&addr, 0, sizeof(addr));
 	addr.nl_family = AF_NETLINK;
-	addr.nl_groups = RTMGRP_IPV4_IFADDR;
+	addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_NEIGH;
 
 	ret = bind(s, (struct sockaddr*)&addr, sizeof(addr));
 	if (ret < 0)
@@ -369,6 +484,7 @@ OpenAndConfMonitorSocket(void)
 		close(s);
 		return -1;
 	}
+	neigh_request_dump(s);
 
 	return s;
 #else
@@ -381,15 +497,27 @@ ProcessMonitorEvent(int s)
 {
 #ifdef HAVE_NETLINK
 	int len;
-	char buf[4096];
+	/* the kernel builds dump messages of up to 32 KiB */
+	char buf[32768];
 	struct nlmsghdr *nlh;
 	int changed = 0;
 
 	nlh = (struct nlmsghdr*)buf;
 
-	len = recv(s, nlh, sizeof(buf), 0);
+	len = recv(s, nlh, sizeof(buf), MSG_TRUNC);
 	if (len <= 0)
 		return;
+	if (len > (int)sizeof(buf))
+	{
+		DPRINTF(E_WARN, L_GENERAL, "Truncated netlink message of %d bytes\n", len);
+		len = sizeof(buf);
+		/* neighbours may have been dropped; read the table again */
+		neigh_synced = 0;
+		if (neigh_dumping)
+			neigh_lost = 1;
+		else
+			neigh_request_dump(s);
+	}
 	while ((NLMSG_OK(nlh, len)) && (nlh->nlmsg_type != NLMSG_DONE))
 	{
 		if (nlh->nlmsg_type == RTM_NEWADDR ||
@@ -397,8 +525,25 @@ ProcessMonitorEvent(int s)
 		{
 			changed = 1;
 		}
+		else if (nlh->nlmsg_type == RTM_NEWNEIGH ||
+		         nlh->nlmsg_type == RTM_DELNEIGH)
+		{
+			neigh_update(nlh);
+		}
 		nlh = NLMSG_NEXT(nlh, len);
 	}
+	/* only the neighbour dump ends with NLMSG_DONE */
+	if (NLMSG_OK(nlh, len) && nlh->nlmsg_type == NLMSG_DONE)
+	{
+		neigh_dumping = 0;
+		if (neigh_lost)
+		{
+			neigh_lost = 0;
+			neigh_request_dump(s);
+		}
+		else
+			neigh_synced = 1;
+	}
 	if (changed)
 		reload_ifaces(0);
 #endif
@@ -55,35 +55,174 @@
 
 #define PATH_BUF_SIZE PATH_MAX
 
+/* Watches form a tree below the media_dirs, each storing only its name
+ * relative to the parent watch.  They are hashed by watch descriptor, for
+ * the events, and by parent and name, to find a path's watch component
+ * by component.  Both tables grow with the number of watches. */
 struct watch
 {
-	int wd;		/* watch descriptor */
-	char *path;	/* watched path */
+	int wd;			/* watch descriptor */
+	struct watch *parent;	/* NULL for a top level watch */
+	struct watch *child;	/* first subdirectory */
+	struct watch *prev;	/* siblings */
 	struct watch *next;
+	struct watch *wd_next;	/* hash chains */
+	struct watch *name_next;
+	uint32_t hash;		/* of parent and name */
+	char name[];		/* full path for a top level watch */
 };
 
-static struct watch *watches;
-static struct watch *lastwatch = NULL;
+static struct watch *top_watches;
+static struct watch **wd_hash;
+static struct watch **name_hash;
+static unsigned int hash_size;
+static unsigned int watch_count;
 static time_t next_pl_fill = 0;
 
-char *get_path_from_wd(int wd)
+static uint32_t
+watch_hash(const struct watch *parent, const char *name, size_t len)
 {
-	struct watch *w = watches;
+	uint32_t hash = 2166136261u;
 
-	while( w != NULL )
+	while (len--)
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+
+	return hash ^ (uint32_t)((uintptr_t)parent * 2654435761u);
+}
+
+static inline unsigned int
+wd_key(int wd)
+{
+	return ((unsigned int)wd * 2654435761u) & (hash_size - 1);
+}
+
+static void
+watch_rehash(void)
+{
+	struct watch **wds, **names, *w, *next;
+	unsigned int i, old_size = hash_size;
+	unsigned int size = old_size ? old_size * 2 : 256;
+
+	wds = calloc(size, sizeof(*wds));
+	names = calloc(size, sizeof(*names));
+	if (!wds || !names)
+	{
+		/* the old tables still work, with longer chains */
+		free(wds);
+		free(names);
+		return;
+	}
+	hash_size = size;
+	for (i = 0; i < old_size; i++)
+	{
+		for (w = wd_hash[i]; w; w = next)
+		{
+			next = w->wd_next;
+			w->wd_next = wds[wd_key(w->wd)];
+			wds[wd_key(w->wd)] = w;
+		}
+		for (w = name_hash[i]; w; w = next)
+		{
+			next = w->name_next;
+			w->name_next = names[w->hash & (size - 1)];
+			names[w->hash & (size - 1)] = w;
+		}
+	}
+	free(wd_hash);
+	free(name_hash);
+	wd_hash = wds;
+	name_hash = names;
+}
+
+static struct watch *
+find_wd(int wd)
+{
+	struct watch *w;
+
+	if (!hash_size)
+		return NULL;
+	for (w = wd_hash[wd_key(wd)]; w; w = w->wd_next)
+	{
+		if (w->wd == wd)
+			return w;
+	}
+
+	return NULL;
+}
+
+static struct watch *
+find_child(const struct watch *parent, const char *name, size_t len)
+{
+	struct watch *w;
+	uint32_t hash;
+
+	if (!hash_size)
+		return NULL;
+	hash = watch_hash(parent, name, len);
+	for (w = name_hash[hash & (hash_size - 1)]; w; w = w->name_next)
 	{
-		if( w->wd == wd )
-			return w->path;
-		w = w->next;
+		if (w->hash == hash && w->parent == parent &&
+		    strncmp(w->name, name, len) == 0 && w->name[len] == '\0')
+			return w;
 	}
 
 	return NULL;
 }
 
+static struct watch *
+find_path(const char *path)
+{
+	struct watch *top, *w;
+	const char *p;
+	size_t len;
+
+	for (top = top_watches; top; top = top->next)
+	{
+		len = strlen(top->name);
+		if (strncmp(path, top->name, len) != 0 ||
+		    (path[len] != '/' && path[len] != '\0'))
+			continue;
+		w = top;
+		for (p = path + len; w && *p; p += len)
+		{
+			while (*p == '/')
+				p++;
+			len = strcspn(p, "/");
+			if (len)
+				w = find_child(w, p, len);
+		}
+		if (w)
+			return w;
+	}
+
+	return NULL;
+}
+
+/* Builds the full path of a watch into buf */
+static int
+watch_path(const struct watch *w, char *buf, size_t size)
+{
+	int len = 0;
+
+	if (w->parent)
+	{
+		len = watch_path(w->parent, buf, size);
+		if (len < 0)
+			return len;
+		len += snprintf(buf + len, size - len, "/%s", w->name);
+	}
+	else
+		len = snprintf(buf, size, "%s", w->name);
+
+	return (len < (int)size) ? len : -1;
+}
+
 int
 add_watch(int fd, const char * path)
 {
-	struct watch *nw;
+	struct watch *nw, *parent, **list;
+	const char *name = path;
+	char *dir;
 	int wd;
 
 	wd = inotify_add_watch(fd, path, IN_CREATE|IN_CLOSE_WRITE|IN_DELETE|IN_MOVE);
@@ -92,29 +231,91 @@ add_watch(int fd, const char * path)
 		DPRINTF(E_ERROR, L_INOTIFY, "inotify_add_watch(%s) [%s]\n", path, strerror(errno));
 		return -1;
 	}
+	/* the same directory reached again, e.g. through a symlink */
+	if( find_wd(wd) )
+		return wd;
+
+	/* directories are watched parents first, so the parent is known
+	 * unless this is a media_dir */
+	dir = strdup(path);
+	parent = dir ? find_path(dirname(dir)) : NULL;
+	free(dir);
+	if( parent )
+		name = strrchr(path, '/') + 1;
 
-	nw = malloc(sizeof(struct watch));
+	nw = malloc(sizeof(struct watch) + strlen(name) + 1);
 	if( nw == NULL )
 	{
 		DPRINTF(E_ERROR, L_INOTIFY, "malloc() error\n");
+		inotify_rm_watch(fd, wd);
 		return -1;
 	}
+	strcpy(nw->name, name);
 	nw->wd = wd;
-	nw->next = NULL;
-	nw->path = strdup(path);
+	nw->parent = parent;
+	nw->child = NULL;
+	nw->hash = watch_hash(parent, nw->name, strlen(nw->name));
+
+	list = parent ? &parent->child : &top_watches;
+	nw->prev = NULL;
+	nw->next = *list;
+	if( *list )
+		(*list)->prev = nw;
+	*list = nw;
+
+	if( watch_count >= hash_size )
+		watch_rehash();
+	nw->wd_next = wd_hash[wd_key(wd)];
+	wd_hash[wd_key(wd)] = nw;
+	nw->name_next = name_hash[nw->hash & (hash_size - 1)];
+	name_hash[nw->hash & (hash_size - 1)] = nw;
+	watch_count++;
+
+	return wd;
+}
+
+/* Forgets a watch and everything below it.  The kernel watches are
+ * removed too, except that of w itself when the kernel already dropped
+ * it (IN_IGNORED); fd < 0 leaves all of them alone. */
+static int
+free_watch(int fd, struct watch *w, int ignored)
+{
+	struct watch **c;
+	int freed = 1;
 
-	if( watches == NULL )
+	while( w->child )
+		freed += free_watch(fd, w->child, 0);
+	if( fd >= 0 && !ignored )
+		inotify_rm_watch(fd, w->wd);
+
+	for( c = &wd_hash[wd_key(w->wd)]; *c; c = &(*c)->wd_next )
 	{
-		watches = nw;
+		if( *c == w )
+		{
+			*c = w->wd_next;
+			break;
+		}
 	}
-
-	if( lastwatch != NULL )
+	for( c = &name_hash[w->hash & (hash_size - 1)]; *c; c = &(*c)->name_next )
 	{
-		lastwatch->next = nw;
+		if( *c == w )
+		{
+			*c = w->name_next;
+			break;
+		}
 	}
-	lastwatch = nw;
+	if( w->prev )
+		w->prev->next = w->next;
+	else if( w->parent )
+		w->parent->child = w->next;
+	else
+		top_watches = w->next;
+	if( w->next )
+		w->next->prev = w->prev;
+	watch_count--;
+	free(w);
 
-	return wd;
+	return freed;
 }
 
 int
@@ -122,13 +323,12 @@ remove_watch(int fd, const char * path)
 {
 	struct watch *w;
 
-	for( w = watches; w; w = w->next )
-	{
-		if( strcmp(path, w->path) == 0 )
-			return(inotify_rm_watch(fd, w->wd));
-	}
+	w = find_path(path);
+	if( !w )
+		return 1;
+	free_watch(fd, w, 0);
 
-	return 1;
+	return 0;
 }
 
 unsigned int
@@ -157,7 +357,7 @@ inotify_create_watches(int fd)
 		add_watch(fd, media_path->path);
 		num_watches++;
 	}
-	sql_get_table(db, "SELECT PATH from DETAILS where MIME is NULL and PATH is not NULL", &result, &rows, NULL);
+	sql_get_table(db, "SELECT PATH from DETAILS where MIME is NULL and PATH is not NULL order by ID", &result, &rows, NULL);
 	for( i=1; i <= rows; i++ )
 	{
 		DPRINTF(E_DEBUG, L_INOTIFY, "Add watch to %s\n", result[i]);
@@ -208,22 +408,17 @@ inotify_create_watches(int fd)
 	return rows;
 }
 
-int 
+int
 inotify_remove_watches(int fd)
 {
-	struct watch *w = watches;
-	struct watch *last_w;
 	int rm_watches = 0;
 
-	while( w )
-	{
-		last_w = w;
-		inotify_rm_watch(fd, w->wd);
-		free(w->path);
-		rm_watches++;
-		w = w->next;
-		free(last_w);
-	}
+	while( top_watches )
+		rm_watches += free_watch(fd, top_watches, 0);
+	free(wd_hash);
+	free(name_hash);
+	wd_hash = name_hash = NULL;
+	hash_size = 0;
 
 	return rm_watches;
 }
@@ -357,18 +552,18 @@ inotify_insert_file(char * name, const char * path)
 	if( stat(path, &st) != 0 )
 		return -1;
 
-	ts = sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = '%q'", path);
+	ts = sql_get_int_param(db, "SELECT TIMESTAMP from DETAILS where PATH = ?", "s", path);
 	if( !ts && is_playlist(path) && (sql_get_int_field(db, "SELECT ID from PLAYLISTS where PATH = '%q'", path) > 0) )
 	{
 		DPRINTF(E_DEBUG, L_INOTIFY, "Re-reading modified playlist (%s).\n", path);
-		inotify_remove_file(path);
+		remove_file(path);
 		next_pl_fill = 1;
 	}
 	else if( ts < st.st_mtime )
 	{
 		if( ts > 0 )
 			DPRINTF(E_DEBUG, L_INOTIFY, "%s is newer than the last db entry.\n", path);
-		inotify_remove_file(path);
+		remove_file(path);
 	}
 
 	/* Find the parentID.  If it's not found, create all necessary parents. */
@@ -451,7 +646,7 @@ inotify_insert_directory(int fd, char *name, const char * path)
 		DPRINTF(E_WARN, L_INOTIFY, "Could not access %s [%s]\n", path, strerror(errno));
 		return -1;
 	}
-	if( sql_get_int_field(db, "SELECT ID from DETAILS where PATH = '%q'", path) > 0 )
+	if( sql_get_int_param(db, "SELECT ID from DETAILS where PATH = ?", "s", path) > 0 )
 	{
 		DPRINTF(E_DEBUG, L_INOTIFY, "%s already exists\n", path);
 		return 0;
@@ -527,116 +722,11 @@ inotify_insert_directory(int fd, char *name, const char * path)
 	return 0;
 }
 
-int
-inotify_remove_file(const char * path)
-{
-	char sql[128];
-	char art_cache[PATH_MAX];
-	char *id;
-	char *ptr;
-	char **result;
-	int64_t detailID;
-	int rows, playlist;
-
-	if( is_caption(path) )
-	{
-		return sql_exec(db, "DELETE from CAPTIONS where PATH = '%q'", path);
-	}
-	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
-	valid_cache = 0;
-	playlist = is_playlist(path);
-	id = sql_get_text_field(db, "SELECT ID from %s where PATH = '%q'", playlist?"PLAYLISTS":"DETAILS", path);
-	if( !id )
-		return 1;
-	detailID = strtoll(id, NULL, 10);
-	sqlite3_free(id);
-	if( playlist )
-	{
-		sql_exec(db, "DELETE from PLAYLISTS where ID = %lld", detailID);
-		sql_exec(db, "DELETE from DETAILS where ID ="
-		             " (SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s$%llX')",
-		         MUSIC_PLIST_ID, detailID);
-		sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s$%llX' or PARENT_ID = '%s$%llX'",
-		         MUSIC_PLIST_ID, detailID, MUSIC_PLIST_ID, detailID);
-	}
-	else
-	{
-		/* Delete the parent containers if we are about to empty them. */
-		snprintf(sql, sizeof(sql), "SELECT PARENT_ID from OBJECTS where DETAIL_ID = %lld"
-		                           " and PARENT_ID not like '64$%%'",
-		                           (long long int)detailID);
-		if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
-		{
-			int i, children;
-			for( i = 1; i <= rows; i++ )
-			{
-				/* If it's a playlist item, adjust the item count of the playlist */
-				if( strncmp(result[i], MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 )
-				{
-					sql_exec(db, "UPDATE PLAYLISTS set FOUND = (FOUND-1) where ID = %d",
-					         atoi(strrchr(result[i], '$') + 1));
-				}
-
-				children = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]);
-				if( children < 0 )
-					continue;
-				if( children < 2 )
-				{
-					sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
-
-					ptr = strrchr(result[i], '$');
-					if( ptr )
-						*ptr = '\0';
-					if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]) == 0 )
-					{
-						sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
-					}
-				}
-			}
-			sqlite3_free_table(result);
-		}
-		/* Now delete the actual objects */
-		sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
-		sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
-	}
-	snprintf(art_cache, sizeof(art_cache), "%s/art_cache%s", db_path, path);
-	remove(art_cache);
-
-	return 0;
-}
-
 int
 inotify_remove_directory(int fd, const char * path)
 {
-	char * sql;
-	char **result;
-	int64_t detailID = 0;
-	int rows, i, ret = 1;
-
-	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
-	valid_cache = 0;
 	remove_watch(fd, path);
-	sql = sqlite3_mprintf("SELECT ID from DETAILS where (PATH > '%q/' and PATH <= '%q/%c')"
-	                      " or PATH = '%q'", path, path, 0xFF, path);
-	if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
-	{
-		if( rows )
-		{
-			for( i=1; i <= rows; i++ )
-			{
-				detailID = strtoll(result[i], NULL, 10);
-				sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
-				sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
-			}
-			ret = 0;
-		}
-		sqlite3_free_table(result);
-	}
-	sqlite3_free(sql);
-	/* Clean up any album art entries in the deleted directory */
-	sql_exec(db, "DELETE from ALBUM_ART where (PATH > '%q/' and PATH <= '%q/%c')", path, path, 0xFF);
-
-	return ret;
+	return remove_directory(path);
 }
 
 void *
@@ -697,15 +787,24 @@ start_inotify()
 		while( i < length )
 		{
 			struct inotify_event * event = (struct inotify_event *) &buffer[i];
-			if( event->len )
+			struct watch *w = find_wd(event->wd);
+			if( event->mask & IN_IGNORED )
+			{
+				/* the directory is gone, or its watch was removed by us
+				 * and freed already */
+				if( w )
+					free_watch(pollfds[0].fd, w, 1);
+			}
+			else if( event->len && w )
 			{
-				if( *(event->name) == '.' )
+				if( *(event->name) == '.' ||
+				    watch_path(w, path_buf, sizeof(path_buf)) < 0 )
 				{
 					i += EVENT_SIZE + event->len;
 					continue;
 				}
 				esc_name = modifyString(strdup(event->name), "&", "&amp;amp;", 0);
-				snprintf(path_buf, sizeof(path_buf), "%s/%s", get_path_from_wd(event->wd), event->name);
+				snprintf(path_buf + strlen(path_buf), sizeof(path_buf) - strlen(path_buf), "/%s", event->name);
 				if ( event->mask & IN_ISDIR && (event->mask & (IN_CREATE|IN_MOVED_TO)) )
 				{
 					DPRINTF(E_DEBUG, L_INOTIFY,  "The directory %s was %s.\n",
@@ -727,7 +826,7 @@ start_inotify()
 					else if( event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO) && st.st_size > 0 )
 					{
 						if( (event->mask & IN_MOVED_TO) ||
-						    (sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = '%q'", path_buf) != st.st_mtime) )
+						    (sql_get_int_param(db, "SELECT TIMESTAMP from DETAILS where PATH = ?", "s", path_buf) != st.st_mtime) )
 						{
 							DPRINTF(E_DEBUG, L_INOTIFY, "The file %s was %s.\n",
 								path_buf, (event->mask & IN_MOVED_TO ? "moved here" : "changed"));
@@ -743,7 +842,7 @@ start_inotify()
 					if ( event->mask & IN_ISDIR )
 						inotify_remove_directory(pollfds[0].fd, path_buf);
 					else
-						inotify_remove_file(path_buf);
+						remove_file(path_buf);
 				}
 				free(esc_name);
 			}
@@ -180,3 +180,14 @@ lav_is_thumbnail_stream(AVStream *s, uint8_t **data, int *size)
 #endif
 	return 0;
 }
+
+static inline const char *
+lav_codec_name(AVCodecContext *c)
+{
+	AVCodec *codec;
+
+	if (!c)
+		return NULL;
+	codec = avcodec_find_decoder(c->codec_id);
+	return codec ? codec->name : NULL;
+}
@@ -44,6 +44,7 @@
 #include "metadata.h"
 #include "albumart.h"
 #include "dlnameta.h"
+#include "transcode.h"
 #include "utils.h"
 #include "sql.h"
 #include "log.h"
@@ -210,22 +211,22 @@ GetFolderMetadata(const char *name, const char *path, const char *artist, const
 	return ret;
 }
 
-int64_t
-GetAudioMetadata(const char *path, char *name)
+int
+ReadAudioMetadata(const char *path, char *name, struct media_details *d)
 {
 	char type[4];
-	static char lang[6] = { '\0' };
+	char lang[6];
 	struct stat file;
-	int64_t ret;
 	char *esc_tag;
 	int i;
 	int fd;
-	int64_t album_art = 0;
 	struct song_metadata song;
 	struct dlna_meta_s dlna_metadata;
+	char *container = NULL, *video_codec = NULL, *audio_codec = NULL;
 	metadata_t m;
 	uint32_t free_flags = FLAG_DURATION|FLAG_DATE;
 	memset(&m, '\0', sizeof(metadata_t));
+	memset(d, '\0', sizeof(*d));
 
 	if ( stat(path, &file) != 0 )
 	{
@@ -273,13 +274,10 @@ GetAudioMetadata(const char *path, char *name)
 		return 0;
 	}
 
-	if( !(*lang) )
-	{
-		if( !getenv("LANG") )
-			strcpy(lang, "en_US");
-		else
-			strncpyt(lang, getenv("LANG"), sizeof(lang));
-	}
+	if( !getenv("LANG") )
+		strcpy(lang, "en_US");
+	else
+		strncpyt(lang, getenv("LANG"), sizeof(lang));
 
 	if( readtags((char *)path, &song, &file, lang, type) != 0 )
 	{
@@ -380,8 +378,6 @@ GetAudioMetadata(const char *path, char *name)
 		}
 	}
 
-	album_art = find_album_art(path, song.image, song.image_size);
-
 	fd = open(path, O_RDONLY);
 	if ( fd < 0 )
 	{
@@ -390,36 +386,43 @@ GetAudioMetadata(const char *path, char *name)
 		free_metadata(&m, free_flags);
 		return 0;
 	}
+	d->album_art = find_album_art_file(path, song.image, song.image_size);
 	dlna_metadata = get_dlna_metadata_audio(fd);
 	close(fd);
 
-	ret = sql_exec(db, "INSERT into DETAILS"
+	/* Only pay for a demuxer probe when some client has audio codecs to transcode */
+	if( transcode_enabled('a') )
+		transcode_probe(path, &container, &video_codec, &audio_codec);
+
+	d->sql = sqlite3_mprintf("INSERT into DETAILS"
 	                   " (PATH, SIZE, TIMESTAMP, DURATION, CHANNELS, BITRATE, SAMPLERATE, DATE,"
-	                   "  TITLE, CREATOR, ARTIST, ALBUM, GENRE, COMMENT, DISC, TRACK, DLNA_PN, MIME, ALBUM_ART) "
+	                   "  TITLE, CREATOR, ARTIST, ALBUM, GENRE, COMMENT, DISC, TRACK, DLNA_PN, MIME, ALBUM_ART,"
+	                   "  CONTAINER, VIDEO_CODEC, AUDIO_CODEC) "
 	                   "VALUES"
-	                   " (%Q, %lld, %lld, '%s', %d, %d, %d, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %d, %d, %Q, '%s', %lld);",
+	                   " (%Q, %lld, %lld, '%s', %d, %d, %d, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %d, %d, %Q, '%s', ?,"
+	                   "  %Q, %Q, %Q);",
 	                   path, (long long)file.st_size, (long long)file.st_mtime, m.duration, song.channels, song.bitrate,
 	                   song.samplerate, m.date, m.title, m.creator, m.artist, m.album, m.genre, m.comment, song.disc,
-	                   song.track, dlna_metadata.dlna_pn, dlna_metadata.mime, album_art);
-	if( ret != SQLITE_OK )
-	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
-		ret = 0;
-	}
-	else
-	{
-		ret = sqlite3_last_insert_rowid(db);
-	}
+	                   song.track, dlna_metadata.dlna_pn, dlna_metadata.mime,
+	                   container, video_codec, audio_codec);
 
 	freetags(&song);
 	free_metadata(&m, free_flags);
 	free_dlna_metadata(&dlna_metadata);
+	free(container);
+	free(video_codec);
+	free(audio_codec);
 
-	return ret;
+	if( !d->sql )
+	{
+		free_media_details(d);
+		return 0;
+	}
+	return 1;
 }
 
-int64_t
-GetImageMetadata(const char *path, char *name)
+int
+ReadImageMetadata(const char *path, char *name, struct media_details *d)
 {
 	ExifData *ed;
 	ExifEntry *e = NULL;
@@ -431,12 +434,12 @@ GetImageMetadata(const char *path, char *name)
 	MagickWand *magick_wand;
 	char *format;
 	int fd;
-	int64_t ret;
 	image_s *imsrc;
 	metadata_t m;
 	struct dlna_meta_s dlna_metadata;
 	uint32_t free_flags = 0xFFFFFFFF;
 	memset(&m, '\0', sizeof(metadata_t));
+	memset(d, '\0', sizeof(*d));
 
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, "Parsing %s...\n", path);
 	if ( stat(path, &file) != 0 )
@@ -563,39 +566,29 @@ no_exifdata:
 	close(fd);
 	free(format);
 
-	ret = sql_exec(db, "INSERT into DETAILS"
+	d->sql = sqlite3_mprintf("INSERT into DETAILS"
 	                   " (PATH, TITLE, SIZE, TIMESTAMP, DATE, RESOLUTION,"
 	                    " ROTATION, THUMBNAIL, CREATOR, DLNA_PN, MIME) "
 	                   "VALUES"
 	                   " (%Q, '%q', %lld, %lld, %Q, %Q, %u, %d, %Q, %Q, %Q);",
 	                   path, name, (long long)file.st_size, (long long)file.st_mtime, m.date,
 	                   m.resolution, m.rotation, thumb, m.creator, dlna_metadata.dlna_pn, dlna_metadata.mime);
-	if( ret != SQLITE_OK )
-	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
-		ret = 0;
-	}
-	else
-	{
-		ret = sqlite3_last_insert_rowid(db);
-	}
 	free_metadata(&m, free_flags);
 	free_dlna_metadata(&dlna_metadata);
 
-	return ret;
+	return d->sql != NULL;
 }
 
-int64_t
-GetVideoMetadata(const char *path, char *name)
+int
+ReadVideoMetadata(const char *path, char *name, struct media_details *d)
 {
 	struct stat file;
+	struct tm modtime;
 	int ret, i;
-	struct tm *modtime;
 	AVFormatContext *ctx = NULL;
 	AVCodecContext *ac = NULL, *vc = NULL;
 	int audio_stream = -1, video_stream = -1;
 	char fourcc[4];
-	int64_t album_art = 0;
 	char nfo[MAXPATHLEN], *ext;
 	struct song_metadata video;
 	metadata_t m;
@@ -604,6 +597,7 @@ GetVideoMetadata(const char *path, char *name)
 
 	memset(&m, '\0', sizeof(m));
 	memset(&video, '\0', sizeof(video));
+	memset(d, '\0', sizeof(*d));
 
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, "Parsing video %s...\n", name);
 	if (stat(path, &file) != 0 ) {
@@ -761,39 +755,120 @@ GetVideoMetadata(const char *path, char *name)
 	if( !m.date )
 	{
 		m.date = malloc(20);
-		modtime = localtime(&file.st_mtime);
-		strftime(m.date, 20, "%FT%T", modtime);
+		localtime_r(&file.st_mtime, &modtime);
+		strftime(m.date, 20, "%FT%T", &modtime);
 	}
 
 	if( !m.title )
 		m.title = strdup(name);
 
-	album_art = find_album_art(path, m.thumb_data, m.thumb_size);
+	d->album_art = find_album_art_file(path, m.thumb_data, m.thumb_size);
+	d->captions = 1;
 	freetags(&video);
-	lav_close(ctx);
 
-	ret = sql_exec(db, "INSERT into DETAILS"
+	d->sql = sqlite3_mprintf("INSERT into DETAILS"
 	                   " (PATH, SIZE, TIMESTAMP, DURATION, DATE, CHANNELS, BITRATE, SAMPLERATE, RESOLUTION,"
-	                   "  TITLE, CREATOR, ARTIST, GENRE, COMMENT, DLNA_PN, MIME, ALBUM_ART) "
+	                   "  TITLE, CREATOR, ARTIST, GENRE, COMMENT, DLNA_PN, MIME, ALBUM_ART,"
+	                   "  CONTAINER, VIDEO_CODEC, AUDIO_CODEC) "
 	                   "VALUES"
-	                   " (%Q, %lld, %lld, %Q, %Q, %u, %u, %u, %Q, '%q', %Q, %Q, %Q, %Q, %Q, '%q', %lld);",
+	                   " (%Q, %lld, %lld, %Q, %Q, %u, %u, %u, %Q, '%q', %Q, %Q, %Q, %Q, %Q, '%q', ?,"
+	                   "  %Q, %Q, %Q);",
 	                   path, (long long)file.st_size, (long long)file.st_mtime, m.duration,
 	                   m.date, m.channels, m.bitrate, m.frequency, m.resolution,
 	                   m.title, m.creator, m.artist, m.genre, m.comment, dlna_metadata.dlna_pn,
-	                   dlna_metadata.mime, album_art);
-	if( ret != SQLITE_OK )
+	                   dlna_metadata.mime,
+	                   ctx->iformat->name, lav_codec_name(vc), lav_codec_name(ac));
+	lav_close(ctx);
+	free_metadata(&m, free_flags);
+	free_dlna_metadata(&dlna_metadata);
+	free(path_cpy);
+
+	if( !d->sql )
 	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
-		ret = 0;
+		free_media_details(d);
+		return 0;
 	}
-	else
+	return 1;
+}
+
+/* Writes what one of the Read*Metadata() functions found, along with its
+ * album art and captions, and returns the new DETAILS ID */
+int64_t
+StoreMetadata(const char *path, struct media_details *d)
+{
+	sqlite3_stmt *stmt;
+	int64_t album_art = 0;
+	int64_t ret = 0;
+
+	if( d->album_art )
+		album_art = get_album_art_id(d->album_art);
+
+	if( sqlite3_prepare_v2(db, d->sql, -1, &stmt, NULL) != SQLITE_OK )
 	{
+		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'! [%s]\n", path, sqlite3_errmsg(db));
+		return 0;
+	}
+	if( sqlite3_bind_parameter_count(stmt) )
+		sqlite3_bind_int64(stmt, 1, album_art);
+	if( sqlite3_step(stmt) == SQLITE_DONE )
 		ret = sqlite3_last_insert_rowid(db);
+	else
+		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
+	sqlite3_finalize(stmt);
+
+	if( ret && d->captions )
 		check_for_captions(path, ret);
-	}
-	free_metadata(&m, free_flags);
-	free_dlna_metadata(&dlna_metadata);
-	free(path_cpy);
+
+	return ret;
+}
+
+void
+free_media_details(struct media_details *d)
+{
+	sqlite3_free(d->sql);
+	free(d->album_art);
+	d->sql = NULL;
+	d->album_art = NULL;
+}
+
+int64_t
+GetAudioMetadata(const char *path, char *name)
+{
+	struct media_details d;
+	int64_t ret;
+
+	if( !ReadAudioMetadata(path, name, &d) )
+		return 0;
+	ret = StoreMetadata(path, &d);
+	free_media_details(&d);
+
+	return ret;
+}
+
+int64_t
+GetImageMetadata(const char *path, char *name)
+{
+	struct media_details d;
+	int64_t ret;
+
+	if( !ReadImageMetadata(path, name, &d) )
+		return 0;
+	ret = StoreMetadata(path, &d);
+	free_media_details(&d);
+
+	return ret;
+}
+
+int64_t
+GetVideoMetadata(const char *path, char *name)
+{
+	struct media_details d;
+	int64_t ret;
+
+	if( !ReadVideoMetadata(path, name, &d) )
+		return 0;
+	ret = StoreMetadata(path, &d);
+	free_media_details(&d);
 
 	return ret;
 }
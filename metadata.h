@@ -82,6 +82,14 @@ typedef enum {
 	VALID
 } ts_timestamp_t;
 
+/* What a scanner worker found about a file, for StoreMetadata() to write
+ * from the database thread */
+struct media_details {
+	char *sql;		/* INSERT into DETAILS, with ALBUM_ART as ? if any */
+	char *album_art;	/* cached art file, or NULL */
+	int captions;		/* look for subtitles once we have the ID */
+};
+
 int
 ends_with(const char *haystack, const char *needle);
 
@@ -100,4 +108,19 @@ GetImageMetadata(const char *path, char *name);
 int64_t
 GetVideoMetadata(const char *path, char *name);
 
+int
+ReadAudioMetadata(const char *path, char *name, struct media_details *d);
+
+int
+ReadImageMetadata(const char *path, char *name, struct media_details *d);
+
+int
+ReadVideoMetadata(const char *path, char *name, struct media_details *d);
+
+int64_t
+StoreMetadata(const char *path, struct media_details *d);
+
+void
+free_media_details(struct media_details *d);
+
 #endif
@@ -96,6 +96,14 @@
 #include "tivo_beacon.h"
 #include "tivo_utils.h"
 #include "clients.h"
+#include "transcode.h"
+#include "filecache.h"
+#include "soapcache.h"
+#include "transcodesession.h"
+#include "transcodecache.h"
+#include "pretranscode.h"
+#include "stream.h"
+#include "event.h"
 
 #if SQLITE_VERSION_NUMBER < 3005001
 # warning "Your SQLite3 library appears to be too old!  Please use 3.5.1 or newer."
@@ -111,9 +119,6 @@ OpenAndConfHTTPSocket(unsigned short port)
 	int i = 1;
 	struct sockaddr_in listenname;
 
-	/* Initialize client type cache */
-	memset(&clients, 0, sizeof(struct client_cache_s));
-
 	s = socket(PF_INET, SOCK_STREAM, 0);
 	if (s < 0)
 	{
@@ -164,7 +169,7 @@ sigusr1(int sig)
 	signal(sig, sigusr1);
 	DPRINTF(E_WARN, L_GENERAL, "received signal %d, clear cache\n", sig);
 
-	memset(&clients, '\0', sizeof(clients));
+	ClearClientCache();
 }
 
 static void
@@ -344,6 +349,7 @@ static int
 open_db(sqlite3 **sq3)
 {
 	char path[PATH_MAX];
+	char *mode;
 	int new_db = 0;
 
 	snprintf(path, sizeof(path), "%s/files.db", db_path);
@@ -358,8 +364,19 @@ open_db(sqlite3 **sq3)
 		*sq3 = db;
 	sqlite3_busy_timeout(db, 5000);
 	sql_exec(db, "pragma page_size = 4096");
-	sql_exec(db, "pragma journal_mode = OFF");
-	sql_exec(db, "pragma synchronous = OFF;");
+	/* WAL lets the server read while the scanner writes, and a crash can
+	 * no longer leave a half-written database behind.  It needs shared
+	 * memory, which some network filesystems refuse. */
+	mode = sql_get_text_field(db, "pragma journal_mode = WAL");
+	if (!mode || strcasecmp(mode, "wal") != 0)
+	{
+		DPRINTF(E_WARN, L_GENERAL, "WAL journal not available for %s; using %s\n",
+			path, mode ? mode : "the default journal");
+		sql_exec(db, "pragma synchronous = FULL;");
+	}
+	else
+		sql_exec(db, "pragma synchronous = NORMAL;");
+	sqlite3_free(mode);
 	sql_exec(db, "pragma default_cache_size = 8192;");
 
 	return new_db;
@@ -371,22 +388,19 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 	struct media_dir_s *media_path = NULL;
 	char cmd[PATH_MAX*2];
 	char **result;
-	int i, rows = 0;
-	int ret;
+	int i, rows = 0, ndirs = 0;
+	int ret, changed = 0;
+	void (*scan)(void);
 
 	if (!new_db)
 	{
 		/* Check if any new media dirs appeared */
-		media_path = media_dirs;
-		while (media_path)
+		for (media_path = media_dirs; media_path; media_path = media_path->next)
 		{
-			ret = sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = %Q", media_path->path);
+			ret = sql_get_int_param(db, "SELECT TIMESTAMP from DETAILS where PATH = ?", "s", media_path->path);
 			if (ret != media_path->types)
-			{
-				ret = 1;
-				goto rescan;
-			}
-			media_path = media_path->next;
+				changed = 1;
+			ndirs++;
 		}
 		/* Check if any media dirs disappeared */
 		sql_get_table(db, "SELECT VALUE from SETTINGS where KEY = 'media_dir'", &result, &rows, NULL);
@@ -399,20 +413,30 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 					break;
 				media_path = media_path->next;
 			}
-			if (!media_path)
-			{
-				ret = 2;
-				sqlite3_free_table(result);
-				goto rescan;
-			}
+			if (!media_path && !changed)
+				changed = 2;
 		}
 		sqlite3_free_table(result);
 	}
 
 	ret = db_upgrade(db);
+	if (ret == 0 && changed && !GETFLAG(MERGE_MEDIA_DIRS_MASK) && (rows > 1) != (ndirs > 1))
+	{
+		/* going from one media_dir to several adds a level to the tree */
+		ret = changed;
+	}
+	else if (ret == 0)
+	{
+		if (!changed && !GETFLAG(RESCAN_MASK))
+			return;
+		if (changed == 1)
+			DPRINTF(E_WARN, L_GENERAL, "New media_dir detected; updating...\n");
+		else if (changed == 2)
+			DPRINTF(E_WARN, L_GENERAL, "Removed media_dir detected; updating...\n");
+	}
+
 	if (ret != 0)
 	{
-rescan:
 		if (ret < 0)
 			DPRINTF(E_WARN, L_GENERAL, "Creating new database at %s/files.db\n", db_path);
 		else if (ret == 1)
@@ -422,36 +446,41 @@ rescan:
 		else
 			DPRINTF(E_WARN, L_GENERAL, "Database version mismatch (%d=>%d); need to recreate...\n",
 				ret, DB_VERSION);
+		sql_finalize_stmts(db);
 		sqlite3_close(db);
 
-		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm %s/art_cache",
+			 db_path, db_path, db_path, db_path);
 		if (system(cmd) != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache!  Exiting...\n");
 
 		open_db(&db);
 		if (CreateDatabase() != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "ERROR: Failed to create sqlite database!  Exiting...\n");
+	}
+	scan = (ret != 0) ? start_scanner : start_rescan;
 #if USE_FORK
-		scanning = 1;
+	scanning = 1;
+	sql_finalize_stmts(db);
+	sqlite3_close(db);
+	*scanner_pid = fork();
+	open_db(&db);
+	if (*scanner_pid == 0) /* child (scanner) process */
+	{
+		scan();
+		sql_finalize_stmts(db);
 		sqlite3_close(db);
-		*scanner_pid = fork();
-		open_db(&db);
-		if (*scanner_pid == 0) /* child (scanner) process */
-		{
-			start_scanner();
-			sqlite3_close(db);
-			log_close();
-			freeoptions();
-			exit(EXIT_SUCCESS);
-		}
-		else if (*scanner_pid < 0)
-		{
-			start_scanner();
-		}
+		log_close();
+		freeoptions();
+		exit(EXIT_SUCCESS);
+	}
+	else if (*scanner_pid < 0)
+	{
+		scan();
+	}
 #else
-		start_scanner();
+	scan();
 #endif
-	}
 }
 
 static int
@@ -592,6 +621,16 @@ init(int argc, char **argv)
 	runtime_vars.port = 8200;
 	runtime_vars.notify_interval = 895;	/* seconds between SSDP announces */
 	runtime_vars.max_connections = 50;
+	runtime_vars.file_cache_size = 32;
+	runtime_vars.soap_cache_size = 1024;
+	runtime_vars.transcode_cache_size = 0;
+	runtime_vars.pretranscode_jobs = 1;
+	runtime_vars.pretranscode_nice = 19;
+	runtime_vars.pretranscode_quota = -1;
+	runtime_vars.stream_threads = 0;
+	runtime_vars.scanner_threads = 0;
+	runtime_vars.keepalive_timeout = 15;
+	runtime_vars.keepalive_requests = 100;
 	runtime_vars.root_container = NULL;
 	runtime_vars.ifaces[0] = NULL;
 
@@ -604,6 +643,15 @@ init(int argc, char **argv)
 			DPRINTF(E_FATAL, L_GENERAL, "Error reading configuration file %s\n", optionsfile);
 	}
 
+	/* before the transcode options, which may name profiles */
+	for (i=0; i<num_options; i++)
+	{
+		if (ary_options[i].id == CLIENT_PROFILES)
+			LoadClientProfiles(ary_options[i].value);
+	}
+	if (InitClientMatcher() != 0)
+		return 1;
+
 	for (i=0; i<num_options; i++)
 	{
 		switch (ary_options[i].id)
@@ -793,6 +841,44 @@ init(int argc, char **argv)
 		case MAX_CONNECTIONS:
 			runtime_vars.max_connections = atoi(ary_options[i].value);
 			break;
+		case FILE_CACHE_SIZE:
+			runtime_vars.file_cache_size = atoi(ary_options[i].value);
+			break;
+		case SOAP_CACHE_SIZE:
+			runtime_vars.soap_cache_size = atoi(ary_options[i].value);
+			break;
+		case CLIENT_PROFILES:
+			break;
+		case TRANSCODE_CACHE_SIZE:
+			runtime_vars.transcode_cache_size = atoi(ary_options[i].value);
+			break;
+		case PRETRANSCODE:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(PRETRANSCODE_MASK);
+			break;
+		case PRETRANSCODE_JOBS:
+			runtime_vars.pretranscode_jobs = atoi(ary_options[i].value);
+			if (runtime_vars.pretranscode_jobs > PRETRANSCODE_MAX_JOBS)
+				runtime_vars.pretranscode_jobs = PRETRANSCODE_MAX_JOBS;
+			break;
+		case PRETRANSCODE_NICE:
+			runtime_vars.pretranscode_nice = atoi(ary_options[i].value);
+			break;
+		case PRETRANSCODE_QUOTA:
+			runtime_vars.pretranscode_quota = atoi(ary_options[i].value);
+			break;
+		case STREAM_THREADS:
+			runtime_vars.stream_threads = atoi(ary_options[i].value);
+			break;
+		case SCANNER_THREADS:
+			runtime_vars.scanner_threads = atoi(ary_options[i].value);
+			break;
+		case KEEPALIVE_TIMEOUT:
+			runtime_vars.keepalive_timeout = atoi(ary_options[i].value);
+			break;
+		case KEEPALIVE_REQUESTS:
+			runtime_vars.keepalive_requests = atoi(ary_options[i].value);
+			break;
 		case MERGE_MEDIA_DIRS:
 			if (strtobool(ary_options[i].value))
 				SETFLAG(MERGE_MEDIA_DIRS_MASK);
@@ -925,10 +1011,14 @@ init(int argc, char **argv)
 			runtime_vars.port = -1; // triggers help display
 			break;
 		case 'R':
-			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm %s/art_cache",
+				 db_path, db_path, db_path, db_path);
 			if (system(buf) != 0)
 				DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache. EXITING\n");
 			break;
+		case 'r':
+			SETFLAG(RESCAN_MASK);
+			break;
 		case 'u':
 			if (i+1 != argc)
 			{
@@ -970,9 +1060,9 @@ init(int argc, char **argv)
 			"\t\t[-t notify_interval] [-P pid_filename]\n"
 			"\t\t[-s serial] [-m model_number]\n"
 #ifdef __linux__
-			"\t\t[-w url] [-R] [-L] [-S] [-V] [-h]\n"
+			"\t\t[-w url] [-r] [-R] [-L] [-S] [-V] [-h]\n"
 #else
-			"\t\t[-w url] [-R] [-L] [-V] [-h]\n"
+			"\t\t[-w url] [-r] [-R] [-L] [-V] [-h]\n"
 #endif
 			"\nNotes:\n\tNotify interval is in seconds. Default is 895 seconds.\n"
 			"\tDefault pid file is %s.\n"
@@ -980,6 +1070,7 @@ init(int argc, char **argv)
 			"\t-w sets the presentation url. Default is http address on port 80\n"
 			"\t-v enables verbose output\n"
 			"\t-h displays this text\n"
+			"\t-r updates the database with changes made while not running\n"
 			"\t-R forces a full rescan\n"
 			"\t-L do not create playlists\n"
 #ifdef __linux__
@@ -1076,10 +1167,169 @@ init(int argc, char **argv)
 		DPRINTF(E_ERROR, L_GENERAL, "Allocation failed\n");
 		return 1;
 	}
+	if (file_cache_init(runtime_vars.file_cache_size) != 0)
+		return 1;
+	soap_cache_init(runtime_vars.soap_cache_size);
+	/* without it every stream simply runs its own transcoder */
+	transcode_session_init();
+	transcode_cache_init();
+	if (stream_init(runtime_vars.stream_threads) != 0)
+		DPRINTF(E_WARN, L_GENERAL, "Streaming threads unavailable, streams will be forked\n");
 
 	return 0;
 }
 
+static LIST_HEAD(httplisthead, upnphttp) upnphttphead;
+#ifdef TIVO_SUPPORT
+static struct sockaddr_in tivo_bcast;
+#endif
+
+/* main loop callbacks */
+static void
+process_ssdp(struct event *ev)
+{
+	ProcessSSDPRequest(ev->fd, (unsigned short)runtime_vars.port);
+}
+
+static void
+process_monitor(struct event *ev)
+{
+	ProcessMonitorEvent(ev->fd);
+}
+
+static void
+process_upnphttp(struct event *ev)
+{
+	struct upnphttp *h = ev->data;
+
+	if (h->state <= 2)
+		Process_upnphttp(h);
+	/* delete finished HTTP connections */
+	if (h->state >= 100)
+	{
+		LIST_REMOVE(h, entries);
+		Delete_upnphttp(h);
+	}
+}
+
+static void
+process_listen(struct event *ev)
+{
+	struct upnphttp *tmp;
+	struct sockaddr_in clientname;
+	socklen_t clientnamelen;
+	int shttp;
+
+	clientnamelen = sizeof(struct sockaddr_in);
+	shttp = accept(ev->fd, (struct sockaddr *)&clientname, &clientnamelen);
+	if (shttp < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
+		return;
+	}
+	fcntl(shttp, F_SETFD, FD_CLOEXEC);
+	DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
+		inet_ntoa(clientname.sin_addr),
+		ntohs(clientname.sin_port) );
+	/* Create a new upnphttp object and add it to
+	 * the active upnphttp object list */
+	tmp = New_upnphttp(shttp);
+	if (!tmp)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "New_upnphttp() failed\n");
+		close(shttp);
+		return;
+	}
+	tmp->clientaddr = clientname.sin_addr;
+	tmp->ev.rdwr = EVENT_READ;
+	tmp->ev.process = process_upnphttp;
+	tmp->ev.data = tmp;
+	if (event_add(&tmp->ev) != 0)
+	{
+		Delete_upnphttp(tmp);
+		return;
+	}
+	LIST_INSERT_HEAD(&upnphttphead, tmp, entries);
+}
+
+/* Idle connections are only shut down here; their event then fires and
+ * process_upnphttp() deletes them once recv() reports the end. */
+static void
+close_idle(struct event *ev)
+{
+	struct upnphttp *e;
+	time_t now = time(NULL);
+
+	for (e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
+	{
+		if (e->socket >= 0 && e->state <= 2 && e->expires && now >= e->expires)
+		{
+			DPRINTF(E_DEBUG, L_HTTP, "Closing idle HTTP connection %d\n", e->socket);
+			shutdown(e->socket, SHUT_RDWR);
+			e->expires = 0;
+		}
+	}
+}
+
+static void
+send_notifies(struct event *ev)
+{
+	int i;
+
+	DPRINTF(E_DEBUG, L_SSDP, "Sending SSDP notifies\n");
+	for (i = 0; i < n_lan_addr; i++)
+	{
+		SendSSDPNotifies(lan_addr[i].snotify, lan_addr[i].str,
+			runtime_vars.port, runtime_vars.notify_interval);
+	}
+}
+
+static void
+housekeeping(struct event *ev)
+{
+	upnpevents_gc();
+}
+
+static void
+run_pretranscode(struct event *ev)
+{
+	pretranscode_run();
+}
+
+#ifdef TIVO_SUPPORT
+/* The TiVo queries may run on db or any of the read-only connections */
+static void
+add_tivo_functions(sqlite3 *conn)
+{
+	int ret;
+
+	if (!GETFLAG(TIVO_MASK))
+		return;
+	/* Add TiVo-specific randomize function to sqlite */
+	ret = sqlite3_create_function(conn, "tivorandom", 1, SQLITE_UTF8, NULL, &TiVoRandomSeedFunc, NULL, NULL);
+	if (ret != SQLITE_OK)
+		DPRINTF(E_ERROR, L_TIVO, "ERROR: Failed to add sqlite randomize function for TiVo!\n");
+}
+#endif
+
+#ifdef TIVO_SUPPORT
+static void
+process_beacon(struct event *ev)
+{
+	ProcessTiVoBeacon(ev->fd);
+}
+
+static void
+send_beacon(struct event *ev)
+{
+	sendBeaconMessage(*(int *)ev->data, &tivo_bcast, sizeof(struct sockaddr_in), 1);
+	/* Beacons should be sent every 5 seconds or so for the first minute,
+	 * then every minute or so thereafter. */
+	if (ev->interval == 5 && (time(NULL) - startup_time) > 60)
+		event_timer_set(ev, 60);
+}
+#endif
+
 /* === main === */
 /* process HTTP or SSDP requests */
 int
@@ -1088,22 +1338,16 @@ main(int argc, char **argv)
 	int ret, i;
 	int shttpl = -1;
 	int smonitor = -1;
-	LIST_HEAD(httplisthead, upnphttp) upnphttphead;
 	struct upnphttp * e = 0;
-	struct upnphttp * next;
-	fd_set readset;	/* for select() */
-	fd_set writeset;
-	struct timeval timeout, timeofday, lastnotifytime = {0, 0};
-	time_t lastupdatetime = 0;
-	int max_fd = -1;
+	struct event ssdpev, httpev, monev, notifyev, gcev, idleev, pretranscodeev;
+	time_t lastupdatetime = 0, now;
 	int last_changecnt = 0;
 	pid_t scanner_pid = 0;
 	pthread_t inotify_thread = 0;
+	char dbfile[PATH_MAX];
 #ifdef TIVO_SUPPORT
-	uint8_t beacon_interval = 5;
 	int sbeacon = -1;
-	struct sockaddr_in tivo_bcast;
-	struct timeval lastbeacontime = {0, 0};
+	struct event beaconev, beacontimerev;
 #endif
 
 	for (i = 0; i < L_MAX; i++)
@@ -1130,6 +1374,13 @@ main(int argc, char **argv)
 			ret = -1;
 	}
 	check_db(db, ret, &scanner_pid);
+	transcode_check_config();
+	snprintf(dbfile, sizeof(dbfile), "%s/files.db", db_path);
+#ifdef TIVO_SUPPORT
+	sql_readers_init(dbfile, add_tivo_functions);
+#else
+	sql_readers_init(dbfile, NULL);
+#endif
 #ifdef HAVE_INOTIFY
 	if( GETFLAG(INOTIFY_MASK) )
 	{
@@ -1159,10 +1410,7 @@ main(int argc, char **argv)
 	if (GETFLAG(TIVO_MASK))
 	{
 		DPRINTF(E_WARN, L_GENERAL, "TiVo support is enabled.\n");
-		/* Add TiVo-specific randomize function to sqlite */
-		ret = sqlite3_create_function(db, "tivorandom", 1, SQLITE_UTF8, NULL, &TiVoRandomSeedFunc, NULL, NULL);
-		if (ret != SQLITE_OK)
-			DPRINTF(E_ERROR, L_TIVO, "ERROR: Failed to add sqlite randomize function for TiVo!\n");
+		add_tivo_functions(db);
 		/* open socket for sending Tivo notifications */
 		sbeacon = OpenAndConfTivoBeaconSocket();
 		if(sbeacon < 0)
@@ -1175,70 +1423,72 @@ main(int argc, char **argv)
 #endif
 
 	reload_ifaces(0);
-	lastnotifytime.tv_sec = time(NULL) + runtime_vars.notify_interval;
 
-	/* main loop */
-	while (!quitting)
+	/* register everything the main loop waits for */
+	if (event_init() != 0)
+		DPRINTF(E_FATAL, L_GENERAL, "Failed to initialize the event loop. EXITING\n");
+	memset(&ssdpev, 0, sizeof(ssdpev));
+	memset(&httpev, 0, sizeof(httpev));
+	memset(&monev, 0, sizeof(monev));
+	memset(&notifyev, 0, sizeof(notifyev));
+	memset(&gcev, 0, sizeof(gcev));
+	if (sssdp >= 0)
 	{
-		/* Check if we need to send SSDP NOTIFY messages and do it if
-		 * needed */
-		if (gettimeofday(&timeofday, 0) < 0)
-		{
-			DPRINTF(E_ERROR, L_GENERAL, "gettimeofday(): %s\n", strerror(errno));
-			timeout.tv_sec = runtime_vars.notify_interval;
-			timeout.tv_usec = 0;
-		}
-		else
-		{
-			/* the comparison is not very precise but who cares ? */
-			if (timeofday.tv_sec >= (lastnotifytime.tv_sec + runtime_vars.notify_interval))
-			{
-				DPRINTF(E_DEBUG, L_SSDP, "Sending SSDP notifies\n");
-				for (i = 0; i < n_lan_addr; i++)
-				{
-					SendSSDPNotifies(lan_addr[i].snotify, lan_addr[i].str,
-						runtime_vars.port, runtime_vars.notify_interval);
-				}
-				memcpy(&lastnotifytime, &timeofday, sizeof(struct timeval));
-				timeout.tv_sec = runtime_vars.notify_interval;
-				timeout.tv_usec = 0;
-			}
-			else
-			{
-				timeout.tv_sec = lastnotifytime.tv_sec + runtime_vars.notify_interval
-				                 - timeofday.tv_sec;
-				if (timeofday.tv_usec > lastnotifytime.tv_usec)
-				{
-					timeout.tv_usec = 1000000 + lastnotifytime.tv_usec
-					                  - timeofday.tv_usec;
-					timeout.tv_sec--;
-				}
-				else
-					timeout.tv_usec = lastnotifytime.tv_usec - timeofday.tv_usec;
-			}
+		ssdpev.fd = sssdp;
+		ssdpev.rdwr = EVENT_READ;
+		ssdpev.process = process_ssdp;
+		event_add(&ssdpev);
+	}
+	httpev.fd = shttpl;
+	httpev.rdwr = EVENT_READ;
+	httpev.process = process_listen;
+	if (event_add(&httpev) != 0)
+		DPRINTF(E_FATAL, L_GENERAL, "Failed to watch the HTTP socket. EXITING\n");
+	if (smonitor >= 0)
+	{
+		monev.fd = smonitor;
+		monev.rdwr = EVENT_READ;
+		monev.process = process_monitor;
+		event_add(&monev);
+	}
+	notifyev.process = send_notifies;
+	if (event_timer_add(&notifyev, runtime_vars.notify_interval) != 0)
+		DPRINTF(E_FATAL, L_GENERAL, "Failed to start the SSDP notify timer. EXITING\n");
+	/* expire subscribers */
+	gcev.process = housekeeping;
+	event_timer_add(&gcev, 60);
+	/* pretranscode_run() starts jobs only while no streams are served */
+	if (GETFLAG(PRETRANSCODE_MASK))
+	{
+		memset(&pretranscodeev, 0, sizeof(pretranscodeev));
+		pretranscodeev.process = run_pretranscode;
+		event_timer_add(&pretranscodeev, PRETRANSCODE_INTERVAL);
+	}
+	if (runtime_vars.keepalive_timeout > 0)
+	{
+		memset(&idleev, 0, sizeof(idleev));
+		idleev.process = close_idle;
+		event_timer_add(&idleev, MIN(runtime_vars.keepalive_timeout, 5));
+	}
 #ifdef TIVO_SUPPORT
-			if (sbeacon >= 0)
-			{
-				if (timeofday.tv_sec >= (lastbeacontime.tv_sec + beacon_interval))
-				{
-					sendBeaconMessage(sbeacon, &tivo_bcast, sizeof(struct sockaddr_in), 1);
-					memcpy(&lastbeacontime, &timeofday, sizeof(struct timeval));
-					if (timeout.tv_sec > beacon_interval)
-					{
-						timeout.tv_sec = beacon_interval;
-						timeout.tv_usec = 0;
-					}
-					/* Beacons should be sent every 5 seconds or so for the first minute,
-					 * then every minute or so thereafter. */
-					if (beacon_interval == 5 && (timeofday.tv_sec - startup_time) > 60)
-						beacon_interval = 60;
-				}
-				else if (timeout.tv_sec > (lastbeacontime.tv_sec + beacon_interval + 1 - timeofday.tv_sec))
-					timeout.tv_sec = lastbeacontime.tv_sec + beacon_interval - timeofday.tv_sec;
-			}
+	if (sbeacon >= 0)
+	{
+		memset(&beaconev, 0, sizeof(beaconev));
+		memset(&beacontimerev, 0, sizeof(beacontimerev));
+		beaconev.fd = sbeacon;
+		beaconev.rdwr = EVENT_READ;
+		beaconev.process = process_beacon;
+		event_add(&beaconev);
+		beacontimerev.process = send_beacon;
+		beacontimerev.data = &sbeacon;
+		if (event_timer_add(&beacontimerev, 5) == 0)
+			send_beacon(&beacontimerev);
+	}
 #endif
-		}
 
+	/* main loop */
+	while (!quitting)
+	{
 		if (scanning)
 		{
 			if (!scanner_pid || kill(scanner_pid, 0) != 0)
@@ -1247,151 +1497,33 @@ main(int argc, char **argv)
 				updateID++;
 			}
 		}
-
-		/* select open sockets (SSDP, HTTP listen, and all HTTP soap sockets) */
-		FD_ZERO(&readset);
-
-		if (sssdp >= 0) 
-		{
-			FD_SET(sssdp, &readset);
-			max_fd = MAX(max_fd, sssdp);
-		}
-		
-		if (shttpl >= 0) 
-		{
-			FD_SET(shttpl, &readset);
-			max_fd = MAX(max_fd, shttpl);
-		}
-#ifdef TIVO_SUPPORT
-		if (sbeacon >= 0) 
-		{
-			FD_SET(sbeacon, &readset);
-			max_fd = MAX(max_fd, sbeacon);
-		}
-#endif
-		if (smonitor >= 0) 
-		{
-			FD_SET(smonitor, &readset);
-			max_fd = MAX(max_fd, smonitor);
-		}
-
-		i = 0;	/* active HTTP connections count */
-		for (e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
+		if (event_process() != 0)
 		{
-			if ((e->socket >= 0) && (e->state <= 2))
-			{
-				FD_SET(e->socket, &readset);
-				max_fd = MAX(max_fd, e->socket);
-				i++;
-			}
+			if (quitting)
+				break;
+			DPRINTF(E_ERROR, L_GENERAL, "event_process(): %s\n", strerror(errno));
+			DPRINTF(E_FATAL, L_GENERAL, "Failed to wait for open sockets. EXITING\n");
 		}
-		FD_ZERO(&writeset);
-		upnpevents_selectfds(&readset, &writeset, &max_fd);
 
-		ret = select(max_fd+1, &readset, &writeset, 0, &timeout);
-		if (ret < 0)
-		{
-			if(quitting) goto shutdown;
-			if(errno == EINTR) continue;
-			DPRINTF(E_ERROR, L_GENERAL, "select(all): %s\n", strerror(errno));
-			DPRINTF(E_FATAL, L_GENERAL, "Failed to select open sockets. EXITING\n");
-		}
-		upnpevents_processfds(&readset, &writeset);
-		/* process SSDP packets */
-		if (sssdp >= 0 && FD_ISSET(sssdp, &readset))
-		{
-			/*DPRINTF(E_DEBUG, L_GENERAL, "Received SSDP Packet\n");*/
-			ProcessSSDPRequest(sssdp, (unsigned short)runtime_vars.port);
-		}
-#ifdef TIVO_SUPPORT
-		if (sbeacon >= 0 && FD_ISSET(sbeacon, &readset))
-		{
-			/*DPRINTF(E_DEBUG, L_GENERAL, "Received UDP Packet\n");*/
-			ProcessTiVoBeacon(sbeacon);
-		}
-#endif
-		if (smonitor >= 0 && FD_ISSET(smonitor, &readset))
-		{
-			ProcessMonitorEvent(smonitor);
-		}
 		/* increment SystemUpdateID if the content database has changed,
 		 * and if there is an active HTTP connection, at most once every 2 seconds */
-		if (i && (timeofday.tv_sec >= (lastupdatetime + 2)))
+		now = time(NULL);
+		if (upnphttphead.lh_first != NULL && now >= (lastupdatetime + 2))
 		{
 			if (scanning || sqlite3_total_changes(db) != last_changecnt)
 			{
 				updateID++;
 				last_changecnt = sqlite3_total_changes(db);
 				upnp_event_var_change_notify(EContentDirectory);
-				lastupdatetime = timeofday.tv_sec;
-			}
-		}
-		/* process active HTTP connections */
-		for (e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
-		{
-			if ((e->socket >= 0) && (e->state <= 2) && (FD_ISSET(e->socket, &readset)))
-				Process_upnphttp(e);
-		}
-		/* process incoming HTTP connections */
-		if (shttpl >= 0 && FD_ISSET(shttpl, &readset))
-		{
-			int shttp;
-			socklen_t clientnamelen;
-			struct sockaddr_in clientname;
-			clientnamelen = sizeof(struct sockaddr_in);
-			shttp = accept(shttpl, (struct sockaddr *)&clientname, &clientnamelen);
-			if (shttp<0)
-			{
-				DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
-			}
-			else
-			{
-				struct upnphttp * tmp = 0;
-				DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
-					inet_ntoa(clientname.sin_addr),
-					ntohs(clientname.sin_port) );
-				/*if (fcntl(shttp, F_SETFL, O_NONBLOCK) < 0) {
-					DPRINTF(E_ERROR, L_GENERAL, "fcntl F_SETFL, O_NONBLOCK\n");
-				}*/
-				/* Create a new upnphttp object and add it to
-				 * the active upnphttp object list */
-				tmp = New_upnphttp(shttp);
-				if (tmp)
-				{
-					tmp->clientaddr = clientname.sin_addr;
-					LIST_INSERT_HEAD(&upnphttphead, tmp, entries);
-				}
-				else
-				{
-					DPRINTF(E_ERROR, L_GENERAL, "New_upnphttp() failed\n");
-					close(shttp);
-				}
-			}
-		}
-		/* delete finished HTTP connections */
-		for (e = upnphttphead.lh_first; e != NULL; e = next)
-		{
-			next = e->entries.le_next;
-			if(e->state >= 100)
-			{
-				LIST_REMOVE(e, entries);
-				Delete_upnphttp(e);
+				lastupdatetime = now;
 			}
 		}
 	}
 
-shutdown:
 	/* kill the scanner */
 	if (scanning && scanner_pid)
 		kill(scanner_pid, SIGKILL);
 
-	/* remove files that that could have been left after transcoding */
-	if ( transcode_tempfile )
-	{
-		unlink(transcode_tempfile);
-		transcode_tempfile = NULL;
-	}
-
 	/* kill other child processes */
 	process_reap_children();
 	free(children);
@@ -1411,6 +1543,7 @@ shutdown:
 	if (sbeacon >= 0)
 		close(sbeacon);
 #endif
+	event_fini();
 	
 	for (i = 0; i < n_lan_addr; i++)
 	{
@@ -1420,8 +1553,14 @@ shutdown:
 
 	if (inotify_thread)
 		pthread_join(inotify_thread, NULL);
+	file_cache_free();
+	soap_cache_free();
+	transcode_session_free();
+	stream_free();
 
+	sql_readers_close();
 	sql_exec(db, "UPDATE SETTINGS set VALUE = '%u' where KEY = 'UPDATE_ID'", updateID);
+	sql_finalize_stmts(db);
 	sqlite3_close(db);
 
 	upnpevents_removeSubscribers();
@@ -49,6 +49,16 @@ struct runtime_vars_s {
 	int port;	/* HTTP Port */
 	int notify_interval;	/* seconds between SSDP announces */
 	int max_connections;	/* max number of simultaneous conenctions */
+	int file_cache_size;	/* number of media file lookups to cache */
+	int soap_cache_size;	/* KB of Browse and Search responses to cache, 0 disables */
+	int transcode_cache_size;	/* MB of transcoded output kept on disk, 0 disables */
+	int pretranscode_jobs;	/* background transcoders run at once */
+	int pretranscode_nice;	/* niceness of the background transcoders */
+	int pretranscode_quota;	/* MB of the transcode cache they may fill */
+	int stream_threads;	/* threads streaming untranscoded files, 0 forks instead */
+	int scanner_threads;	/* threads reading metadata during a scan, 0 for one per CPU */
+	int keepalive_timeout;	/* seconds an idle HTTP connection is kept, 0 disables keep-alive */
+	int keepalive_requests;	/* max requests served over one HTTP connection */
 	const char *root_container;	/* root ObjectID (instead of "0") */
 	const char *ifaces[MAX_LAN_ADDR];	/* list of configured network interfaces */
 };
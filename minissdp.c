@@ -36,6 +36,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -47,6 +49,7 @@
 #include "upnpglobalvars.h"
 #include "upnpreplyparse.h"
 #include "getifaddr.h"
+#include "event.h"
 #include "minissdp.h"
 #include "codelength.h"
 #include "utils.h"
@@ -307,121 +310,89 @@ SendSSDPNotifies(int s, const char *host, unsigned short port,
 	}
 }
 
-static void
-ParseUPnPClient(char *location)
-{
-	char buf[8192];
-	struct sockaddr_in dest;
-	int s, n, do_headers = 0, nread = 0;
-	struct timeval tv;
-	char *addr, *path, *port_str;
-	long port = 80;
-	char *off = NULL, *p;
-	int content_len = sizeof(buf);
-	struct NameValueParserData xml;
-	struct client_cache_s *client;
-	int type = 0;
-	char *model, *serial, *name;
-
-	if (strncmp(location, "http://", 7) != 0)
-		return;
-	path = location + 7;
-	port_str = strsep(&path, "/");
-	if (!path)
-		return;
-	addr = strsep(&port_str, ":");
-	if (port_str)
-	{
-		port = strtol(port_str, NULL, 10);
-		if (!port)
-			port = 80;
-	}
-
-	memset(&dest, '\0', sizeof(dest));
-	if (!inet_aton(addr, &dest.sin_addr))
-		return;
-	/* Check if the client is already in cache */
-	dest.sin_family = AF_INET;
-	dest.sin_port = htons(port);
+/* Renderer descriptions are fetched without blocking the main loop: the
+ * connect, request and reply of each fetch are driven by its own event, and
+ * a timer aborts the fetches that take too long.  A location fetched lately
+ * is not fetched again before FETCH_TTL, whatever its answer. */
+#define FETCH_SLOTS 8
+#define FETCH_TIMEOUT 2
+#define FETCH_TTL 300
+#define FETCHED_SLOTS 32
+
+enum fetch_state {
+	FETCH_IDLE,
+	FETCH_CONNECT,
+	FETCH_READ
+};
 
-	s = socket(PF_INET, SOCK_STREAM, 0);
-	if (s < 0)
-		return;
+struct client_fetch_s {
+	struct event ev;
+	enum fetch_state state;
+	struct in_addr addr;
+	time_t started;
+	char location[256];
+	char buf[8192];
+	int nread;
+	int off;		/* start of the body, 0 until the headers are in */
+	int content_len;
+};
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 500000;
-	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+static struct client_fetch_s fetches[FETCH_SLOTS];
+static struct event fetch_timer;
+static int fetch_count = 0;
 
-	if (connect(s, (struct sockaddr*)&dest, sizeof(struct sockaddr_in)) < 0)
-		goto close;
+static struct {
+	char location[256];
+	time_t fetched;
+} fetched[FETCHED_SLOTS];
 
-	n = snprintf(buf, sizeof(buf), "GET /%s HTTP/1.0\r\n"
-	                               "HOST: %s:%ld\r\n\r\n",
-	                               path, addr, port);
-	if (write(s, buf, n) < 1)
-		goto close;
+/* Remember location, and tell whether it was fetched within FETCH_TTL. */
+static int
+fetched_lately(const char *location)
+{
+	time_t now = time(NULL);
+	int i, oldest = 0;
 
-	while ((n = read(s, buf+nread, sizeof(buf)-nread-1)) > 0)
+	for (i = 0; i < FETCH_SLOTS; i++)
 	{
-		nread += n;
-		buf[nread] = '\0';
-		n = nread - 4;
-		p = buf;
-
-		while (!off && (n-- > 0))
-		{
-			if (p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
-			{
-				off = p + 4;
-				do_headers = 1;
-			}
-			p++;
-		}
-		if (!off)
-			continue;
-
-		if (do_headers)
+		if (fetches[i].state != FETCH_IDLE &&
+		    strcmp(fetches[i].location, location) == 0)
+			return 1;
+	}
+	for (i = 0; i < FETCHED_SLOTS; i++)
+	{
+		if (strcmp(fetched[i].location, location) == 0)
 		{
-			p = buf;
-			if (strncmp(p, "HTTP/", 5) != 0)
-				goto close;
-			while (*p != ' ' && *p != '\t')
-				p++;
-			/* If we don't get a 200 status, ignore it */
-			if (strtol(p, NULL, 10) != 200)
-				goto close;
-			p = strcasestr(p, "Content-Length:");
-			if (p)
-				content_len = strtol(p+15, NULL, 10);
-			do_headers = 0;
+			if (now - fetched[i].fetched < FETCH_TTL)
+				return 1;
+			fetched[i].fetched = now;
+			return 0;
 		}
-		if ((buf + nread - off) >= content_len)
-			break;
+		if (fetched[i].fetched < fetched[oldest].fetched)
+			oldest = i;
 	}
-close:
-	close(s);
-	if (!off)
-		return;
-	nread -= off - buf;
-	ParseNameValue(off, nread, &xml, 0);
+	strncpyt(fetched[oldest].location, location, sizeof(fetched[oldest].location));
+	fetched[oldest].fetched = now;
+
+	return 0;
+}
+
+static void
+ParseUPnPClient(struct in_addr addr, char *desc, int len)
+{
+	struct NameValueParserData xml;
+	struct client_cache_s *client;
+	int type = 0;
+	char *model, *serial, *name;
+
+	ParseNameValue(desc, len, &xml, 0);
 	model = GetValueFromNameValueList(&xml, "modelName");
 	serial = GetValueFromNameValueList(&xml, "serialNumber");
 	name = GetValueFromNameValueList(&xml, "friendlyName");
 	if (model)
 	{
-		int i;
 		DPRINTF(E_DEBUG, L_SSDP, "Model: %s\n", model);
-		for (i = 0; client_types[i].name; i++)
-		{
-			if (client_types[i].match_type != EModelName)
-				continue;
-			if (strstr(model, client_types[i].match) != NULL)
-			{
-				type = i;
-				break;
-			}
-		}
+		type = MatchClient(EModelName, model, '\0');
 
 		/* Special Samsung handling.  It's very hard to tell Series A from B */
 		if (type > 0 && client_types[type].type == ESamsungSeriesB)
@@ -440,27 +411,16 @@ close:
 		}
 
 		if (type == 0 && name != NULL)
-		{
-			for (i = 0; client_types[i].name; i++)
-			{
-				if (client_types[i].match_type != EFriendlyNameSSDP)
-					continue;
-				if (strcmp(name, client_types[i].match) == 0)
-				{
-					type = i;
-					break;
-				}
-			}
-		}
+			type = MatchClient(EFriendlyNameSSDP, name, '\0');
 	}
 	ClearNameValueList(&xml);
 	if (!type)
 		return;
 	/* Add this client to the cache if it's not there already. */
-	client = SearchClientCache(dest.sin_addr, 1);
+	client = SearchClientCache(addr, 1);
 	if (!client)
 	{
-		AddClientCache(dest.sin_addr, type);
+		AddClientCache(addr, type);
 	}
 	else
 	{
@@ -469,6 +429,181 @@ close:
 	}
 }
 
+static void
+fetch_close(struct client_fetch_s *f)
+{
+	event_del(&f->ev);
+	close(f->ev.fd);
+	f->ev.fd = -1;
+	f->state = FETCH_IDLE;
+	if (--fetch_count == 0)
+		event_del(&fetch_timer);
+}
+
+static void
+fetch_abort_stalled(struct event *ev)
+{
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < FETCH_SLOTS; i++)
+	{
+		if (fetches[i].state == FETCH_IDLE || now - fetches[i].started < FETCH_TIMEOUT)
+			continue;
+		DPRINTF(E_DEBUG, L_SSDP, "Timed out fetching %s\n", fetches[i].location);
+		fetch_close(&fetches[i]);
+	}
+}
+
+static void
+fetch_process(struct event *ev)
+{
+	struct client_fetch_s *f = ev->data;
+	char *p;
+	int n, err = 0;
+	socklen_t len = sizeof(err);
+
+	/* aborted by the timer after this event fired */
+	if (f->state == FETCH_IDLE)
+		return;
+	if (f->state == FETCH_CONNECT)
+	{
+		if (getsockopt(ev->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+			goto close;
+		n = write(ev->fd, f->buf, strlen(f->buf));
+		/* a stale event for a reused slot, still connecting */
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n != (int)strlen(f->buf))
+			goto close;
+		f->buf[0] = '\0';
+		f->state = FETCH_READ;
+		event_mod(ev, EVENT_READ);
+		return;
+	}
+
+	n = read(ev->fd, f->buf + f->nread, sizeof(f->buf) - f->nread - 1);
+	if (n < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		goto close;
+	}
+	f->nread += n;
+	f->buf[f->nread] = '\0';
+	if (!f->off && (p = strstr(f->buf, "\r\n\r\n")))
+	{
+		f->off = p + 4 - f->buf;
+		p = f->buf;
+		if (strncmp(p, "HTTP/", 5) != 0)
+			goto close;
+		while (*p != ' ' && *p != '\t')
+			p++;
+		/* If we don't get a 200 status, ignore it */
+		if (strtol(p, NULL, 10) != 200)
+			goto close;
+		p = strcasestr(p, "Content-Length:");
+		if (p)
+			f->content_len = strtol(p+15, NULL, 10);
+	}
+	/* wait for the rest, unless the reply is over or fills the buffer */
+	if (n > 0 && f->nread < (int)sizeof(f->buf) - 1 &&
+	    (!f->off || f->nread - f->off < f->content_len))
+		return;
+	if (f->off)
+		ParseUPnPClient(f->addr, f->buf + f->off, f->nread - f->off);
+close:
+	fetch_close(f);
+}
+
+/* Start fetching the device description at location, if it was not
+ * fetched lately and a slot is free. */
+static void
+FetchUPnPClient(const char *location)
+{
+	struct client_fetch_s *f = NULL;
+	struct sockaddr_in dest;
+	char buf[sizeof(f->location)];
+	char *addr, *path, *port_str;
+	long port = 80;
+	int s, i;
+
+	if (strncmp(location, "http://", 7) != 0 ||
+	    strlen(location) >= sizeof(buf))
+		return;
+	for (i = 0; i < FETCH_SLOTS; i++)
+	{
+		if (fetches[i].state == FETCH_IDLE)
+		{
+			f = &fetches[i];
+			break;
+		}
+	}
+	if (!f)
+	{
+		DPRINTF(E_DEBUG, L_SSDP, "Too many pending fetches, skipping %s\n", location);
+		return;
+	}
+	strcpy(buf, location);
+	path = buf + 7;
+	port_str = strsep(&path, "/");
+	if (!path)
+		return;
+	addr = strsep(&port_str, ":");
+	if (port_str)
+	{
+		port = strtol(port_str, NULL, 10);
+		if (!port)
+			port = 80;
+	}
+
+	memset(&dest, '\0', sizeof(dest));
+	if (!inet_aton(addr, &dest.sin_addr))
+		return;
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(port);
+	if (fetched_lately(location))
+		return;
+
+	s = socket(PF_INET, SOCK_STREAM, 0);
+	if (s < 0)
+		return;
+	fcntl(s, F_SETFL, O_NONBLOCK);
+	fcntl(s, F_SETFD, FD_CLOEXEC);
+	if (connect(s, (struct sockaddr*)&dest, sizeof(struct sockaddr_in)) < 0 &&
+	    errno != EINPROGRESS)
+	{
+		close(s);
+		return;
+	}
+
+	memset(f, 0, sizeof(*f));
+	f->ev.fd = s;
+	f->ev.rdwr = EVENT_WRITE;
+	f->ev.process = fetch_process;
+	f->ev.data = f;
+	if (event_add(&f->ev) != 0)
+	{
+		close(s);
+		return;
+	}
+	f->state = FETCH_CONNECT;
+	/* without a Content-Length, read until EOF or a full buffer */
+	f->content_len = sizeof(f->buf);
+	f->addr = dest.sin_addr;
+	f->started = time(NULL);
+	strcpy(f->location, location);
+	snprintf(f->buf, sizeof(f->buf), "GET /%s HTTP/1.0\r\n"
+	                                 "HOST: %s:%ld\r\n\r\n",
+	                                 path, addr, port);
+	if (fetch_count++ == 0)
+	{
+		memset(&fetch_timer, 0, sizeof(fetch_timer));
+		fetch_timer.process = fetch_abort_stalled;
+		event_timer_add(&fetch_timer, 1);
+	}
+}
+
 /* ProcessSSDPRequest()
  * process SSDP M-SEARCH requests and responds to them */
 void
@@ -556,7 +691,7 @@ ProcessSSDPRequest(int s, unsigned short port)
 					return;
 				}
 			}
-			ParseUPnPClient(loc);
+			FetchUPnPClient(loc);
 		}
 	}
 	else if (memcmp(bufr, "M-SEARCH", 8) == 0)
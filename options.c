@@ -71,7 +71,19 @@ static const struct {
 	{ TRANSCODE_VIDEO_CODECS, "transcode_video_codecs"},
 	{ TRANSCODE_VIDEOTRANSCODER, "transcode_video_transcoder"},
 	{ TRANSCODE_IMAGE, "transcode_image"},
-	{ TRANSCODE_IMAGETRANSCODER, "transcode_image_transcoder"}
+	{ TRANSCODE_IMAGETRANSCODER, "transcode_image_transcoder"},
+	{ FILE_CACHE_SIZE, "file_cache_size" },
+	{ SOAP_CACHE_SIZE, "soap_cache_size" },
+	{ CLIENT_PROFILES, "client_profiles" },
+	{ TRANSCODE_CACHE_SIZE, "transcode_cache_size" },
+	{ PRETRANSCODE, "pretranscode" },
+	{ PRETRANSCODE_JOBS, "pretranscode_jobs" },
+	{ PRETRANSCODE_NICE, "pretranscode_nice" },
+	{ PRETRANSCODE_QUOTA, "pretranscode_quota" },
+	{ STREAM_THREADS, "stream_threads" },
+	{ SCANNER_THREADS, "scanner_threads" },
+	{ KEEPALIVE_TIMEOUT, "keepalive_timeout" },
+	{ KEEPALIVE_REQUESTS, "keepalive_requests" }
 };
 
 int
@@ -194,6 +206,7 @@ freeoptions(void)
 	struct album_art_name_s *art_names, *last_name;
 	struct transcode_info_s *last_entry;
 	struct transcode_list_format_s *tmp, *last_tmp, *cleaned_lists[4];
+	struct transcode_profile_s *profiles[3];
 	
 	media_path = media_dirs;
 	while (media_path)
@@ -223,6 +236,18 @@ freeoptions(void)
 				free(client_types[i].transcode_info->video_transcoder);
 			if (client_types[i].transcode_info->image_transcoder)
 				free(client_types[i].transcode_info->image_transcoder);
+			profiles[0] = client_types[i].transcode_info->audio_profile;
+			profiles[1] = client_types[i].transcode_info->video_profile;
+			profiles[2] = client_types[i].transcode_info->image_profile;
+			for ( j = 0; j < 3; j++ )
+			{
+				if (profiles[j])
+				{
+					free(profiles[j]->mime);
+					free(profiles[j]->dlna_pn);
+					free(profiles[j]);
+				}
+			}
 
 			cleaned_lists[0] = client_types[i].transcode_info->audio_codecs;
 			cleaned_lists[1] = client_types[i].transcode_info->video_codecs;
@@ -64,7 +64,19 @@ enum upnpconfigoptions {
 	TRANSCODE_VIDEO_CODECS,		/* video codecs that needs to be transcoded */
 	TRANSCODE_VIDEOTRANSCODER,	/* video transcoder */
 	TRANSCODE_IMAGE,			/* image files that needs to be transcoded */
-	TRANSCODE_IMAGETRANSCODER	/* image transcoder */
+	TRANSCODE_IMAGETRANSCODER,	/* image transcoder */
+	FILE_CACHE_SIZE,		/* number of media file lookups to cache */
+	SOAP_CACHE_SIZE,		/* KB of Browse and Search responses to cache */
+	CLIENT_PROFILES,		/* file of additional client profiles */
+	TRANSCODE_CACHE_SIZE,		/* MB of transcoded output kept on disk */
+	PRETRANSCODE,			/* transcode new files into the cache in the background */
+	PRETRANSCODE_JOBS,		/* background transcoders run at once */
+	PRETRANSCODE_NICE,		/* niceness of the background transcoders */
+	PRETRANSCODE_QUOTA,		/* MB of the transcode cache they may fill */
+	STREAM_THREADS,			/* threads streaming untranscoded files */
+	SCANNER_THREADS,		/* threads reading metadata during a scan */
+	KEEPALIVE_TIMEOUT,		/* seconds an idle HTTP connection is kept open */
+	KEEPALIVE_REQUESTS		/* requests served over one HTTP connection */
 };
 
 /* readoptionsfile()
@@ -0,0 +1,305 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "upnpglobalvars.h"
+#include "pretranscode.h"
+#include "transcode.h"
+#include "transcodecache.h"
+#include "process.h"
+#include "clients.h"
+#include "sql.h"
+#include "utils.h"
+#include "log.h"
+
+/* Files waiting to be transcoded ahead of time are queued in the
+ * PRETRANSCODE table by the scanner and inotify.  While no streams are
+ * being served the main process forks low priority jobs that fill the
+ * transcode cache with every segment of the queued files, for each
+ * transcoder some client would use on them.  Entries leave the queue once
+ * the file is fully cached, so the queue survives restarts. */
+
+#define PRETRANSCODE_RECHECK 60		/* seconds between looks at an empty queue */
+
+struct pretranscode_job_s {
+	pid_t pid;
+	int64_t id;
+};
+
+static struct pretranscode_job_s *jobs = NULL;
+static time_t next_check = 0;
+
+void
+pretranscode_add(int64_t id)
+{
+	if (!GETFLAG(PRETRANSCODE_MASK) || !runtime_vars.transcode_cache_size)
+		return;
+	sql_exec(db, "INSERT OR IGNORE into PRETRANSCODE (ID) values (%lld)", (long long)id);
+}
+
+void
+pretranscode_remove(int64_t id)
+{
+	sql_exec(db, "DELETE from PRETRANSCODE where ID = %lld", (long long)id);
+}
+
+static off_t
+pretranscode_quota(void)
+{
+	int quota = runtime_vars.pretranscode_quota;
+
+	if (quota < 0 || quota > runtime_vars.transcode_cache_size)
+		quota = runtime_vars.transcode_cache_size / 2;
+
+	return (off_t)quota * 1024 * 1024;
+}
+
+/* Transcodes every segment of a file that is not cached yet, one run per
+ * stretch of missing segments, split into the cache by the transcoder.
+ * Returns 1 when the quota stopped it and -1 if the transcoder failed. */
+static int
+pretranscode_file(char *path, char *transcoder, int duration)
+{
+	char dir[PATH_MAX], pattern[PATH_MAX];
+	char *buf, *splits;
+	int seg, last, segments, start, end;
+	int fd, pipefd, status, ok;
+	ssize_t n, total;
+	off_t size;
+	pid_t pid;
+
+	/* only transcoders splitting their own output are cached */
+	if (duration <= 0 || !transcode_segments(transcoder))
+		return 0;
+	if (transcode_cache_dir(path, transcoder, dir, sizeof(dir)) != 0)
+		return -1;
+	buf = malloc(65536);
+	if (!buf)
+		return -1;
+
+	segments = TRANSCODE_SEGMENTS(duration);
+	for (seg = 0; seg < segments; seg = last + 1)
+	{
+		fd = transcode_cache_open(dir, seg, &size);
+		if (fd >= 0)
+		{
+			close(fd);
+			last = seg;
+			continue;
+		}
+		if (transcode_cache_usage() >= pretranscode_quota())
+		{
+			DPRINTF(E_INFO, L_TRANSCODE, "Pre-transcoding quota reached\n");
+			free(buf);
+			return 1;
+		}
+
+		/* run up to the next segment that is cached */
+		for (last = seg; last + 1 < segments; last++)
+		{
+			fd = transcode_cache_open(dir, last + 1, &size);
+			if (fd >= 0)
+			{
+				close(fd);
+				break;
+			}
+		}
+		start = seg * TRANSCODE_SEGMENT_MS;
+		end = MIN((last + 1) * TRANSCODE_SEGMENT_MS, duration) - 1;
+		splits = transcode_cache_splits(start, end);
+		if (!splits)
+			break;
+		transcode_cache_pieces(dir, pattern, sizeof(pattern));
+		pid = exec_transcode(transcoder, path, start, end, pattern, splits, &pipefd);
+		free(splits);
+		if (pid < 0)
+			break;
+		/* the pieces are what is wanted, stdout is not */
+		ok = 1;
+		total = 0;
+		while ((n = read(pipefd, buf, 65536)) != 0)
+		{
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				ok = 0;
+				break;
+			}
+			total += n;
+		}
+		close(pipefd);
+		if (!ok)
+			kill(pid, SIGKILL);
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			ok = 0;
+		transcode_cache_commit_pieces(dir, seg, seg, last, ok && total > 0);
+		if (!ok || !total)
+		{
+			DPRINTF(E_WARN, L_TRANSCODE, "Pre-transcoding segments %d to %d of %s failed\n",
+			        seg, last, path);
+			break;
+		}
+	}
+	free(buf);
+
+	return (seg < segments) ? -1 : 0;
+}
+
+static void
+pretranscode_item(int64_t id)
+{
+	char path[PATH_MAX], mime[32];
+	char *done[16];
+	char *transcoder;
+	char **result;
+	char *sql;
+	int rows, duration, client, ndone = 0, i;
+	int ret = 0;
+
+	sql = sqlite3_mprintf("SELECT PATH, MIME, DURATION from DETAILS where ID = %lld", (long long)id);
+	ret = sql_get_table(db, sql, &result, &rows, NULL);
+	sqlite3_free(sql);
+	if (ret != SQLITE_OK)
+		return;
+	if (!rows || !result[3] || !result[4])
+	{
+		sqlite3_free_table(result);
+		pretranscode_remove(id);
+		return;
+	}
+	strncpyt(path, result[3], sizeof(path));
+	strncpyt(mime, result[4], sizeof(mime));
+	duration = 0;
+	if (result[5])
+	{
+		/* DURATION is H:MM:SS.mmm */
+		int h, m, sec, ms;
+		if (sscanf(result[5], "%d:%d:%d.%d", &h, &m, &sec, &ms) == 4)
+			duration = (3600*h + 60*m + sec)*1000 + ms;
+	}
+	sqlite3_free_table(result);
+
+	DPRINTF(E_INFO, L_TRANSCODE, "Pre-transcoding %s\n", path);
+	for (client = 0; client_types[client].name && ret == 0; client++)
+	{
+		if (client && !client_types[client].transcode_info)
+			continue;
+		transcoder = transcode_get_transcoder(mime[0], client);
+		if (!transcoder || mime[0] == 'i')
+			continue;
+		/* clients sharing a transcoder share its cache */
+		for (i = 0; i < ndone; i++)
+			if (strcmp(done[i], transcoder) == 0)
+				break;
+		if (i < ndone)
+			continue;
+		if (!transcode_decision(id, path, mime, client))
+			continue;
+		ret = pretranscode_file(path, transcoder, duration);
+		if (ndone < 16)
+			done[ndone++] = transcoder;
+	}
+	/* keep it queued if it only ran into the quota */
+	if (ret <= 0)
+		pretranscode_remove(id);
+}
+
+/* Called from a main loop timer; starts queued jobs while the server is idle */
+void
+pretranscode_run(void)
+{
+	char **result;
+	char *sql;
+	char buf[256];
+	int rows, running = 0, i, j;
+	time_t now;
+	pid_t pid;
+
+	if (!GETFLAG(PRETRANSCODE_MASK) || !runtime_vars.transcode_cache_size ||
+	    runtime_vars.pretranscode_jobs <= 0 || scanning)
+		return;
+	if (!jobs)
+	{
+		jobs = calloc(runtime_vars.pretranscode_jobs, sizeof(struct pretranscode_job_s));
+		if (!jobs)
+			return;
+	}
+
+	for (i = 0; i < runtime_vars.pretranscode_jobs; i++)
+	{
+		if (jobs[i].pid && kill(jobs[i].pid, 0) != 0)
+			jobs[i].pid = 0;
+		if (jobs[i].pid)
+			running++;
+	}
+	/* anything else forked is serving a stream */
+	if (running >= runtime_vars.pretranscode_jobs || number_of_children > running)
+		return;
+	now = time(NULL);
+	if (now < next_check)
+		return;
+	if (transcode_cache_usage() >= pretranscode_quota())
+	{
+		next_check = now + PRETRANSCODE_RECHECK;
+		return;
+	}
+
+	/* skip the files already being worked on */
+	strcpy(buf, "0");
+	for (i = 0; i < runtime_vars.pretranscode_jobs; i++)
+		if (jobs[i].pid)
+			snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), ",%lld", (long long)jobs[i].id);
+	sql = sqlite3_mprintf("SELECT ID from PRETRANSCODE where ID not in (%s) order by ID limit %d",
+	                      buf, runtime_vars.pretranscode_jobs - running);
+	i = sql_get_table(db, sql, &result, &rows, NULL);
+	sqlite3_free(sql);
+	if (i != SQLITE_OK)
+		return;
+	if (!rows)
+		next_check = now + PRETRANSCODE_RECHECK;
+
+	for (i = 1, j = 0; i <= rows; i++)
+	{
+		while (jobs[j].pid)
+			j++;
+		pid = process_fork(NULL);
+		if (pid < 0)
+			break;
+		if (pid == 0)
+		{
+			setpriority(PRIO_PROCESS, 0, runtime_vars.pretranscode_nice);
+			pretranscode_item(strtoll(result[i], NULL, 10));
+			_exit(0);
+		}
+		jobs[j].pid = pid;
+		jobs[j].id = strtoll(result[i], NULL, 10);
+	}
+	sqlite3_free_table(result);
+}
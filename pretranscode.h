@@ -0,0 +1,29 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __PRETRANSCODE_H__
+#define __PRETRANSCODE_H__
+
+#include <stdint.h>
+
+#define PRETRANSCODE_MAX_JOBS 8
+#define PRETRANSCODE_INTERVAL 5		/* seconds between looks at the queue */
+
+void pretranscode_add(int64_t id);
+void pretranscode_remove(int64_t id);
+void pretranscode_run(void);
+
+#endif
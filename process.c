@@ -41,6 +41,8 @@
 #include "upnpglobalvars.h"
 #include "process.h"
 #include "config.h"
+#include "sql.h"
+#include "event.h"
 #include "log.h"
 
 struct child *children = NULL;
@@ -93,8 +95,12 @@ process_fork(struct client_cache_s *client)
 		return -1;
 	}
 
+	sql_fork_prepare();
 	pid_t pid = fork();
-	if (pid > 0)
+	sql_fork_done(pid == 0);
+	if (pid == 0)
+		event_fork_child();
+	else if (pid > 0)
 	{
 		number_of_children++;
 		if (client)
@@ -23,6 +23,7 @@
 #include <locale.h>
 #include <libgen.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -45,6 +46,8 @@
 #include "scanner.h"
 #include "albumart.h"
 #include "containers.h"
+#include "pretranscode.h"
+#include "filecache.h"
 #include "log.h"
 
 #if SCANDIR_CONST
@@ -393,7 +396,7 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 
 	if( strcmp(base, BROWSEDIR_ID) != 0 )
 	{
-		int found = 0;
+		int found = 0, children = 0;
 		char id_buf[64], parent_buf[64], refID[64];
 		char *dir_buf, *dir;
 
@@ -406,23 +409,24 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 		{
 			if( valid_cache && strcmp(id_buf, last_found) == 0 )
 				break;
-			if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%s'", id_buf) > 0 )
+			if( sql_get_int_param(db, "SELECT count(*) from OBJECTS where OBJECT_ID = ?", "s", id_buf) > 0 )
 			{
 				strcpy(last_found, id_buf);
 				break;
 			}
 			/* Does not exist.  Need to create, and may need to create parents also */
-			result = sql_get_text_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s'", refID);
+			result = sql_get_text_param(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = ?", "s", refID);
 			if( result )
 			{
 				detailID = strtoll(result, NULL, 10);
 				sqlite3_free(result);
 			}
-			sql_exec(db, "INSERT into OBJECTS"
-			             " (OBJECT_ID, PARENT_ID, REF_ID, DETAIL_ID, CLASS, NAME) "
-			             "VALUES"
-			             " ('%s', '%s', %Q, %lld, '%s', '%q')",
-			             id_buf, parent_buf, refID, detailID, class, strrchr(dir, '/')+1);
+			/* Parents come after their child, too late for the trigger */
+			sql_exec_param(db, "INSERT into OBJECTS"
+			                   " (OBJECT_ID, PARENT_ID, REF_ID, DETAIL_ID, CLASS, NAME, CHILD_COUNT) "
+			                   "VALUES (?, ?, ?, ?, ?, ?, ?)", "sssIssi",
+			                   id_buf, parent_buf, refID, detailID, class, strrchr(dir, '/')+1, children);
+			children = 1;
 			if( (p = strrchr(id_buf, '$')) )
 				*p = '\0';
 			if( (p = strrchr(parent_buf, '$')) )
@@ -445,46 +449,74 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 	return detailID;
 }
 
-int
-insert_file(char *name, const char *path, const char *parentID, int object, media_types types)
-{
-	char class[32];
-	char objectID[64];
-	int64_t detailID = 0;
+/* What read_file() learned about a file, for store_file() */
+struct file_info {
 	char base[8];
-	char *typedir_parentID;
-	char *baseid;
+	char class[32];
+	int skip;
+	int playlist;
+	struct media_details d;
+};
+
+/* The half of insert_file() that only reads the file, so that scanner
+ * workers can run it while the database is busy with earlier files */
+static void
+read_file(char *name, const char *path, media_types types, struct file_info *f)
+{
 	char *orig_name = NULL;
+	int found = 0;
 
+	memset(f, '\0', sizeof(*f));
 	if( (types & TYPE_IMAGES) && is_image(name) )
 	{
 		if( is_album_art(name) )
-			return -1;
-		strcpy(base, IMAGE_DIR_ID);
-		strcpy(class, "item.imageItem.photo");
-		detailID = GetImageMetadata(path, name);
+		{
+			f->skip = 1;
+			return;
+		}
+		strcpy(f->base, IMAGE_DIR_ID);
+		strcpy(f->class, "item.imageItem.photo");
+		found = ReadImageMetadata(path, name, &f->d);
 	}
 	else if( (types & TYPE_VIDEO) && is_video(name) )
 	{
  		orig_name = strdup(name);
-		strcpy(base, VIDEO_DIR_ID);
-		strcpy(class, "item.videoItem");
-		detailID = GetVideoMetadata(path, name);
-		if( !detailID )
+		strcpy(f->base, VIDEO_DIR_ID);
+		strcpy(f->class, "item.videoItem");
+		found = ReadVideoMetadata(path, name, &f->d);
+		if( !found )
 			strcpy(name, orig_name);
 	}
 	else if( is_playlist(name) )
 	{
-		if( insert_playlist(path, name) == 0 )
-			return 1;
+		f->playlist = 1;
+		return;
 	}
-	if( !detailID && (types & TYPE_AUDIO) && is_audio(name) )
+	if( !found && (types & TYPE_AUDIO) && is_audio(name) )
 	{
-		strcpy(base, MUSIC_DIR_ID);
-		strcpy(class, "item.audioItem.musicTrack");
-		detailID = GetAudioMetadata(path, name);
+		strcpy(f->base, MUSIC_DIR_ID);
+		strcpy(f->class, "item.audioItem.musicTrack");
+		ReadAudioMetadata(path, name, &f->d);
 	}
 	free(orig_name);
+}
+
+static int
+store_file(char *name, const char *path, const char *parentID, int object, struct file_info *f)
+{
+	char objectID[64], parent[64], item[64];
+	int64_t detailID = 0;
+	char *base = f->base, *class = f->class;
+	char *typedir_parentID;
+	char *baseid;
+
+	if( f->skip )
+		return -1;
+	if( f->playlist && insert_playlist(path, name) == 0 )
+		return 1;
+	if( f->d.sql )
+		detailID = StoreMetadata(path, &f->d);
+	free_media_details(&f->d);
 	if( !detailID )
 	{
 		DPRINTF(E_WARN, L_SCANNER, "Unsuccessful getting details for %s!\n", path);
@@ -492,12 +524,12 @@ insert_file(char *name, const char *path, const char *parentID, int object, medi
 	}
 
 	sprintf(objectID, "%s%s$%X", BROWSEDIR_ID, parentID, object);
+	snprintf(parent, sizeof(parent), "%s%s", BROWSEDIR_ID, parentID);
 
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME) "
-	             "VALUES"
-	             " ('%s', '%s%s', '%s', %lld, '%q')",
-	             objectID, BROWSEDIR_ID, parentID, class, detailID, name);
+	sql_exec_param(db, "INSERT into OBJECTS"
+	                   " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME) "
+	                   "VALUES (?, ?, ?, ?, ?)", "sssIs",
+	                   objectID, parent, class, detailID, name);
 
 	if( *parentID )
 	{
@@ -512,16 +544,161 @@ insert_file(char *name, const char *path, const char *parentID, int object, medi
 		insert_directory(name, path, base, typedir_parentID, typedir_objectID);
 		free(typedir_parentID);
 	}
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
-	             "VALUES"
-	             " ('%s%s$%X', '%s%s', '%s', '%s', %lld, '%q')",
-	             base, parentID, object, base, parentID, objectID, class, detailID, name);
+	snprintf(parent, sizeof(parent), "%s%s", base, parentID);
+	snprintf(item, sizeof(item), "%s$%X", parent, object);
+	sql_exec_param(db, "INSERT into OBJECTS"
+	                   " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
+	                   "VALUES (?, ?, ?, ?, ?, ?)", "ssssIs",
+	                   item, parent, objectID, class, detailID, name);
 
 	insert_containers(name, path, objectID, class, detailID);
+	if( *base != *IMAGE_DIR_ID )
+		pretranscode_add(detailID);
 	return 0;
 }
 
+int
+insert_file(char *name, const char *path, const char *parentID, int object, media_types types)
+{
+	struct file_info f;
+
+	read_file(name, path, types, &f);
+	return store_file(name, path, parentID, object, &f);
+}
+
+int
+remove_file(const char *path)
+{
+	char sql[128];
+	char art_cache[PATH_MAX];
+	char *id;
+	char *ptr;
+	char **result;
+	int64_t detailID;
+	int rows, playlist;
+
+	if( is_caption(path) )
+	{
+		return sql_exec(db, "DELETE from CAPTIONS where PATH = '%q'", path);
+	}
+	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
+	valid_cache = 0;
+	playlist = is_playlist(path);
+	if( playlist )
+		id = sql_get_text_param(db, "SELECT ID from PLAYLISTS where PATH = ?", "s", path);
+	else
+		id = sql_get_text_param(db, "SELECT ID from DETAILS where PATH = ?", "s", path);
+	if( !id )
+		return 1;
+	detailID = strtoll(id, NULL, 10);
+	sqlite3_free(id);
+	if( playlist )
+	{
+		sql_exec(db, "DELETE from PLAYLISTS where ID = %lld", detailID);
+		sql_exec(db, "DELETE from DETAILS where ID ="
+		             " (SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s$%llX')",
+		         MUSIC_PLIST_ID, detailID);
+		sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s$%llX' or PARENT_ID = '%s$%llX'",
+		         MUSIC_PLIST_ID, detailID, MUSIC_PLIST_ID, detailID);
+	}
+	else
+	{
+		/* Delete the parent containers if we are about to empty them. */
+		snprintf(sql, sizeof(sql), "SELECT PARENT_ID from OBJECTS where DETAIL_ID = %lld"
+		                           " and PARENT_ID not like '64$%%'",
+		                           (long long int)detailID);
+		if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
+		{
+			int i, children;
+			for( i = 1; i <= rows; i++ )
+			{
+				/* If it's a playlist item, adjust the item count of the playlist */
+				if( strncmp(result[i], MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 )
+				{
+					sql_exec(db, "UPDATE PLAYLISTS set FOUND = (FOUND-1) where ID = %d",
+					         atoi(strrchr(result[i], '$') + 1));
+				}
+
+				children = sql_get_int_param(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?", "s", result[i]);
+				if( children < 0 )
+					continue;
+				if( children < 2 )
+				{
+					sql_exec_param(db, "DELETE from OBJECTS where OBJECT_ID = ?", "s", result[i]);
+
+					ptr = strrchr(result[i], '$');
+					if( ptr )
+						*ptr = '\0';
+					if( sql_get_int_param(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?", "s", result[i]) == 0 )
+					{
+						sql_exec_param(db, "DELETE from OBJECTS where OBJECT_ID = ?", "s", result[i]);
+					}
+				}
+			}
+			sqlite3_free_table(result);
+		}
+		/* Now delete the actual objects */
+		sql_exec_param(db, "DELETE from DETAILS where ID = ?", "I", detailID);
+		sql_exec_param(db, "DELETE from OBJECTS where DETAIL_ID = ?", "I", detailID);
+		sql_exec_param(db, "DELETE from TRANSCODE where ID = ?", "I", detailID);
+		pretranscode_remove(detailID);
+		file_cache_invalidate(detailID);
+	}
+	snprintf(art_cache, sizeof(art_cache), "%s/art_cache%s", db_path, path);
+	remove(art_cache);
+
+	return 0;
+}
+
+/* Removes a directory and everything below it.  Files go one by one, so
+ * that the virtual containers they leave empty go too. */
+int
+remove_directory(const char *path)
+{
+	char *sql;
+	char **result;
+	int64_t detailID = 0;
+	int rows, i, ret = 1;
+
+	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
+	valid_cache = 0;
+	sql = sqlite3_mprintf("SELECT PATH from DETAILS where PATH > '%q/' and PATH <= '%q/%c' and MIME is not NULL"
+	                      " UNION SELECT PATH from PLAYLISTS where PATH > '%q/' and PATH <= '%q/%c'",
+	                      path, path, 0xFF, path, path, 0xFF);
+	if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
+	{
+		for( i=1; i <= rows; i++ )
+			remove_file(result[i]);
+		sqlite3_free_table(result);
+	}
+	sqlite3_free(sql);
+
+	sql = sqlite3_mprintf("SELECT ID from DETAILS where (PATH > '%q/' and PATH <= '%q/%c')"
+	                      " or PATH = '%q'", path, path, 0xFF, path);
+	if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
+	{
+		if( rows )
+		{
+			for( i=1; i <= rows; i++ )
+			{
+				detailID = strtoll(result[i], NULL, 10);
+				sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
+				sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
+				sql_exec(db, "DELETE from TRANSCODE where ID = %lld", detailID);
+				pretranscode_remove(detailID);
+				file_cache_invalidate(detailID);
+			}
+			ret = 0;
+		}
+		sqlite3_free_table(result);
+	}
+	sqlite3_free(sql);
+	/* Clean up any album art entries in the deleted directory */
+	sql_exec(db, "DELETE from ALBUM_ART where (PATH > '%q/' and PATH <= '%q/%c')", path, path, 0xFF);
+
+	return ret;
+}
+
 int
 CreateDatabase(void)
 {
@@ -549,9 +726,15 @@ CreateDatabase(void)
 			0 };
 
 	ret = sql_exec(db, create_objectTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_childCountTriggers_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_detailTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = db_create_fts(db);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_albumArtTable_sqlite);
@@ -564,6 +747,12 @@ CreateDatabase(void)
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_playlistTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_transcodeTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_pretranscodeTable_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_settingsTable_sqlite);
@@ -600,14 +789,7 @@ CreateDatabase(void)
 				goto sql_failed;
 		}
 	}
-	sql_exec(db, "create INDEX IDX_OBJECTS_OBJECT_ID ON OBJECTS(OBJECT_ID);");
-	sql_exec(db, "create INDEX IDX_OBJECTS_PARENT_ID ON OBJECTS(PARENT_ID);");
-	sql_exec(db, "create INDEX IDX_OBJECTS_DETAIL_ID ON OBJECTS(DETAIL_ID);");
-	sql_exec(db, "create INDEX IDX_OBJECTS_CLASS ON OBJECTS(CLASS);");
-	sql_exec(db, "create INDEX IDX_DETAILS_PATH ON DETAILS(PATH);");
-	sql_exec(db, "create INDEX IDX_DETAILS_ID ON DETAILS(ID);");
-	sql_exec(db, "create INDEX IDX_ALBUM_ART ON ALBUM_ART(ID);");
-	sql_exec(db, "create INDEX IDX_SCANNER_OPT ON OBJECTS(PARENT_ID, NAME, OBJECT_ID);");
+	db_create_indexes(db);
 
 sql_failed:
 	if( ret != SQLITE_OK )
@@ -713,44 +895,413 @@ filter_avp(scan_filter *d)
 	       );
 }
 
+/* Scanner writes are grouped in transactions of up to SCAN_BATCH_ROWS
+ * files, committed at least every SCAN_BATCH_MS so that clients browsing
+ * during the scan see it progress.  Only one thread writes at a time:
+ * the walker, or the writer thread while it runs.  The batch belongs to
+ * the thread that began it, and scan_lock guards it, so the other thread
+ * can neither commit it nor mistake it for its own; the walker commits
+ * its batch before handing the database over in scan_queue() and
+ * scan_flush(). */
+#define SCAN_BATCH_ROWS		1000
+#define SCAN_BATCH_MS		2000
+
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static int batch_rows;
+static pthread_t batch_owner;
+static struct timeval batch_start;
+
 static void
-ScanDirectory(const char *dir, const char *parent, media_types dir_types)
+batch_begin(void)
 {
-	struct dirent **namelist;
-	int i, n, startID = 0;
-	char *full_path;
-	char *name = NULL;
-	static long long unsigned int fileno = 0;
-	enum file_types type;
+	pthread_mutex_lock(&scan_lock);
+	if (batch_rows++)
+	{
+		if (!pthread_equal(batch_owner, pthread_self()))
+			DPRINTF(E_ERROR, L_SCANNER, "Scanner batch begun while another thread has one open\n");
+		pthread_mutex_unlock(&scan_lock);
+		return;
+	}
+	batch_owner = pthread_self();
+	gettimeofday(&batch_start, NULL);
+	pthread_mutex_unlock(&scan_lock);
+	sql_exec(db, "BEGIN");
+}
 
-	DPRINTF(parent?E_INFO:E_WARN, L_SCANNER, _("Scanning %s\n"), dir);
+/* Commits the calling thread's batch, if it has one open */
+static void
+batch_commit(void)
+{
+	int rows;
+
+	pthread_mutex_lock(&scan_lock);
+	rows = batch_rows;
+	if (rows && !pthread_equal(batch_owner, pthread_self()))
+		rows = 0;
+	else
+		batch_rows = 0;
+	pthread_mutex_unlock(&scan_lock);
+	if (rows)
+		sql_exec(db, "COMMIT");
+}
+
+static void
+batch_tick(void)
+{
+	struct timeval now;
+	int rows;
+
+	pthread_mutex_lock(&scan_lock);
+	rows = batch_rows;
+	pthread_mutex_unlock(&scan_lock);
+	if (rows < SCAN_BATCH_ROWS)
+	{
+		gettimeofday(&now, NULL);
+		if ((now.tv_sec - batch_start.tv_sec) * 1000 +
+		    (now.tv_usec - batch_start.tv_usec) / 1000 < SCAN_BATCH_MS)
+			return;
+	}
+	batch_commit();
+}
+
+/* Settings for the length of a scan.  A full scan that dies halfway is
+ * started over, so it can skip syncing; a rescan updates a database that
+ * is in use and keeps that. */
+static void
+scan_pragmas(int scanning, int full)
+{
+	if (scanning)
+	{
+		if (full)
+			sql_exec(db, "pragma synchronous = OFF");
+		sql_exec(db, "pragma cache_size = 16384");
+		sql_exec(db, "pragma temp_store = MEMORY");
+		sql_exec(db, "pragma mmap_size = 268435456");
+	}
+	else
+	{
+		char *mode;
+
+		/* back to what open_db() chose: without WAL only FULL is safe */
+		mode = sql_get_text_field(db, "pragma journal_mode");
+		if (mode && strcasecmp(mode, "wal") == 0)
+			sql_exec(db, "pragma synchronous = NORMAL");
+		else
+			sql_exec(db, "pragma synchronous = FULL");
+		sqlite3_free(mode);
+		sql_exec(db, "pragma cache_size = 8192");
+		sql_exec(db, "pragma temp_store = DEFAULT");
+		sql_exec(db, "pragma mmap_size = 0");
+		sql_exec(db, "pragma wal_checkpoint(TRUNCATE)");
+	}
+}
+
+/* With scanner_threads above one, ScanDirectory() only walks the tree and
+ * queues what it finds.  Workers read the metadata of queued files, and a
+ * single writer thread stores the jobs strictly in queue order, so object
+ * and detail IDs come out the same as with a serial scan. */
+struct scan_job {
+	struct scan_job *next;		/* queue order */
+	struct scan_job *work_next;	/* files waiting for a worker */
+	char *name;
+	char *path;
+	char *parent;
+	int object;
+	media_types types;
+	int dir;
+	int done;
+	struct file_info f;
+};
+
+#define SCAN_QUEUE_PER_THREAD	64
+
+static pthread_cond_t scan_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scan_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scan_space_cond = PTHREAD_COND_INITIALIZER;
+static struct scan_job *scan_head, *scan_tail;
+static struct scan_job *work_head, *work_tail;
+static int scan_len, scan_max;
+static int scan_finished;
+static int writer_idle;
+static int scan_nthreads;
+static pthread_t *scan_threads;
+static long long unsigned int files_found = 0;
+
+static void
+free_scan_job(struct scan_job *job)
+{
+	free(job->name);
+	free(job->path);
+	free(job->parent);
+	free(job);
+}
+
+static void *
+scan_worker(void *arg)
+{
+	struct scan_job *job;
+
+	pthread_mutex_lock(&scan_lock);
+	for (;;)
+	{
+		while (!work_head && !scan_finished)
+			pthread_cond_wait(&scan_work_cond, &scan_lock);
+		if (!work_head)
+			break;
+		job = work_head;
+		work_head = job->work_next;
+		if (!work_head)
+			work_tail = NULL;
+		pthread_mutex_unlock(&scan_lock);
+
+		read_file(job->name, job->path, job->types, &job->f);
+
+		pthread_mutex_lock(&scan_lock);
+		job->done = 1;
+		if (job == scan_head)
+			pthread_cond_signal(&scan_done_cond);
+	}
+	pthread_mutex_unlock(&scan_lock);
+
+	return NULL;
+}
+
+static void *
+scan_writer(void *arg)
+{
+	struct scan_job *job;
+
+	pthread_mutex_lock(&scan_lock);
+	for (;;)
+	{
+		while (!scan_head || !scan_head->done)
+		{
+			/* Commit whenever we run dry, so that scan_flush()
+			 * hands the walker a quiet database */
+			if (batch_rows && pthread_equal(batch_owner, pthread_self()) && !scan_head)
+			{
+				pthread_mutex_unlock(&scan_lock);
+				batch_commit();
+				pthread_mutex_lock(&scan_lock);
+				continue;
+			}
+			if (scan_finished && !scan_head)
+				goto out;
+			writer_idle = 1;
+			pthread_cond_broadcast(&scan_space_cond);
+			pthread_cond_wait(&scan_done_cond, &scan_lock);
+			writer_idle = 0;
+		}
+		job = scan_head;
+		pthread_mutex_unlock(&scan_lock);
+
+		batch_begin();
+		if (job->dir)
+			insert_directory(job->name, job->path, BROWSEDIR_ID, job->parent, job->object);
+		else if (store_file(job->name, job->path, job->parent, job->object, &job->f) == 0)
+			files_found++;
+		batch_tick();
+
+		pthread_mutex_lock(&scan_lock);
+		scan_head = job->next;
+		if (!scan_head)
+			scan_tail = NULL;
+		scan_len--;
+		pthread_cond_broadcast(&scan_space_cond);
+		free_scan_job(job);
+	}
+out:
+	pthread_mutex_unlock(&scan_lock);
+
+	return NULL;
+}
+
+/* Wait until everything queued so far is in the database, before the
+ * walker touches it itself */
+static void
+scan_flush(void)
+{
+	if (!scan_nthreads)
+		return;
+	batch_commit();
+	pthread_mutex_lock(&scan_lock);
+	while (scan_head || !writer_idle)
+		pthread_cond_wait(&scan_space_cond, &scan_lock);
+	pthread_mutex_unlock(&scan_lock);
+}
+
+static void
+scan_queue(const char *name, const char *path, const char *parent, int object, media_types types, int dir)
+{
+	struct scan_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (!job || !(job->name = strdup(name)) || !(job->path = strdup(path)) ||
+	    !(job->parent = strdup(parent)))
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "Memory allocation failed queueing %s\n", path);
+		if (job)
+			free_scan_job(job);
+		return;
+	}
+	job->object = object;
+	job->types = types;
+	job->dir = dir;
+	job->done = dir;
+
+	/* the writer thread may pick it up right away */
+	batch_commit();
+	pthread_mutex_lock(&scan_lock);
+	while (scan_len >= scan_max)
+		pthread_cond_wait(&scan_space_cond, &scan_lock);
+	if (scan_tail)
+		scan_tail->next = job;
+	else
+		scan_head = job;
+	scan_tail = job;
+	scan_len++;
+	if (dir)
+	{
+		if (job == scan_head)
+			pthread_cond_signal(&scan_done_cond);
+	}
+	else
+	{
+		if (work_tail)
+			work_tail->work_next = job;
+		else
+			work_head = job;
+		work_tail = job;
+		pthread_cond_signal(&scan_work_cond);
+	}
+	pthread_mutex_unlock(&scan_lock);
+}
+
+#if LIBAVCODEC_VERSION_MAJOR < 58
+/* Older libavcodec needs this to open codecs from several threads */
+static int
+lav_lockmgr(void **mutex, enum AVLockOp op)
+{
+	switch (op)
+	{
+	case AV_LOCK_CREATE:
+		*mutex = malloc(sizeof(pthread_mutex_t));
+		if (!*mutex)
+			return 1;
+		return pthread_mutex_init(*mutex, NULL) != 0;
+	case AV_LOCK_OBTAIN:
+		return pthread_mutex_lock(*mutex) != 0;
+	case AV_LOCK_RELEASE:
+		return pthread_mutex_unlock(*mutex) != 0;
+	case AV_LOCK_DESTROY:
+		pthread_mutex_destroy(*mutex);
+		free(*mutex);
+		*mutex = NULL;
+		return 0;
+	}
+	return 1;
+}
+#endif
+
+static void
+scan_stop(void)
+{
+	int i;
+
+	if (!scan_nthreads)
+		return;
+	pthread_mutex_lock(&scan_lock);
+	scan_finished = 1;
+	pthread_cond_broadcast(&scan_work_cond);
+	pthread_cond_broadcast(&scan_done_cond);
+	pthread_mutex_unlock(&scan_lock);
+	for (i = 0; i < scan_nthreads; i++)
+		pthread_join(scan_threads[i], NULL);
+	free(scan_threads);
+	scan_threads = NULL;
+	scan_nthreads = 0;
+}
+
+static void
+scan_start(void)
+{
+	int i, n = runtime_vars.scanner_threads;
+
+	if (n <= 0)
+	{
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n > 8)
+			n = 8;
+	}
+	if (n <= 1)
+		return;
+
+	scan_threads = calloc(n + 1, sizeof(pthread_t));
+	if (!scan_threads)
+		return;
+#if LIBAVCODEC_VERSION_MAJOR < 58
+	av_lockmgr_register(lav_lockmgr);
+#endif
+	scan_max = n * SCAN_QUEUE_PER_THREAD;
+	scan_finished = 0;
+	writer_idle = 0;
+	if (pthread_create(&scan_threads[0], NULL, scan_writer, NULL) != 0)
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "Failed to start the scanner writer thread\n");
+		free(scan_threads);
+		scan_threads = NULL;
+		return;
+	}
+	for (i = 1; i <= n; i++)
+	{
+		if (pthread_create(&scan_threads[i], NULL, scan_worker, NULL) != 0)
+			break;
+	}
+	scan_nthreads = i;
+	if (i == 1)
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "Failed to start scanner threads\n");
+		scan_stop();
+		return;
+	}
+	DPRINTF(E_WARN, L_SCANNER, "Scanning with %d metadata threads\n", i - 1);
+}
+
+static int
+list_directory(const char *dir, struct dirent ***namelist, media_types dir_types)
+{
 	switch( dir_types )
 	{
 		case ALL_MEDIA:
-			n = scandir(dir, &namelist, filter_avp, alphasort);
-			break;
+			return scandir(dir, namelist, filter_avp, alphasort);
 		case TYPE_AUDIO:
-			n = scandir(dir, &namelist, filter_a, alphasort);
-			break;
+			return scandir(dir, namelist, filter_a, alphasort);
 		case TYPE_AUDIO|TYPE_VIDEO:
-			n = scandir(dir, &namelist, filter_av, alphasort);
-			break;
+			return scandir(dir, namelist, filter_av, alphasort);
 		case TYPE_AUDIO|TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_ap, alphasort);
-			break;
+			return scandir(dir, namelist, filter_ap, alphasort);
 		case TYPE_VIDEO:
-			n = scandir(dir, &namelist, filter_v, alphasort);
-			break;
+			return scandir(dir, namelist, filter_v, alphasort);
 		case TYPE_VIDEO|TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_vp, alphasort);
-			break;
+			return scandir(dir, namelist, filter_vp, alphasort);
 		case TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_p, alphasort);
-			break;
+			return scandir(dir, namelist, filter_p, alphasort);
 		default:
-			n = -1;
-			break;
+			return -1;
 	}
+}
+
+static void
+ScanDirectory(const char *dir, const char *parent, media_types dir_types)
+{
+	struct dirent **namelist;
+	int i, n, startID = 0;
+	char *full_path;
+	char *name = NULL;
+	enum file_types type;
+
+	DPRINTF(parent?E_INFO:E_WARN, L_SCANNER, _("Scanning %s\n"), dir);
+	n = list_directory(dir, &namelist, dir_types);
 	if( n < 0 )
 	{
 		DPRINTF(E_WARN, L_SCANNER, "Error scanning %s\n", dir);
@@ -766,6 +1317,7 @@ ScanDirectory(const char *dir, const char *parent, media_types dir_types)
 
 	if( !parent )
 	{
+		scan_flush();
 		startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
 	}
 
@@ -793,15 +1345,29 @@ ScanDirectory(const char *dir, const char *parent, media_types dir_types)
 		if( (type == TYPE_DIR) && (access(full_path, R_OK|X_OK) == 0) )
 		{
 			char *parent_id;
-			insert_directory(name, full_path, BROWSEDIR_ID, THISORNUL(parent), i+startID);
+			if( scan_nthreads )
+				scan_queue(name, full_path, THISORNUL(parent), i+startID, dir_types, 1);
+			else
+			{
+				batch_begin();
+				insert_directory(name, full_path, BROWSEDIR_ID, THISORNUL(parent), i+startID);
+				batch_tick();
+			}
 			xasprintf(&parent_id, "%s$%X", THISORNUL(parent), i+startID);
 			ScanDirectory(full_path, parent_id, dir_types);
 			free(parent_id);
 		}
 		else if( type == TYPE_FILE && (access(full_path, R_OK) == 0) )
 		{
-			if( insert_file(name, full_path, THISORNUL(parent), i+startID, dir_types) == 0 )
-				fileno++;
+			if( scan_nthreads )
+				scan_queue(name, full_path, THISORNUL(parent), i+startID, dir_types, 0);
+			else
+			{
+				batch_begin();
+				if( insert_file(name, full_path, THISORNUL(parent), i+startID, dir_types) == 0 )
+					files_found++;
+				batch_tick();
+			}
 		}
 		free(name);
 		free(namelist[i]);
@@ -810,7 +1376,8 @@ ScanDirectory(const char *dir, const char *parent, media_types dir_types)
 	free(full_path);
 	if( !parent )
 	{
-		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), dir, fileno);
+		scan_flush();
+		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), dir, files_found);
 	}
 }
 
@@ -834,11 +1401,269 @@ _notify_stop(void)
 #endif
 }
 
+static void
+scan_media_dir(struct media_dir_s *media_path)
+{
+	char path[MAXPATHLEN];
+	int64_t id;
+	char *bname, *parent = NULL;
+	char buf[8];
+
+	strncpyt(path, media_path->path, sizeof(path));
+	bname = basename(path);
+	/* If there are multiple media locations, add a level to the ContentDirectory */
+	if( !GETFLAG(MERGE_MEDIA_DIRS_MASK) && media_dirs->next )
+	{
+		int startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
+		id = insert_directory(bname, path, BROWSEDIR_ID, "", startID);
+		sprintf(buf, "$%X", startID);
+		parent = buf;
+	}
+	else
+		id = GetFolderMetadata(bname, media_path->path, NULL, NULL, 0);
+	/* Use TIMESTAMP to store the media type */
+	sql_exec(db, "UPDATE DETAILS set TIMESTAMP = %d where ID = %lld", media_path->types, (long long)id);
+	ScanDirectory(media_path->path, parent, media_path->types);
+	scan_flush();
+	sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", media_path->path);
+}
+
+/* What the database holds for one entry of a directory being rescanned */
+struct known_entry {
+	const char *path;
+	const char *object_id;
+	long long timestamp;
+	long long size;
+	int dir;
+	int seen;
+};
+
+static int rescan_changes;
+
+static int
+known_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct known_entry *)a)->path, ((const struct known_entry *)b)->path);
+}
+
+/* Brings the database in line with one directory.  Unchanged entries keep
+ * their object IDs; new and modified files are appended to the directory
+ * the way inotify adds them, and whatever is gone is removed. */
+static void
+RescanDirectory(const char *dir, const char *parent, media_types dir_types)
+{
+	struct dirent **namelist;
+	struct known_entry *known = NULL, *k, key;
+	char parent_id[64];
+	char **result = NULL;
+	char *sql, *full_path, *name, *sub;
+	enum file_types type;
+	struct stat st;
+	int i, n, rows = 0, nknown = 0;
+	size_t len = strlen(dir);
+
+	n = list_directory(dir, &namelist, dir_types);
+	if( n < 0 )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Error scanning %s\n", dir);
+		return;
+	}
+	DPRINTF(E_DEBUG, L_SCANNER, "Rescanning %s\n", dir);
+
+	/* With merged media dirs the root holds the entries of all of them */
+	snprintf(parent_id, sizeof(parent_id), "%s%s", BROWSEDIR_ID, parent);
+	sql = sqlite3_mprintf("SELECT d.PATH, o.OBJECT_ID, d.TIMESTAMP, d.SIZE, d.MIME from OBJECTS o"
+	                      " left join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                      " where o.PARENT_ID = '%q' and d.PATH > '%q/' and d.PATH <= '%q/%c'",
+	                      parent_id, dir, dir, 0xFF);
+	full_path = malloc(PATH_MAX);
+	if( !full_path || sql_get_table(db, sql, &result, &rows, NULL) != SQLITE_OK ||
+	    (rows && !(known = calloc(rows, sizeof(*known)))) )
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "Failed to rescan %s\n", dir);
+		goto done;
+	}
+	for( i = 1; i <= rows; i++ )
+	{
+		char **row = result + i * 5;
+
+		if( strchr(row[0] + len + 1, '/') )
+			continue;
+		k = &known[nknown++];
+		k->path = row[0];
+		k->object_id = row[1];
+		k->timestamp = row[2] ? strtoll(row[2], NULL, 10) : 0;
+		k->size = row[3] ? strtoll(row[3], NULL, 10) : 0;
+		k->dir = !row[4];
+	}
+	qsort(known, nknown, sizeof(*known), known_cmp);
+
+	for( i = 0; i < n; i++ )
+	{
+#if !USE_FORK
+		if( quitting )
+			break;
+#endif
+		snprintf(full_path, PATH_MAX, "%s/%s", dir, namelist[i]->d_name);
+		if( is_dir(namelist[i]) == 1 )
+			type = TYPE_DIR;
+		else if( is_reg(namelist[i]) == 1 )
+			type = TYPE_FILE;
+		else
+			type = resolve_unknown_type(full_path, dir_types);
+		if( (type == TYPE_DIR && access(full_path, R_OK|X_OK) != 0) ||
+		    (type == TYPE_FILE && (access(full_path, R_OK) != 0 || stat(full_path, &st) != 0)) )
+			type = TYPE_UNKNOWN;
+
+		key.path = full_path;
+		k = nknown ? bsearch(&key, known, nknown, sizeof(*known), known_cmp) : NULL;
+		if( k && type == TYPE_UNKNOWN )
+			k = NULL;
+		else if( k )
+		{
+			k->seen = 1;
+			/* A file that became a directory or the other way round */
+			if( k->dir != (type == TYPE_DIR) )
+			{
+				batch_begin();
+				if( k->dir )
+					remove_directory(full_path);
+				else
+					remove_file(full_path);
+				batch_tick();
+				rescan_changes++;
+				k = NULL;
+			}
+		}
+
+		name = escape_tag(namelist[i]->d_name, 1);
+		if( type == TYPE_DIR )
+		{
+			if( k )
+				RescanDirectory(full_path, k->object_id + 2, dir_types);
+			else
+			{
+				int object = get_next_available_id("OBJECTS", parent_id);
+				batch_begin();
+				insert_directory(name, full_path, BROWSEDIR_ID, parent, object);
+				/* the writer thread, if any, takes over from here */
+				batch_commit();
+				xasprintf(&sub, "%s$%X", parent, object);
+				ScanDirectory(full_path, sub, dir_types);
+				scan_flush();
+				free(sub);
+				rescan_changes++;
+			}
+		}
+		else if( type == TYPE_FILE )
+		{
+			int changed = !k || k->timestamp != st.st_mtime || k->size != st.st_size;
+
+			/* Playlists only have a PLAYLISTS row */
+			if( !k && is_playlist(full_path) &&
+			    sql_get_int_param(db, "SELECT ID from PLAYLISTS where PATH = ?", "s", full_path) > 0 )
+				changed = 0;
+			if( changed )
+			{
+				batch_begin();
+				if( k )
+				{
+					DPRINTF(E_DEBUG, L_SCANNER, "%s changed since the last scan\n", full_path);
+					remove_file(full_path);
+				}
+				insert_file(name, full_path, parent, get_next_available_id("OBJECTS", parent_id), dir_types);
+				batch_tick();
+				rescan_changes++;
+			}
+		}
+		free(name);
+	}
+
+	for( i = 0; i < nknown; i++ )
+	{
+		if( known[i].seen )
+			continue;
+		DPRINTF(E_DEBUG, L_SCANNER, "%s is gone\n", known[i].path);
+		batch_begin();
+		if( known[i].dir )
+			remove_directory(known[i].path);
+		else
+			remove_file(known[i].path);
+		batch_tick();
+		rescan_changes++;
+	}
+
+done:
+	for( i = 0; i < n; i++ )
+		free(namelist[i]);
+	free(namelist);
+	free(known);
+	free(full_path);
+	if( result )
+		sqlite3_free_table(result);
+	sqlite3_free(sql);
+}
+
+/* Whether dir has anything in it; an unmounted share should not empty
+ * the database */
+static int
+dir_has_entries(const char *dir)
+{
+	DIR *d;
+	struct dirent *e;
+	int ret = 0;
+
+	d = opendir(dir);
+	if( !d )
+		return 0;
+	while( !ret && (e = readdir(d)) )
+		ret = (e->d_name[0] != '.');
+	closedir(d);
+
+	return ret;
+}
+
+static void
+rescan_media_dir(struct media_dir_s *media_path)
+{
+	char *id, *sql, **result;
+	int rows, i;
+
+	if( !dir_has_entries(media_path->path) &&
+	    sql_get_int_field(db, "SELECT count(*) from DETAILS where PATH > '%q/' and PATH <= '%q/%c'",
+	                      media_path->path, media_path->path, 0xFF) > 0 )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "%s is empty or unreadable, leaving its entries alone\n", media_path->path);
+		return;
+	}
+	DPRINTF(E_WARN, L_SCANNER, "Rescanning %s\n", media_path->path);
+
+	id = sql_get_text_field(db, "SELECT OBJECT_ID from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                            " where d.PATH = '%q' and REF_ID is NULL", media_path->path);
+	RescanDirectory(media_path->path, id ? id + 2 : "", media_path->types);
+	sqlite3_free(id);
+
+	sql = sqlite3_mprintf("SELECT PATH from PLAYLISTS where PATH > '%q/' and PATH <= '%q/%c'",
+	                      media_path->path, media_path->path, 0xFF);
+	if( sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK )
+	{
+		for( i = 1; i <= rows; i++ )
+		{
+			if( access(result[i], F_OK) != 0 )
+			{
+				remove_file(result[i]);
+				rescan_changes++;
+			}
+		}
+		sqlite3_free_table(result);
+	}
+	sqlite3_free(sql);
+}
+
 void
-start_scanner()
+start_scanner(void)
 {
 	struct media_dir_s *media_path;
-	char path[MAXPATHLEN];
 
 	if (setpriority(PRIO_PROCESS, 0, 15) == -1)
 		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce scanner thread priority\n");
@@ -848,28 +1673,12 @@ start_scanner()
 
 	av_register_all();
 	av_log_set_level(AV_LOG_PANIC);
+	scan_pragmas(1, 1);
+	scan_start();
 	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
-	{
-		int64_t id;
-		char *bname, *parent = NULL;
-		char buf[8];
-		strncpyt(path, media_path->path, sizeof(path));
-		bname = basename(path);
-		/* If there are multiple media locations, add a level to the ContentDirectory */
-		if( !GETFLAG(MERGE_MEDIA_DIRS_MASK) && media_dirs->next )
-		{
-			int startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
-			id = insert_directory(bname, path, BROWSEDIR_ID, "", startID);
-			sprintf(buf, "$%X", startID);
-			parent = buf;
-		}
-		else
-			id = GetFolderMetadata(bname, media_path->path, NULL, NULL, 0);
-		/* Use TIMESTAMP to store the media type */
-		sql_exec(db, "UPDATE DETAILS set TIMESTAMP = %d where ID = %lld", media_path->types, (long long)id);
-		ScanDirectory(media_path->path, parent, media_path->types);
-		sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", media_path->path);
-	}
+		scan_media_dir(media_path);
+	scan_stop();
+	batch_commit();
 	_notify_stop();
 	/* Create this index after scanning, so it doesn't slow down the scanning process.
 	 * This index is very useful for large libraries used with an XBox360 (or any
@@ -882,10 +1691,99 @@ start_scanner()
 	}
 	else
 	{
+		batch_begin();
 		fill_playlists();
+		batch_commit();
 	}
 
 	DPRINTF(E_DEBUG, L_SCANNER, "Initial file scan completed\n");
 	//JM: Set up a db version number, so we know if we need to rebuild due to a new structure.
 	sql_exec(db, "pragma user_version = %d;", DB_VERSION);
+	scan_pragmas(0, 1);
+}
+
+/* Updates an existing database instead of building a new one: media dirs
+ * no longer configured are removed, new ones are scanned, and with -r the
+ * others are compared against the filesystem. */
+void
+start_rescan(void)
+{
+	struct media_dir_s *media_path;
+	char **result;
+	int rows, i;
+
+	if (setpriority(PRIO_PROCESS, 0, 15) == -1)
+		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce scanner thread priority\n");
+	_notify_start();
+
+	setlocale(LC_COLLATE, "");
+
+	av_register_all();
+	av_log_set_level(AV_LOG_PANIC);
+	scan_pragmas(1, 0);
+	rescan_changes = 0;
+
+	if( sql_get_table(db, "SELECT VALUE from SETTINGS where KEY = 'media_dir'", &result, &rows, NULL) == SQLITE_OK )
+	{
+		for( i = 1; i <= rows; i++ )
+		{
+			for( media_path = media_dirs; media_path; media_path = media_path->next )
+			{
+				if( strcmp(result[i], media_path->path) == 0 )
+					break;
+			}
+			if( media_path )
+				continue;
+			DPRINTF(E_WARN, L_SCANNER, "Removing %s\n", result[i]);
+			batch_begin();
+			remove_directory(result[i]);
+			sql_exec(db, "DELETE from SETTINGS where KEY = 'media_dir' and VALUE = %Q", result[i]);
+			batch_commit();
+			rescan_changes++;
+		}
+		sqlite3_free_table(result);
+	}
+
+	scan_start();
+	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+	{
+		int types = sql_get_int_param(db, "SELECT TIMESTAMP from DETAILS where PATH = ?", "s", media_path->path);
+		int known = sql_get_int_param(db, "SELECT 1 from SETTINGS where KEY = 'media_dir' and VALUE = ?",
+		                              "s", media_path->path);
+
+		if( known && types == media_path->types )
+		{
+			if( GETFLAG(RESCAN_MASK) )
+				rescan_media_dir(media_path);
+			continue;
+		}
+		if( known )
+		{
+			DPRINTF(E_WARN, L_SCANNER, "Media types of %s changed\n", media_path->path);
+			batch_begin();
+			remove_directory(media_path->path);
+			sql_exec(db, "DELETE from SETTINGS where KEY = 'media_dir' and VALUE = %Q", media_path->path);
+			batch_commit();
+		}
+		scan_media_dir(media_path);
+		rescan_changes++;
+	}
+	scan_stop();
+	batch_commit();
+	_notify_stop();
+
+	if( rescan_changes )
+	{
+		if( GETFLAG(NO_PLAYLIST_MASK) )
+			DPRINTF(E_WARN, L_SCANNER, "Playlist creation disabled\n");
+		else
+		{
+			batch_begin();
+			fill_playlists();
+			batch_commit();
+		}
+	}
+	scan_pragmas(0, 0);
+
+	DPRINTF(E_WARN, L_SCANNER, "Rescan completed (%d changes)\n", rescan_changes);
 }
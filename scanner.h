@@ -77,10 +77,19 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 int
 insert_file(char *name, const char *path, const char *parentID, int object, media_types dir_types);
 
+int
+remove_file(const char *path);
+
+int
+remove_directory(const char *path);
+
 int
 CreateDatabase(void);
 
 void
-start_scanner();
+start_scanner(void);
+
+void
+start_rescan(void);
 
 #endif
@@ -29,7 +29,17 @@ char create_objectTable_sqlite[] = "CREATE TABLE OBJECTS ("
 					"REF_ID TEXT DEFAULT NULL, "
 					"CLASS TEXT NOT NULL, "
 					"DETAIL_ID INTEGER DEFAULT NULL, "
-                                        "NAME TEXT DEFAULT NULL);";
+                                        "NAME TEXT DEFAULT NULL, "
+					"CHILD_COUNT INTEGER DEFAULT 0);";
+
+/* Keep OBJECTS.CHILD_COUNT in step with every insert and delete, whoever
+ * does them (scanner, inotify, playlists) */
+char create_childCountTriggers_sqlite[] = "CREATE TRIGGER OBJECTS_CHILD_INSERT AFTER INSERT ON OBJECTS BEGIN "
+					"UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT + 1 where OBJECT_ID = new.PARENT_ID; "
+					"END; "
+					"CREATE TRIGGER OBJECTS_CHILD_DELETE AFTER DELETE ON OBJECTS BEGIN "
+					"UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT - 1 where OBJECT_ID = old.PARENT_ID; "
+					"END;";
 
 char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
@@ -54,7 +64,10 @@ char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
 					"ALBUM_ART INTEGER DEFAULT 0, "
 					"ROTATION INTEGER, "
 					"DLNA_PN TEXT, "
-					"MIME TEXT);";
+					"MIME TEXT, "
+					"CONTAINER TEXT, "
+					"VIDEO_CODEC TEXT, "
+					"AUDIO_CODEC TEXT);";
 
 char create_albumArtTable_sqlite[] = "CREATE TABLE ALBUM_ART ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
@@ -79,6 +92,20 @@ char create_playlistTable_sqlite[] = "CREATE TABLE PLAYLISTS ("
 					"FOUND INTEGER DEFAULT 0"
 					");";
 
+char create_transcodeTable_sqlite[] = "CREATE TABLE TRANSCODE ("
+					"ID INTEGER NOT NULL, "
+					"CLIENT INTEGER NOT NULL, "
+					"TIMESTAMP INTEGER, "
+					"TRANSCODE INTEGER, "
+					"MIME TEXT, "
+					"DLNA_PN TEXT, "
+					"PRIMARY KEY (ID, CLIENT)"
+					");";
+
+char create_pretranscodeTable_sqlite[] = "CREATE TABLE PRETRANSCODE ("
+					"ID INTEGER PRIMARY KEY"
+					");";
+
 char create_settingsTable_sqlite[] = "CREATE TABLE SETTINGS ("
 					"KEY TEXT NOT NULL, "
 					"VALUE TEXT"
@@ -0,0 +1,159 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include "soapcache.h"
+#include "upnpglobalvars.h"
+#include "log.h"
+
+/* LRU cache of rendered Browse and Search response bodies, keyed by the
+ * request and whatever about the client changes the answer.  Any change to
+ * the database bumps updateID, which empties the whole cache.  Responses
+ * that depend on the time as well expire on their own.  Only the main loop
+ * answers SOAP requests, so there is no lock. */
+struct soap_cache_entry_s {
+	TAILQ_ENTRY(soap_cache_entry_s) entries;
+	uint32_t hash;
+	size_t size;
+	time_t expires;		/* 0 for none */
+	int len;
+	char *key;
+	char *body;
+};
+
+static TAILQ_HEAD(soap_cache_head, soap_cache_entry_s) cache_head = TAILQ_HEAD_INITIALIZER(cache_head);
+static size_t cache_budget = 0;
+static size_t cache_used = 0;
+static unsigned int cache_update_id = 0;
+
+unsigned long soap_cache_hits = 0;
+unsigned long soap_cache_misses = 0;
+
+static uint32_t
+key_hash(const char *key)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*key)
+		hash = (hash ^ (unsigned char)*key++) * 16777619u;
+
+	return hash;
+}
+
+static void
+entry_free(struct soap_cache_entry_s *e)
+{
+	TAILQ_REMOVE(&cache_head, e, entries);
+	cache_used -= e->size;
+	free(e);
+}
+
+static void
+cache_flush(void)
+{
+	while (!TAILQ_EMPTY(&cache_head))
+		entry_free(TAILQ_FIRST(&cache_head));
+	cache_update_id = updateID;
+}
+
+/* size is the memory budget in KB, 0 disables the cache */
+int
+soap_cache_init(int size)
+{
+	if (size <= 0)
+		return 0;
+	cache_budget = (size_t)size * 1024;
+	cache_update_id = updateID;
+
+	return 0;
+}
+
+/* Returns the cached body for key, valid until the next soap_cache_put(),
+ * or NULL. */
+const char *
+soap_cache_get(const char *key, int *len)
+{
+	struct soap_cache_entry_s *e;
+	uint32_t hash;
+
+	if (!cache_budget)
+		return NULL;
+	if (cache_update_id != updateID)
+		cache_flush();
+	hash = key_hash(key);
+	TAILQ_FOREACH(e, &cache_head, entries)
+	{
+		if (e->hash != hash || strcmp(e->key, key) != 0)
+			continue;
+		if (e->expires && e->expires <= time(NULL))
+		{
+			entry_free(e);
+			break;
+		}
+		/* most recently used entries stay at the head */
+		TAILQ_REMOVE(&cache_head, e, entries);
+		TAILQ_INSERT_HEAD(&cache_head, e, entries);
+		soap_cache_hits++;
+		*len = e->len;
+		return e->body;
+	}
+	soap_cache_misses++;
+
+	return NULL;
+}
+
+/* ttl is in seconds, 0 keeps the body until updateID changes */
+void
+soap_cache_put(const char *key, const char *body, int len, int ttl)
+{
+	struct soap_cache_entry_s *e;
+	size_t keylen = strlen(key) + 1;
+	size_t size = sizeof(*e) + keylen + len;
+
+	/* a response rendered from an older database is not worth keeping */
+	if (!cache_budget || size > cache_budget / 4 || cache_update_id != updateID)
+		return;
+	e = malloc(size);
+	if (!e)
+		return;
+	e->hash = key_hash(key);
+	e->size = size;
+	e->expires = ttl ? time(NULL) + ttl : 0;
+	e->len = len;
+	e->key = (char *)(e + 1);
+	e->body = e->key + keylen;
+	memcpy(e->key, key, keylen);
+	memcpy(e->body, body, len);
+
+	while (cache_used + size > cache_budget)
+		entry_free(TAILQ_LAST(&cache_head, soap_cache_head));
+	TAILQ_INSERT_HEAD(&cache_head, e, entries);
+	cache_used += size;
+	DPRINTF(E_DEBUG, L_HTTP, "Cached %d byte response, %lu of %lu bytes used\n",
+		len, (unsigned long)cache_used, (unsigned long)cache_budget);
+}
+
+void
+soap_cache_free(void)
+{
+	cache_flush();
+	cache_budget = 0;
+}
@@ -0,0 +1,28 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SOAPCACHE_H__
+#define __SOAPCACHE_H__
+
+extern unsigned long soap_cache_hits;
+extern unsigned long soap_cache_misses;
+
+int soap_cache_init(int size);
+const char *soap_cache_get(const char *key, int *len);
+void soap_cache_put(const char *key, const char *body, int len, int ttl);
+void soap_cache_free(void);
+
+#endif
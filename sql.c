@@ -18,6 +18,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
 
 #include "sql.h"
 #include "upnpglobalvars.h"
@@ -259,6 +261,465 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 	return str;
 }
 
+/* Prepared statements of the fixed queries are kept across calls, so a
+ * repeated lookup only binds its parameters instead of being printed and
+ * parsed again.  They are keyed by connection and SQL text.  A statement
+ * is run under its connection's own mutex, so lookups on one connection
+ * never wait for another; the lock only guards the cache itself, and a
+ * statement in use is never evicted. */
+#define SQL_STMT_CACHE 32
+
+static struct {
+	sqlite3 *db;
+	const char *sql;
+	sqlite3_stmt *stmt;
+	int busy;
+} stmt_cache[SQL_STMT_CACHE];
+static int stmt_next = 0;
+static pthread_mutex_t stmt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static sqlite3_stmt *
+stmt_get(sqlite3 *db, const char *sql)
+{
+	sqlite3_stmt *stmt;
+	int i;
+
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		if (stmt_cache[i].stmt && stmt_cache[i].db == db &&
+		    (stmt_cache[i].sql == sql || strcmp(stmt_cache[i].sql, sql) == 0))
+		{
+			stmt_cache[i].busy = 1;
+			pthread_mutex_unlock(&stmt_lock);
+			return stmt_cache[i].stmt;
+		}
+	}
+	pthread_mutex_unlock(&stmt_lock);
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		return NULL;
+	}
+	/* slots are filled in turn, so once full the oldest makes room; each
+	 * thread holds at most one statement, so a free slot is found */
+	pthread_mutex_lock(&stmt_lock);
+	do {
+		i = stmt_next;
+		stmt_next = (stmt_next + 1) % SQL_STMT_CACHE;
+	} while (stmt_cache[i].busy);
+	if (stmt_cache[i].stmt)
+		sqlite3_finalize(stmt_cache[i].stmt);
+	stmt_cache[i].db = db;
+	stmt_cache[i].sql = sql;
+	stmt_cache[i].stmt = stmt;
+	stmt_cache[i].busy = 1;
+	pthread_mutex_unlock(&stmt_lock);
+
+	return stmt;
+}
+
+static void
+stmt_done(sqlite3_stmt *stmt)
+{
+	sqlite3 *db = sqlite3_db_handle(stmt);
+	int i;
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		if (stmt_cache[i].stmt != stmt)
+			continue;
+		stmt_cache[i].busy = 0;
+		break;
+	}
+	pthread_mutex_unlock(&stmt_lock);
+	sqlite3_mutex_leave(sqlite3_db_mutex(db));
+}
+
+/* Bind the parameters described by types ('i' int, 'I' int64_t, 's' text,
+ * NULL binding SQL NULL) and step once.  On success the statement is
+ * returned with the connection's mutex held, to be read and handed to
+ * stmt_done(). */
+static sqlite3_stmt *
+stmt_run(sqlite3 *db, const char *sql, const char *types, va_list ap, int *result)
+{
+	sqlite3_stmt *stmt;
+	int counter, i, ret = SQLITE_OK;
+
+	if (db == NULL)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "db is NULL\n");
+		return NULL;
+	}
+
+	sqlite3_mutex_enter(sqlite3_db_mutex(db));
+	stmt = stmt_get(db, sql);
+	if (!stmt)
+	{
+		sqlite3_mutex_leave(sqlite3_db_mutex(db));
+		return NULL;
+	}
+
+	for (i = 0; types[i] && ret == SQLITE_OK; i++)
+	{
+		switch (types[i])
+		{
+			case 'i':
+				ret = sqlite3_bind_int(stmt, i + 1, va_arg(ap, int));
+				break;
+			case 'I':
+				ret = sqlite3_bind_int64(stmt, i + 1, va_arg(ap, int64_t));
+				break;
+			case 's':
+				ret = sqlite3_bind_text(stmt, i + 1, va_arg(ap, const char *), -1, SQLITE_STATIC);
+				break;
+			default:
+				ret = SQLITE_MISUSE;
+				break;
+		}
+	}
+	if (ret != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "bind failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		stmt_done(stmt);
+		return NULL;
+	}
+
+	for (counter = 0;
+	     ((*result = sqlite3_step(stmt)) == SQLITE_BUSY || *result == SQLITE_LOCKED) && counter < 2;
+	     counter++)
+	{
+		/* While SQLITE_BUSY has a built in timeout,
+		 * SQLITE_LOCKED does not, so sleep */
+		if (*result == SQLITE_LOCKED)
+			sleep(1);
+	}
+	if (*result != SQLITE_ROW && *result != SQLITE_DONE)
+		DPRINTF(E_WARN, L_DB_SQL, "step failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+
+	return stmt;
+}
+
+int
+sql_exec_param(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	va_list		ap;
+	sqlite3_stmt	*stmt;
+	int		result;
+
+	va_start(ap, types);
+	stmt = stmt_run(db, sql, types, ap, &result);
+	va_end(ap);
+	if (!stmt)
+		return SQLITE_ERROR;
+	stmt_done(stmt);
+
+	return (result == SQLITE_DONE || result == SQLITE_ROW) ? SQLITE_OK : result;
+}
+
+int
+sql_get_int_param(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	va_list		ap;
+	sqlite3_stmt	*stmt;
+	int		result, ret;
+
+	va_start(ap, types);
+	stmt = stmt_run(db, sql, types, ap, &result);
+	va_end(ap);
+	if (!stmt)
+		return -1;
+
+	if (result == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0);
+	else
+		ret = (result == SQLITE_DONE) ? 0 : -1;
+	stmt_done(stmt);
+
+	return ret;
+}
+
+int64_t
+sql_get_int64_param(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	va_list		ap;
+	sqlite3_stmt	*stmt;
+	int		result;
+	int64_t		ret;
+
+	va_start(ap, types);
+	stmt = stmt_run(db, sql, types, ap, &result);
+	va_end(ap);
+	if (!stmt)
+		return -1;
+
+	if (result == SQLITE_ROW)
+		ret = sqlite3_column_int64(stmt, 0);
+	else
+		ret = (result == SQLITE_DONE) ? 0 : -1;
+	stmt_done(stmt);
+
+	return ret;
+}
+
+char *
+sql_get_text_param(sqlite3 *db, const char *sql, const char *types, ...)
+{
+	va_list		ap;
+	sqlite3_stmt	*stmt;
+	int		result, len;
+	char		*str = NULL;
+
+	va_start(ap, types);
+	stmt = stmt_run(db, sql, types, ap, &result);
+	va_end(ap);
+	if (!stmt)
+		return NULL;
+
+	if (result == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+	{
+		len = sqlite3_column_bytes(stmt, 0);
+		if ((str = sqlite3_malloc(len + 1)) != NULL)
+			strncpy(str, (char *)sqlite3_column_text(stmt, 0), len + 1);
+		else
+			DPRINTF(E_ERROR, L_DB_SQL, "malloc failed\n");
+	}
+	stmt_done(stmt);
+
+	return str;
+}
+
+/* Cached statements keep their connection busy; drop them before
+ * sqlite3_close(). */
+void
+sql_finalize_stmts(sqlite3 *db)
+{
+	int i;
+
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		if (!stmt_cache[i].stmt || stmt_cache[i].db != db)
+			continue;
+		sqlite3_finalize(stmt_cache[i].stmt);
+		stmt_cache[i].stmt = NULL;
+		stmt_cache[i].db = NULL;
+	}
+	pthread_mutex_unlock(&stmt_lock);
+}
+
+/* Read-only connections for the lookups of the HTTP, SOAP and TiVo
+ * handlers.  With the WAL journal they read the last committed state
+ * while the scanner or the inotify thread write, instead of queueing
+ * behind them on db.  A thread keeps the connection it first takes;
+ * once the pool is used up, further threads read through db. */
+#define SQL_READERS 4
+
+static sqlite3 *readers[SQL_READERS];
+static int readers_used = 0;
+static char reader_path[PATH_MAX];
+static char db_file[PATH_MAX];
+static void (*reader_setup)(sqlite3 *);
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread sqlite3 *thread_reader;
+
+/* setup, if given, runs on every new connection, e.g. to add the SQL
+ * functions that db has */
+void
+sql_readers_init(const char *path, void (*setup)(sqlite3 *))
+{
+	pthread_mutex_lock(&readers_lock);
+	snprintf(reader_path, sizeof(reader_path), "%s", path);
+	snprintf(db_file, sizeof(db_file), "%s", path);
+	reader_setup = setup;
+	pthread_mutex_unlock(&readers_lock);
+}
+
+sqlite3 *
+sql_reader(void)
+{
+	sqlite3 *reader;
+
+	if (thread_reader)
+		return thread_reader;
+
+	pthread_mutex_lock(&readers_lock);
+	if (readers_used < SQL_READERS && reader_path[0])
+	{
+		if (sqlite3_open_v2(reader_path, &reader, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK)
+		{
+			sqlite3_busy_timeout(reader, 5000);
+			if (reader_setup)
+				reader_setup(reader);
+			readers[readers_used++] = reader;
+			thread_reader = reader;
+		}
+		else
+		{
+			DPRINTF(E_WARN, L_DB_SQL, "Failed to open read-only connection: %s\n",
+				sqlite3_errmsg(reader));
+			sqlite3_close(reader);
+			reader_path[0] = '\0';
+		}
+	}
+	pthread_mutex_unlock(&readers_lock);
+
+	return thread_reader ? thread_reader : db;
+}
+
+void
+sql_readers_close(void)
+{
+	int i;
+
+	pthread_mutex_lock(&readers_lock);
+	for (i = 0; i < readers_used; i++)
+	{
+		sql_finalize_stmts(readers[i]);
+		sqlite3_close(readers[i]);
+		readers[i] = NULL;
+	}
+	readers_used = 0;
+	reader_path[0] = '\0';
+	thread_reader = NULL;
+	pthread_mutex_unlock(&readers_lock);
+}
+
+/* The inotify thread may be using the cache, the reader pool or db when
+ * the main loop forks.  process_fork() holds their locks over fork(), and
+ * the child, which must not use its parent's connections or their
+ * statements, starts with an empty cache, no readers and a db of its own
+ * for both its lookups and its writes. */
+static sqlite3_mutex *fork_db_mutex;
+
+void
+sql_fork_prepare(void)
+{
+	/* in the order stmt_run() and sql_readers_close() take them */
+	fork_db_mutex = db ? sqlite3_db_mutex(db) : NULL;
+	sqlite3_mutex_enter(fork_db_mutex);
+	pthread_mutex_lock(&readers_lock);
+	pthread_mutex_lock(&stmt_lock);
+}
+
+void
+sql_fork_done(int child)
+{
+	if (child)
+	{
+		memset(stmt_cache, 0, sizeof(stmt_cache));
+		stmt_next = 0;
+		memset(readers, 0, sizeof(readers));
+		readers_used = 0;
+		reader_path[0] = '\0';
+		thread_reader = NULL;
+	}
+	pthread_mutex_unlock(&stmt_lock);
+	pthread_mutex_unlock(&readers_lock);
+	sqlite3_mutex_leave(fork_db_mutex);
+	if (child && db_file[0])
+	{
+		/* the parent's handle is left alone, not closed */
+		if (sqlite3_open(db_file, &db) == SQLITE_OK)
+		{
+			sqlite3_busy_timeout(db, 5000);
+			if (reader_setup)
+				reader_setup(db);
+		}
+		else
+		{
+			DPRINTF(E_ERROR, L_DB_SQL, "Failed to open %s: %s\n", db_file, sqlite3_errmsg(db));
+			sqlite3_close(db);
+			db = NULL;
+		}
+	}
+}
+
+/* The secondary indexes.  OBJECT_ID and the ID columns need none of their
+ * own, being covered by their UNIQUE and PRIMARY KEY constraints.
+ * PARENT_ID keeps a narrow index, its rowid order making the
+ * max(ID) lookups of get_next_available_id() a single seek. */
+static const char *db_indexes[] = {
+	"CREATE INDEX IF NOT EXISTS IDX_OBJECTS_PARENT_ID ON OBJECTS(PARENT_ID)",
+	"CREATE INDEX IF NOT EXISTS IDX_OBJECTS_DETAIL_ID ON OBJECTS(DETAIL_ID, REF_ID)",
+	"CREATE INDEX IF NOT EXISTS IDX_OBJECTS_CLASS ON OBJECTS(CLASS)",
+	"CREATE INDEX IF NOT EXISTS IDX_SCANNER_OPT ON OBJECTS(PARENT_ID, NAME, OBJECT_ID)",
+	"CREATE INDEX IF NOT EXISTS IDX_DETAILS_PATH ON DETAILS(PATH, TIMESTAMP)",
+	"CREATE INDEX IF NOT EXISTS IDX_DETAILS_TIMESTAMP ON DETAILS(TIMESTAMP)",
+	"CREATE INDEX IF NOT EXISTS IDX_ALBUM_ART_PATH ON ALBUM_ART(PATH)",
+	NULL
+};
+
+int
+db_create_indexes(sqlite3 *db)
+{
+	int i, ret;
+
+	for (i = 0; db_indexes[i]; i++)
+	{
+		ret = sql_exec(db, db_indexes[i]);
+		if (ret != SQLITE_OK)
+			return ret;
+	}
+
+	return SQLITE_OK;
+}
+
+/* Full text index over the searchable DETAILS columns, used by UPnP Search
+ * for "contains".  FTS5's trigram tokenizer matches substrings like the
+ * LIKE it replaces; the others match words by prefix.  The index is
+ * optional, Search keeps using LIKE when SQLite has no FTS module. */
+static const char *fts_modules[] = {
+	"fts5(TITLE, ARTIST, ALBUM, CREATOR, GENRE, FILENAME, tokenize = 'trigram')",
+	"fts5(TITLE, ARTIST, ALBUM, CREATOR, GENRE, FILENAME)",
+	"fts4(TITLE, ARTIST, ALBUM, CREATOR, GENRE, FILENAME)",
+	NULL
+};
+
+#define FTS_COLUMNS "TITLE, ARTIST, ALBUM, CREATOR, GENRE, FILENAME"
+#define FTS_VALUES(t) t".ID, "t".TITLE, "t".ARTIST, "t".ALBUM, "t".CREATOR, "t".GENRE, " \
+	"substr("t".PATH, length(rtrim("t".PATH, replace("t".PATH, '/', ''))) + 1)"
+
+int
+db_create_fts(sqlite3 *db)
+{
+	int i, ret;
+
+	for (i = 0; fts_modules[i]; i++)
+	{
+		char *sql = sqlite3_mprintf("CREATE VIRTUAL TABLE DETAILS_FTS USING %s", fts_modules[i]);
+		ret = sqlite3_exec(db, sql, 0, 0, NULL);
+		sqlite3_free(sql);
+		if (ret == SQLITE_OK)
+			break;
+	}
+	if (!fts_modules[i])
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "SQLite has no full text search, searches will be slower\n");
+		return SQLITE_OK;
+	}
+
+	if ((ret = sql_exec(db, "CREATE TRIGGER DETAILS_FTS_INSERT AFTER INSERT ON DETAILS BEGIN "
+	                        "INSERT into DETAILS_FTS (rowid, " FTS_COLUMNS ") VALUES (" FTS_VALUES("new") "); "
+	                        "END")) != SQLITE_OK ||
+	    (ret = sql_exec(db, "CREATE TRIGGER DETAILS_FTS_DELETE AFTER DELETE ON DETAILS BEGIN "
+	                        "DELETE from DETAILS_FTS where rowid = old.ID; "
+	                        "END")) != SQLITE_OK ||
+	    (ret = sql_exec(db, "CREATE TRIGGER DETAILS_FTS_UPDATE AFTER UPDATE OF"
+	                        " TITLE, ARTIST, ALBUM, CREATOR, GENRE, PATH ON DETAILS BEGIN "
+	                        "DELETE from DETAILS_FTS where rowid = old.ID; "
+	                        "INSERT into DETAILS_FTS (rowid, " FTS_COLUMNS ") VALUES (" FTS_VALUES("new") "); "
+	                        "END")) != SQLITE_OK)
+		return ret;
+
+	return sql_exec(db, "INSERT into DETAILS_FTS (rowid, " FTS_COLUMNS ")"
+	                    " SELECT " FTS_VALUES("d") " from DETAILS d");
+}
+
 int
 db_upgrade(sqlite3 *db)
 {
@@ -274,6 +735,68 @@ db_upgrade(sqlite3 *db)
 		return -1;
 	if (db_vers < 9)
 		return db_vers;
+	if (db_vers < 10)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 10);
+		if (sql_exec(db, "ALTER TABLE DETAILS ADD CONTAINER TEXT") != SQLITE_OK ||
+		    sql_exec(db, "ALTER TABLE DETAILS ADD VIDEO_CODEC TEXT") != SQLITE_OK ||
+		    sql_exec(db, "ALTER TABLE DETAILS ADD AUDIO_CODEC TEXT") != SQLITE_OK ||
+		    sql_exec(db, "CREATE TABLE TRANSCODE ("
+		                 "ID INTEGER NOT NULL, "
+		                 "CLIENT INTEGER NOT NULL, "
+		                 "TIMESTAMP INTEGER, "
+		                 "TRANSCODE INTEGER, "
+		                 "PRIMARY KEY (ID, CLIENT))") != SQLITE_OK)
+			return 9;
+	}
+	if (db_vers < 11)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 11);
+		if (sql_exec(db, "ALTER TABLE TRANSCODE ADD MIME TEXT") != SQLITE_OK ||
+		    sql_exec(db, "ALTER TABLE TRANSCODE ADD DLNA_PN TEXT") != SQLITE_OK)
+			return 10;
+	}
+	if (db_vers < 12)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 12);
+		if (sql_exec(db, "CREATE TABLE PRETRANSCODE ("
+		                 "ID INTEGER PRIMARY KEY)") != SQLITE_OK)
+			return 11;
+	}
+	if (db_vers < 13)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 13);
+		if (sql_exec(db, "ALTER TABLE OBJECTS ADD CHILD_COUNT INTEGER DEFAULT 0") != SQLITE_OK ||
+		    sql_exec(db, "UPDATE OBJECTS set CHILD_COUNT ="
+		                 " (SELECT count(*) from OBJECTS c where c.PARENT_ID = OBJECTS.OBJECT_ID)"
+		                 " where CLASS glob 'container*'") != SQLITE_OK ||
+		    sql_exec(db, "CREATE TRIGGER OBJECTS_CHILD_INSERT AFTER INSERT ON OBJECTS BEGIN "
+		                 "UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT + 1 where OBJECT_ID = new.PARENT_ID; "
+		                 "END") != SQLITE_OK ||
+		    sql_exec(db, "CREATE TRIGGER OBJECTS_CHILD_DELETE AFTER DELETE ON OBJECTS BEGIN "
+		                 "UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT - 1 where OBJECT_ID = old.PARENT_ID; "
+		                 "END") != SQLITE_OK)
+			return 12;
+	}
+	if (db_vers < 14)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 14);
+		/* PATH and DETAIL_ID indexes are widened, the others duplicated
+		 * the UNIQUE and PRIMARY KEY indexes */
+		if (sql_exec(db, "DROP INDEX IF EXISTS IDX_OBJECTS_OBJECT_ID") != SQLITE_OK ||
+		    sql_exec(db, "DROP INDEX IF EXISTS IDX_OBJECTS_DETAIL_ID") != SQLITE_OK ||
+		    sql_exec(db, "DROP INDEX IF EXISTS IDX_DETAILS_PATH") != SQLITE_OK ||
+		    sql_exec(db, "DROP INDEX IF EXISTS IDX_DETAILS_ID") != SQLITE_OK ||
+		    sql_exec(db, "DROP INDEX IF EXISTS IDX_ALBUM_ART") != SQLITE_OK ||
+		    db_create_indexes(db) != SQLITE_OK)
+			return 13;
+	}
+	if (db_vers < 15)
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "Updating DB version to v%d\n", 15);
+		if (db_create_fts(db) != SQLITE_OK)
+			return 14;
+	}
 	sql_exec(db, "PRAGMA user_version = %d", DB_VERSION);
 
 	return 0;
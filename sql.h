@@ -39,6 +39,21 @@ int sql_get_table(sqlite3 *db, const char *zSql, char ***pazResult, int *pnRow,
 int sql_get_int_field(sqlite3 *db, const char *fmt, ...);
 int64_t sql_get_int64_field(sqlite3 *db, const char *fmt, ...);
 char * sql_get_text_field(sqlite3 *db, const char *fmt, ...);
+/* Cached prepared statements: sql is a string constant with ? parameters,
+ * types gives one character per parameter ('i' int, 'I' int64_t, 's' text) */
+int sql_exec_param(sqlite3 *db, const char *sql, const char *types, ...);
+int sql_get_int_param(sqlite3 *db, const char *sql, const char *types, ...);
+int64_t sql_get_int64_param(sqlite3 *db, const char *sql, const char *types, ...);
+char * sql_get_text_param(sqlite3 *db, const char *sql, const char *types, ...);
+void sql_finalize_stmts(sqlite3 *db);
+void sql_fork_prepare(void);
+void sql_fork_done(int child);
+/* Read-only connection of the calling thread, or db if there is none */
+void sql_readers_init(const char *path, void (*setup)(sqlite3 *));
+sqlite3 *sql_reader(void);
+void sql_readers_close(void);
+int db_create_indexes(sqlite3 *db);
+int db_create_fts(sqlite3 *db);
 int db_upgrade(sqlite3 *db);
 
 #endif
@@ -0,0 +1,217 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Times the lookups the server repeats most, printed and parsed for every
+ * call as before, then through the statement cache, first with the index
+ * set of DB version 13 and then with the current one.
+ *
+ *   ./sqlbench [items] [lookups]
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "upnpglobalvars.h"
+#include "sql.h"
+#include "log.h"
+#include "scanner_sqlite.h"
+
+#define DIR_ITEMS 100
+
+uint32_t runtime_flags = 0;
+sqlite3 *db = NULL;
+
+static const char *old_indexes[] = {
+	"create INDEX IDX_OBJECTS_OBJECT_ID ON OBJECTS(OBJECT_ID)",
+	"create INDEX IDX_OBJECTS_PARENT_ID ON OBJECTS(PARENT_ID)",
+	"create INDEX IDX_OBJECTS_DETAIL_ID ON OBJECTS(DETAIL_ID)",
+	"create INDEX IDX_OBJECTS_CLASS ON OBJECTS(CLASS)",
+	"create INDEX IDX_DETAILS_PATH ON DETAILS(PATH)",
+	"create INDEX IDX_DETAILS_ID ON DETAILS(ID)",
+	"create INDEX IDX_ALBUM_ART ON ALBUM_ART(ID)",
+	"create INDEX IDX_SCANNER_OPT ON OBJECTS(PARENT_ID, NAME, OBJECT_ID)",
+	NULL
+};
+
+static sqlite3 *bench_db;
+static int items, lookups;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, double start, int count)
+{
+	double elapsed = now() - start;
+
+	printf("  %-36s %8.1f ms  %8.2f us/lookup\n", name,
+	       elapsed * 1e3, elapsed * 1e6 / count);
+}
+
+static void
+item_path(char *buf, size_t len, int i)
+{
+	snprintf(buf, len, "/media/dir%04d/file%06d.mp3", i / DIR_ITEMS, i);
+}
+
+static void
+fill(void)
+{
+	char path[64];
+	int i;
+
+	sql_exec(bench_db, "BEGIN");
+	for (i = 0; i < items / DIR_ITEMS; i++)
+		sql_exec(bench_db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS, NAME)"
+		                   " VALUES ('64$%X', '64', 'container.storageFolder', 'dir%04d')", i, i);
+	for (i = 0; i < items; i++)
+	{
+		item_path(path, sizeof(path), i);
+		sql_exec(bench_db, "INSERT into DETAILS (ID, PATH, TIMESTAMP, MIME)"
+		                   " VALUES (%d, %Q, %d, 'audio/mpeg')", i + 1, path, 1000000 + i);
+		sql_exec(bench_db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME)"
+		                   " VALUES ('64$%X$%X', '64$%X', 'item.audioItem.musicTrack', %d, 'file%06d')",
+		                   i / DIR_ITEMS, i, i / DIR_ITEMS, i + 1, i);
+		sql_exec(bench_db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME)"
+		                   " VALUES ('1$4$%X', '1$4', '64$%X$%X', 'item.audioItem.musicTrack', %d, 'file%06d')",
+		                   i, i / DIR_ITEMS, i, i + 1, i);
+	}
+	sql_exec(bench_db, "COMMIT");
+}
+
+static void
+run_printf(void)
+{
+	char path[64];
+	double start;
+	int i;
+
+	start = now();
+	for (i = 0; i < lookups; i++)
+	{
+		item_path(path, sizeof(path), (i * 7919) % items);
+		sql_get_int_field(bench_db, "SELECT TIMESTAMP from DETAILS where PATH = '%q'", path);
+	}
+	report("TIMESTAMP by PATH, printf", start, lookups);
+
+	start = now();
+	for (i = 0; i < lookups; i++)
+		sql_get_int_field(bench_db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = '64$%X'",
+		                  i % (items / DIR_ITEMS));
+	report("CHILD_COUNT by OBJECT_ID, printf", start, lookups);
+}
+
+static void
+run_cached(void)
+{
+	char path[64], id[32];
+	char *str;
+	double start;
+	int i;
+
+	start = now();
+	for (i = 0; i < lookups; i++)
+	{
+		item_path(path, sizeof(path), (i * 7919) % items);
+		sql_get_int_param(bench_db, "SELECT TIMESTAMP from DETAILS where PATH = ?", "s", path);
+	}
+	report("TIMESTAMP by PATH, cached", start, lookups);
+
+	start = now();
+	for (i = 0; i < lookups; i++)
+	{
+		snprintf(id, sizeof(id), "64$%X", i % (items / DIR_ITEMS));
+		sql_get_int_param(bench_db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?", "s", id);
+	}
+	report("CHILD_COUNT by OBJECT_ID, cached", start, lookups);
+
+	start = now();
+	for (i = 0; i < lookups; i++)
+	{
+		item_path(path, sizeof(path), (i * 7919) % items);
+		str = sql_get_text_param(bench_db, "SELECT OBJECT_ID from OBJECTS o"
+		                         " left join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                         " where d.PATH = ? and REF_ID is NULL", "s", path);
+		sqlite3_free(str);
+	}
+	report("OBJECT_ID by PATH, REF_ID is NULL", start, lookups);
+
+	start = now();
+	for (i = 0; i < lookups / 100 + 1; i++)
+		sql_get_int_param(bench_db, "SELECT count(*) from (SELECT 1 from DETAILS"
+		                  " where TIMESTAMP > ? order by TIMESTAMP DESC limit 100)", "i",
+		                  1000000 + items - 1000);
+	report("recently added, 100 rows", start, lookups / 100 + 1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int i;
+
+	items = (argc > 1) ? atoi(argv[1]) : 50000;
+	lookups = (argc > 2) ? atoi(argv[2]) : 100000;
+	if (items < DIR_ITEMS || lookups < 1)
+	{
+		fprintf(stderr, "Usage: %s [items >= %d] [lookups]\n", argv[0], DIR_ITEMS);
+		return 1;
+	}
+
+	if (sqlite3_open(":memory:", &bench_db) != SQLITE_OK ||
+	    sql_exec(bench_db, create_objectTable_sqlite) != SQLITE_OK ||
+	    sql_exec(bench_db, create_childCountTriggers_sqlite) != SQLITE_OK ||
+	    sql_exec(bench_db, create_detailTable_sqlite) != SQLITE_OK ||
+	    sql_exec(bench_db, create_albumArtTable_sqlite) != SQLITE_OK)
+	{
+		fprintf(stderr, "Failed to create the database\n");
+		return 1;
+	}
+	for (i = 0; old_indexes[i]; i++)
+		sql_exec(bench_db, old_indexes[i]);
+	fill();
+	printf("%d items, %d lookups\n", items, lookups);
+
+	printf("DB version 13 indexes:\n");
+	run_printf();
+	run_cached();
+
+	sql_finalize_stmts(bench_db);
+	for (i = 0; old_indexes[i]; i++)
+	{
+		const char *name = strstr(old_indexes[i], "IDX_");
+		sql_exec(bench_db, "DROP INDEX %.*s", (int)strcspn(name, " "), name);
+	}
+	db_create_indexes(bench_db);
+
+	printf("DB version %d indexes:\n", DB_VERSION);
+	run_printf();
+	run_cached();
+
+	sql_finalize_stmts(bench_db);
+	sqlite3_close(bench_db);
+
+	return 0;
+}
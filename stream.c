@@ -0,0 +1,371 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#endif
+
+#include "stream.h"
+#include "log.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include "sendfile.h"
+#endif
+
+/* Streams of files that are sent as they are do not need a process of
+ * their own.  Once the response header is built the socket and the file
+ * are handed to this engine, and a few threads drive all of the transfers
+ * from one epoll set with non-blocking sendfile.  Every connection is a
+ * small state machine (header, body, done) registered one-shot, so only
+ * one thread works on it at a time, and it only gets a slice of the
+ * transfer before yielding to the others.  A client that does not keep up
+ * simply leaves its socket unwritable and costs nothing until it drains.
+ * Background transfers get a thread and epoll set of their own, running at
+ * the lowest priority, so that renicing one never slows down the rest. */
+
+#define STREAM_SLICE 1048576	/* bytes sent per wakeup before yielding */
+#define STREAM_EVENTS 16
+
+enum stream_state {
+	STREAM_HEADER,
+	STREAM_BODY,
+	STREAM_DONE
+};
+
+struct stream_s {
+	int epfd;
+	int sock;
+	int fd;
+	enum stream_state state;
+	char *header;
+	size_t header_len;
+	size_t header_off;
+	off_t offset;
+	off_t end_offset;
+	int try_sendfile;
+};
+
+int stream_count = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epfd = -1;
+static int bg_epfd = -1;
+static int nthreads = 0;
+static pthread_t *threads = NULL;
+static volatile int stopping = 0;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+stream_close(struct stream_s *s)
+{
+	epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->sock, NULL);
+	/* forked children may still share the socket; make sure the client
+	 * sees the end of the connection now */
+	shutdown(s->sock, SHUT_RDWR);
+	close(s->sock);
+	close(s->fd);
+	free(s->header);
+	free(s);
+
+	pthread_mutex_lock(&stream_lock);
+	stream_count--;
+	pthread_mutex_unlock(&stream_lock);
+}
+
+static int
+stream_rearm(struct stream_s *s)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT | EPOLLONESHOT;
+	ev.data.ptr = s;
+
+	return epoll_ctl(s->epfd, EPOLL_CTL_MOD, s->sock, &ev);
+}
+
+/* Sends whatever the socket accepts, up to a slice.  Returns 1 to wait for
+ * the socket again, 0 when the transfer is over, -1 on error. */
+static int
+stream_process(struct stream_s *s)
+{
+	char buf[65536];
+	off_t budget = STREAM_SLICE;
+	ssize_t ret;
+	size_t len;
+
+	while (s->state == STREAM_HEADER)
+	{
+		ret = send(s->sock, s->header + s->header_off, s->header_len - s->header_off, 0);
+		if (ret < 0)
+			return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
+		s->header_off += ret;
+		if (s->header_off >= s->header_len)
+			s->state = (s->offset <= s->end_offset) ? STREAM_BODY : STREAM_DONE;
+	}
+
+	while (s->state == STREAM_BODY)
+	{
+		if (budget <= 0)
+			return 1;
+		len = MIN(s->end_offset - s->offset + 1, budget);
+		if (s->try_sendfile)
+		{
+			ret = sys_sendfile(s->sock, s->fd, &s->offset, len);
+			if (ret < 0)
+			{
+				if (errno == EAGAIN || errno == EINTR)
+					return 1;
+				/* not supported for this file, fall back to regular I/O */
+				if (errno != EINVAL && errno != EOVERFLOW)
+					return -1;
+				s->try_sendfile = 0;
+				continue;
+			}
+		}
+		else
+		{
+			ret = pread(s->fd, buf, MIN(len, sizeof(buf)), s->offset);
+			if (ret <= 0)
+				return -1;
+			ret = send(s->sock, buf, ret, 0);
+			if (ret < 0)
+				return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
+			s->offset += ret;
+		}
+		if (ret == 0)
+			return -1;
+		budget -= ret;
+		if (s->offset > s->end_offset)
+			s->state = STREAM_DONE;
+	}
+
+	return 0;
+}
+
+static void *
+stream_thread(void *arg)
+{
+	struct epoll_event ev[STREAM_EVENTS];
+	struct stream_s *s;
+	int set = *(int *)arg;
+	int n, i, ret;
+
+	/* on Linux the nice value is per thread */
+	if (arg == &bg_epfd &&
+	    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19) != 0)
+		DPRINTF(E_WARN, L_HTTP, "Failed to lower background stream priority\n");
+
+	while (!stopping)
+	{
+		n = epoll_wait(set, ev, STREAM_EVENTS, 1000);
+		for (i = 0; i < n; i++)
+		{
+			s = ev[i].data.ptr;
+			if (ev[i].events & (EPOLLERR | EPOLLHUP))
+				ret = -1;
+			else
+				ret = stream_process(s);
+			if (ret > 0 && stream_rearm(s) == 0)
+				continue;
+			if (ret < 0)
+				DPRINTF(E_DEBUG, L_HTTP, "Stream on socket %d ended early: %s\n",
+					s->sock, strerror(errno));
+			stream_close(s);
+		}
+	}
+
+	return NULL;
+}
+
+int
+stream_init(int threads_wanted)
+{
+	int i;
+
+	if (threads_wanted <= 0)
+		return 0;
+	epfd = epoll_create(64);
+	if (epfd < 0)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Unable to create stream epoll set: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(epfd, F_SETFD, FD_CLOEXEC);
+	threads = calloc(threads_wanted + 1, sizeof(pthread_t));
+	if (!threads)
+		return -1;
+	for (i = 0; i < threads_wanted; i++)
+	{
+		if (pthread_create(&threads[i], NULL, stream_thread, &epfd) != 0)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Unable to start stream thread: %s\n", strerror(errno));
+			break;
+		}
+	}
+	nthreads = i;
+	if (!nthreads)
+		return -1;
+
+	bg_epfd = epoll_create(16);
+	if (bg_epfd >= 0)
+		fcntl(bg_epfd, F_SETFD, FD_CLOEXEC);
+	if (bg_epfd >= 0 && pthread_create(&threads[nthreads], NULL, stream_thread, &bg_epfd) == 0)
+		nthreads++;
+	else if (bg_epfd >= 0)
+	{
+		close(bg_epfd);
+		bg_epfd = -1;
+	}
+
+	return 0;
+}
+
+int
+stream_active(void)
+{
+	return nthreads > 0;
+}
+
+/* Whether background transfers can be sent at a lower priority */
+int
+stream_background(void)
+{
+	return bg_epfd >= 0;
+}
+
+/* Takes over sock and fd on success */
+int
+stream_start(int sock, const char *header, size_t len, int fd, off_t offset, off_t end_offset,
+             int background)
+{
+	struct epoll_event ev;
+	struct stream_s *s;
+	int flags;
+
+	if (!nthreads)
+		return -1;
+	s = calloc(1, sizeof(struct stream_s));
+	if (!s)
+		return -1;
+	s->header = malloc(len);
+	if (!s->header)
+	{
+		free(s);
+		return -1;
+	}
+	memcpy(s->header, header, len);
+	s->header_len = len;
+	s->epfd = (background && bg_epfd >= 0) ? bg_epfd : epfd;
+	s->sock = sock;
+	s->fd = fd;
+	s->offset = offset;
+	s->end_offset = end_offset;
+	s->try_sendfile = 1;
+	s->state = STREAM_HEADER;
+
+	flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+	/* transcoders and scripts exec'ed later must not hold them open */
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	pthread_mutex_lock(&stream_lock);
+	stream_count++;
+	pthread_mutex_unlock(&stream_lock);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT | EPOLLONESHOT;
+	ev.data.ptr = s;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, sock, &ev) != 0)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Unable to queue stream: %s\n", strerror(errno));
+		fcntl(sock, F_SETFL, flags);
+		free(s->header);
+		free(s);
+		pthread_mutex_lock(&stream_lock);
+		stream_count--;
+		pthread_mutex_unlock(&stream_lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+stream_free(void)
+{
+	int i;
+
+	if (!nthreads)
+		return;
+	stopping = 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	threads = NULL;
+	nthreads = 0;
+	close(epfd);
+	epfd = -1;
+	if (bg_epfd >= 0)
+		close(bg_epfd);
+	bg_epfd = -1;
+}
+#else
+int
+stream_init(int threads)
+{
+	if (threads > 0)
+		DPRINTF(E_WARN, L_HTTP, "Streaming threads need epoll, streams will be forked\n");
+	return 0;
+}
+
+int
+stream_active(void)
+{
+	return 0;
+}
+
+int
+stream_background(void)
+{
+	return 0;
+}
+
+int
+stream_start(int sock, const char *header, size_t len, int fd, off_t offset, off_t end_offset,
+             int background)
+{
+	return -1;
+}
+
+void
+stream_free(void)
+{
+}
+#endif
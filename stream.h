@@ -0,0 +1,31 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <sys/types.h>
+
+extern int stream_count;
+
+int stream_init(int threads);
+int stream_active(void);
+int stream_background(void);
+int stream_start(int sock, const char *header, size_t len, int fd, off_t offset, off_t end_offset,
+                 int background);
+void stream_free(void);
+
+#endif
@@ -254,9 +254,9 @@ callback(void *args, int argc, char **argv, char **azColName)
 		int count;
 		/* Determine the number of children */
 #ifdef __sparc__ /* Adding filters on large containers can take a long time on slow processors */
-		count = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", id);
+		count = sql_get_int_field(sql_reader(), "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = '%s'", id);
 #else
-		count = sql_get_int_field(db, "SELECT count(*) from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID) where PARENT_ID = '%s' and "
+		count = sql_get_int_field(sql_reader(), "SELECT count(*) from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID) where PARENT_ID = '%s' and "
 		                              " (MIME in ('image/jpeg', 'audio/mpeg', 'video/mpeg', 'video/x-tivo-mpeg', 'video/x-tivo-mpeg-ts')"
 		                              " or CLASS glob 'container*')", id);
 #endif
@@ -306,7 +306,7 @@ SendItemDetails(struct upnphttp *h, int64_t item)
 	               "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
 		       " where o.DETAIL_ID = %lld group by o.DETAIL_ID", (long long)item);
 	DPRINTF(E_DEBUG, L_TIVO, "%s\n", sql);
-	ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+	ret = sqlite3_exec(sql_reader(), sql, callback, (void *) &args, &zErrMsg);
 	free(sql);
 	if( ret != SQLITE_OK )
 	{
@@ -390,7 +390,7 @@ SendContainer(struct upnphttp *h, const char *objectID, int itemStart, int itemC
 	}
 	else
 	{
-		item = sql_get_text_field(db, "SELECT NAME from OBJECTS where OBJECT_ID = '%q'", objectID);
+		item = sql_get_text_field(sql_reader(), "SELECT NAME from OBJECTS where OBJECT_ID = '%q'", objectID);
 		if( item )
 		{
 			title = escape_tag(item, 1);
@@ -583,7 +583,7 @@ SendContainer(struct upnphttp *h, const char *objectID, int itemStart, int itemC
 	                              " %s"
 		                      " order by %s", what, which, myfilter, groupBy, order2);
 		DPRINTF(E_DEBUG, L_TIVO, "%s\n", sql);
-		if( (sql_get_table(db, sql, &result, &ret, NULL) == SQLITE_OK) && ret )
+		if( (sql_get_table(sql_reader(), sql, &result, &ret, NULL) == SQLITE_OK) && ret )
 		{
 			for( i=1; i<=ret; i++ )
 			{
@@ -603,7 +603,7 @@ SendContainer(struct upnphttp *h, const char *objectID, int itemStart, int itemC
 	args.start = itemStart+anchorOffset;
 	sqlite3Prng.isInit = 0;
 
-	ret = sql_get_int_field(db, "SELECT count(distinct DETAIL_ID) "
+	ret = sql_get_int_field(sql_reader(), "SELECT count(distinct DETAIL_ID) "
 	                            "from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
 	                            " where %s and (%s)",
 	                            which, myfilter);
@@ -620,7 +620,7 @@ SendContainer(struct upnphttp *h, const char *objectID, int itemStart, int itemC
 			      " order by %s limit %d, %d",
 	                      which, myfilter, groupBy, order, args.start, args.requested);
 	DPRINTF(E_DEBUG, L_TIVO, "%s\n", sql);
-	ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+	ret = sqlite3_exec(sql_reader(), sql, callback, (void *) &args, &zErrMsg);
 	sqlite3_free(sql);
 	if( ret != SQLITE_OK )
 	{
@@ -780,6 +780,6 @@ ProcessTiVoCommand(struct upnphttp *h, const char *orig_path)
 		}
 	}
 	free(path);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 #endif // TIVO_SUPPORT
@@ -16,12 +16,16 @@
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "config.h"
@@ -31,7 +35,9 @@
 #include "upnpglobalvars.h"
 #include "minidlnatypes.h"
 #include "transcode.h"
+#include "dlnameta.h"
 #include "utils.h"
+#include "sql.h"
 #include "log.h"
 
 #define READ 0
@@ -80,15 +86,17 @@ popenvp(const char* file, char * const argv[], int *pipehandle)
 	return pid;
 }
 
-/* NOTE: Partially based on Hiero's code */
+/* NOTE: Partially based on Hiero's code
+ * A transcoder whose profile declares "segments" is also given a file name
+ * pattern and the times to split its output at; it then writes the pieces
+ * to those files as well as the whole output to the pipe. */
 pid_t
-exec_transcode(char *transcoder, char *source_path, int offset, int end_offset, int *pipehandle)
+exec_transcode(char *transcoder, char *source_path, int offset, int end_offset,
+               char *segments, char *splits, int *pipehandle)
 {
 	pid_t pid;
-	int retval;
 	char position[12], duration[12];
-	static struct sigaction sa;
-	char * args[5];
+	char * args[7];
 
 	sprintf(position, "%d.%03d", offset/1000, offset%1000);
 	sprintf(duration, "%d.%03d", (end_offset - offset + 1)/1000,  (end_offset - offset + 1)%1000);
@@ -97,7 +105,9 @@ exec_transcode(char *transcoder, char *source_path, int offset, int end_offset,
 	args[1] = source_path;
 	args[2] = position;
 	args[3] = duration;
-	args[4] = NULL;
+	args[4] = segments;
+	args[5] = segments ? splits : NULL;
+	args[6] = NULL;
 
 	/* Invoke processs */
 	pid = popenvp(args[0], args, pipehandle);
@@ -109,8 +119,6 @@ pid_t
 exec_transcode_img(char *transcoder, char *source_path, char *dest_path)
 {
 	pid_t pid;
-	int status, retval;
-	static struct sigaction sa;
 	char * args[4];
 
 	args[0] = transcoder;
@@ -168,17 +176,105 @@ needs_transcode_image(const char* path, enum client_types client)
 	return 0;
 }
 
+static int
+transcode_list_match(struct transcode_list_format_s *list, const char *value)
+{
+	/* test for the reserved value "all" */
+	if( list && strcmp(list->value, "all") == 0 )
+		return 1;
+	if( !value )
+		return 0;
+	for( ; list; list = list->next )
+	{
+		if( strcmp(list->value, value) == 0 )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Decide from previously gathered container/codec facts whether a file
+ * of the given media class ('a'udio or 'v'ideo) must be transcoded. */
 int
-needs_transcode_audio(const char* path, enum client_types client)
+transcode_check_facts(char type, enum client_types client, const char *container,
+                      const char *video_codec, const char *audio_codec)
 {
-	int ret;
-	AVFormatContext *ctx = NULL;
-	struct AVCodecContext *ac = NULL;
 	int i;
-	struct transcode_list_format_s *transcode_format_it = NULL;
-	struct AVCodec *codec = NULL;
 	struct transcode_info_s *clients_info[] = {client_types[0].transcode_info, client_types[client].transcode_info};
 
+	if( type == 'v' && !video_codec )
+		return 0;
+
+	for ( i = 0; i < 2; i++ )
+	{
+		if( !clients_info[i] )
+			continue;
+		if( type == 'v' )
+		{
+			if( transcode_list_match(clients_info[i]->video_containers, container) ||
+			    transcode_list_match(clients_info[i]->video_codecs, video_codec) )
+				return 1;
+		}
+		if( transcode_list_match(clients_info[i]->audio_codecs, audio_codec) )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Returns non-zero if any client has codec lists configured that apply
+ * to the given media class ('a'udio or 'v'ideo). */
+int
+transcode_enabled(char type)
+{
+	struct transcode_info_s *info;
+	int i;
+
+	for( i = 0; client_types[i].name; i++ )
+	{
+		info = client_types[i].transcode_info;
+		if( !info )
+			continue;
+		if( info->audio_codecs )
+			return 1;
+		if( type == 'v' && (info->video_codecs || info->video_containers) )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* The transcoder a client uses for a media class, falling back to the
+ * global one. */
+char *
+transcode_get_transcoder(char type, enum client_types client)
+{
+	struct transcode_info_s *info = client_types[client].transcode_info;
+	struct transcode_info_s *global = client_types[0].transcode_info;
+
+	if( type == 'i' ) /* image */
+		return (info && info->image_transcoder) ? info->image_transcoder : (global ? global->image_transcoder : NULL);
+	else if( type == 'a' ) /* audio */
+		return (info && info->audio_transcoder) ? info->audio_transcoder : (global ? global->audio_transcoder : NULL);
+	else if( type == 'v' ) /* video */
+		return (info && info->video_transcoder) ? info->video_transcoder : (global ? global->video_transcoder : NULL);
+
+	return NULL;
+}
+
+/* Open a file with libavformat and report the container name and the
+ * decoder names of the first audio and video streams.  The returned
+ * strings must be freed by the caller. */
+int
+transcode_probe(const char *path, char **container, char **video_codec, char **audio_codec)
+{
+	int ret, i;
+	AVFormatContext *ctx = NULL;
+	AVCodecContext *ac = NULL, *vc = NULL;
+	const char *name;
+
+	*container = *video_codec = *audio_codec = NULL;
+
 	/* prepare ffmpeg */
 	av_register_all();
 	ret = lav_open(&ctx, path);
@@ -191,172 +287,346 @@ needs_transcode_audio(const char* path, enum client_types client)
 	}
 	for( i=0; i<ctx->nb_streams; i++)
 	{
-		if( ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO )
-		{
+		if( !ac && ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO )
 			ac = ctx->streams[i]->codec;
-			break;
-		}
-	}
-	if ( ac )
-	{
-		codec = avcodec_find_decoder(ac->codec_id);
-		
-		for ( i = 0; i < 2; i++ )
-		{	
-			if (clients_info[i])
-			{
-				transcode_format_it = clients_info[i]->audio_codecs;
-				/* test for the reserved value "all" */
-				if ( transcode_format_it && strcmp(transcode_format_it->value, "all") == 0 )
-				{
-					lav_close(ctx);
-					return 1;
-				}
-
-				while( transcode_format_it )
-				{
-					if ( strcmp(codec->name, transcode_format_it->value) == 0 )
-					{
-						lav_close(ctx);
-						return 1;
-					}
-					transcode_format_it = transcode_format_it->next;
-				}
-			}
-		}
+		else if( !vc && ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO )
+			vc = ctx->streams[i]->codec;
 	}
 
+	*container = strdup(ctx->iformat->name);
+	if( (name = lav_codec_name(vc)) )
+		*video_codec = strdup(name);
+	if( (name = lav_codec_name(ac)) )
+		*audio_codec = strdup(name);
 	lav_close(ctx);
+
 	return 0;
 }
 
+int
+needs_transcode_audio(const char* path, enum client_types client)
+{
+	char *container, *video_codec, *audio_codec;
+	int ret;
+
+	if( transcode_probe(path, &container, &video_codec, &audio_codec) != 0 )
+		return -1;
+	ret = transcode_check_facts('a', client, container, video_codec, audio_codec);
+	free(container);
+	free(video_codec);
+	free(audio_codec);
+
+	return ret;
+}
+
 int
 needs_transcode_video(const char* path, enum client_types client)
 {
+	char *container, *video_codec, *audio_codec;
 	int ret;
-	AVFormatContext *ctx = NULL;
-	struct AVCodec *codec = NULL;
-	int audio_stream = -1, video_stream = -1;
-	struct AVCodecContext *ac = NULL;
-	struct AVCodecContext *vc = NULL;
-	int i;
-	struct transcode_list_format_s *transcode_format_it = NULL;
-	struct transcode_info_s *clients_info[] = {client_types[0].transcode_info, client_types[client].transcode_info};
 
-	/* prepare ffmpeg */
-	av_register_all();
-	ret = lav_open(&ctx, path);
-	if( ret != 0 )
+	if( transcode_probe(path, &container, &video_codec, &audio_codec) != 0 )
+		return -1;
+	if( !video_codec )
 	{
-		char err[128];
-		av_strerror(ret, err, sizeof(err));
-		DPRINTF(E_ERROR, L_TRANSCODE, "Opening %s failed! [%s]\n", path, err);
+		/* This must not be a video file. */
+		DPRINTF(E_ERROR, L_TRANSCODE, "File does not contain a video stream.\n");
+	}
+	ret = transcode_check_facts('v', client, container, video_codec, audio_codec);
+	free(container);
+	free(video_codec);
+	free(audio_codec);
+
+	return ret;
+}
+
+/* Answer "transcode or not" for a DETAILS row and a client type.  Decisions
+ * are persisted in the TRANSCODE table keyed by (ID, CLIENT) and stamped
+ * with the file mtime, and are derived from the codec facts stored by the
+ * scanner, so the media file is only reopened when those are missing or
+ * stale. */
+int
+transcode_decision(int64_t id, const char *path, const char *mime, enum client_types client)
+{
+	char sql[256];
+	char **result;
+	char *container = NULL, *video_codec = NULL, *audio_codec = NULL;
+	struct stat st;
+	int rows = 0, ret;
+	long long mtime;
+
+	if( *mime != 'a' && *mime != 'v' && *mime != 'i' )
+		return 0;
+	if( stat(path, &st) != 0 )
+		return -1;
+	mtime = (long long)st.st_mtime;
+
+	snprintf(sql, sizeof(sql), "SELECT d.TIMESTAMP, d.CONTAINER, d.VIDEO_CODEC, d.AUDIO_CODEC,"
+	                           " t.TIMESTAMP, t.TRANSCODE from DETAILS d"
+	                           " left join TRANSCODE t on (t.ID = d.ID and t.CLIENT = %d)"
+	                           " where d.ID = %lld", client, (long long)id);
+	if( sql_get_table(db, sql, &result, &rows, NULL) != SQLITE_OK )
+		return -1;
+	if( !rows )
+	{
+		sqlite3_free_table(result);
 		return -1;
 	}
-	for( i=0; i<ctx->nb_streams; i++)
+
+	/* result[0..5] hold the column names */
+	if( result[10] && result[11] && strtoll(result[10], NULL, 10) == mtime )
 	{
-		if( audio_stream == -1 &&
-			ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO )
-		{
-			audio_stream = i;
-			ac = ctx->streams[audio_stream]->codec;
+		ret = atoi(result[11]);
+		sqlite3_free_table(result);
+		return ret;
+	}
+	if( *mime == 'i' )
+	{
+		ret = needs_transcode_image(path, client);
+		goto store;
+	}
+	if( result[7] && result[6] && strtoll(result[6], NULL, 10) == mtime )
+	{
+		ret = transcode_check_facts(*mime, client, result[7], result[8], result[9]);
+		goto store;
+	}
+
+	DPRINTF(E_DEBUG, L_TRANSCODE, "No stored codec information for %s, probing\n", path);
+	if( transcode_probe(path, &container, &video_codec, &audio_codec) != 0 )
+	{
+		sqlite3_free_table(result);
+		return -1;
+	}
+	ret = transcode_check_facts(*mime, client, container, video_codec, audio_codec);
+	if( result[6] && strtoll(result[6], NULL, 10) == mtime )
+		sql_exec(db, "UPDATE DETAILS set CONTAINER = %Q, VIDEO_CODEC = %Q, AUDIO_CODEC = %Q"
+		             " where ID = %lld", container, video_codec, audio_codec, (long long)id);
+	free(container);
+	free(video_codec);
+	free(audio_codec);
+store:
+	sqlite3_free_table(result);
+	sql_exec(db, "INSERT OR REPLACE into TRANSCODE (ID, CLIENT, TIMESTAMP, TRANSCODE)"
+	             " VALUES (%lld, %d, %lld, %d)", (long long)id, client, mtime, ret);
+
+	return ret;
+}
+
+static void
+transcode_free_profile(struct transcode_profile_s *profile)
+{
+	if( !profile )
+		return;
+	free(profile->mime);
+	free(profile->dlna_pn);
+	free(profile);
+}
+
+/* Read the declarative description of what a transcoder produces.  It
+ * lives next to the transcoder as "<transcoder>.profile" and holds
+ * "mime=" and "dlna_pn=" lines, and "segments=yes" if the transcoder can
+ * split its output itself; '#' starts a comment. */
+static struct transcode_profile_s *
+transcode_read_profile(const char *transcoder)
+{
+	char path[PATH_MAX], buf[256];
+	char *key, *val, *end;
+	struct transcode_profile_s *profile;
+	FILE *f;
+
+	if( !transcoder || snprintf(path, sizeof(path), "%s.profile", transcoder) >= sizeof(path) )
+		return NULL;
+	f = fopen(path, "r");
+	if( !f )
+		return NULL;
+	profile = calloc(1, sizeof(struct transcode_profile_s));
+	if( !profile )
+	{
+		fclose(f);
+		return NULL;
+	}
+	while( fgets(buf, sizeof(buf), f) )
+	{
+		key = buf;
+		while( isspace(*key) )
+			key++;
+		if( *key == '#' || !(val = strchr(key, '=')) )
 			continue;
-		}
-		else if( video_stream == -1 &&
-			ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO )
-		{
-			video_stream = i;
-			vc = ctx->streams[video_stream]->codec;
+		for( end = val; end > key && isspace(end[-1]); end-- );
+		*end = '\0';
+		val++;
+		while( isspace(*val) )
+			val++;
+		for( end = val + strlen(val); end > val && isspace(end[-1]); end-- );
+		*end = '\0';
+		if( !*val )
 			continue;
-		}
+		if( strcasecmp(key, "mime") == 0 && !profile->mime )
+			profile->mime = strdup(val);
+		else if( strcasecmp(key, "dlna_pn") == 0 && !profile->dlna_pn )
+			profile->dlna_pn = strdup(val);
+		else if( strcasecmp(key, "segments") == 0 )
+			profile->segments = (strcasecmp(val, "yes") == 0);
+		else
+			DPRINTF(E_WARN, L_TRANSCODE, "Unknown key '%s' in %s\n", key, path);
 	}
-	if ( vc == NULL )
+	fclose(f);
+
+	if( !profile->mime )
 	{
-		/* This must not be a video file. */
-		DPRINTF(E_ERROR, L_TRANSCODE, "File does not contain a video stream.\n");
-		lav_close(ctx);
-		return 0;
+		DPRINTF(E_WARN, L_TRANSCODE, "No mime type declared in %s\n", path);
+		transcode_free_profile(profile);
+		return NULL;
 	}
+	DPRINTF(E_DEBUG, L_TRANSCODE, "Read transcoder profile %s\n", path);
 
-	/* check if the file needs to be transcoded */
+	return profile;
+}
 
-	/* check the container */
-	for ( i = 0; i < 2; i++ )
+/* The profile read at startup for a transcoder, if it has one */
+static struct transcode_profile_s *
+transcode_get_profile(const char *transcoder)
+{
+	struct transcode_info_s *info;
+	int i;
+
+	if( !transcoder )
+		return NULL;
+	for( i = 0; client_types[i].name; i++ )
 	{
-		if (clients_info[i])
-		{
-			transcode_format_it = clients_info[i]->video_containers;
-			/* test for the reserved value "all" */
-			if ( transcode_format_it && strcmp(transcode_format_it->value, "all") == 0 )
-			{
-				lav_close(ctx);
-				return 1;
-			}
+		info = client_types[i].transcode_info;
+		if( !info )
+			continue;
+		if( info->audio_transcoder && strcmp(info->audio_transcoder, transcoder) == 0 )
+			return info->audio_profile;
+		if( info->video_transcoder && strcmp(info->video_transcoder, transcoder) == 0 )
+			return info->video_profile;
+		if( info->image_transcoder && strcmp(info->image_transcoder, transcoder) == 0 )
+			return info->image_profile;
+	}
 
-			while( transcode_format_it )
-			{
-				if ( strcmp(ctx->iformat->name, transcode_format_it->value) == 0 )
-				{
-					lav_close(ctx);
-					return 1;
-				}
-				transcode_format_it = transcode_format_it->next;
-			}
-		}
+	return NULL;
+}
+
+/* Find out which MIME type and DLNA profile a transcoder will produce
+ * for a file, without running it.  The transcoder's profile sidecar takes
+ * precedence; otherwise the result of an earlier probe of the same file
+ * and client is used.  Returns -1 if the output still has to be probed. */
+int
+transcode_get_output(int64_t id, enum client_types client, const char *transcoder, struct dlna_meta_s *out)
+{
+	struct transcode_profile_s *profile;
+	char sql[128];
+	char **result;
+	int rows = 0;
+
+	memset(out, 0, sizeof(*out));
+	profile = transcode_get_profile(transcoder);
+	if( profile )
+	{
+		out->mime = strdup(profile->mime);
+		if( profile->dlna_pn )
+			out->dlna_pn = strdup(profile->dlna_pn);
+		return 0;
 	}
 
-	/* check the video codec */
-	for ( i = 0; i < 2; i++ )
+	snprintf(sql, sizeof(sql), "SELECT MIME, DLNA_PN from TRANSCODE"
+	                           " where ID = %lld and CLIENT = %d and MIME is not NULL",
+	                           (long long)id, client);
+	if( sql_get_table(db, sql, &result, &rows, NULL) != SQLITE_OK )
+		return -1;
+	if( rows )
 	{
-		if (clients_info[i])
-		{
-			transcode_format_it = clients_info[i]->video_codecs;
-			/* test for the reserved value "all" */
-			if ( transcode_format_it && strcmp(transcode_format_it->value, "all") == 0 )
-			{
-				lav_close(ctx);
-				return 1;
-			}
-			
-			codec = avcodec_find_decoder(vc->codec_id);
-			while( transcode_format_it )
-			{
-				if ( strcmp(codec->name, transcode_format_it->value) == 0 )
-				{
-					lav_close(ctx);
-					return 1;
-				}
-				transcode_format_it = transcode_format_it->next;
-			}
-		}
+		out->mime = strdup(result[2]);
+		if( result[3] )
+			out->dlna_pn = strdup(result[3]);
 	}
-	
-	/* check the audio codec */
-	for ( i = 0; i < 2; i++ )
+	sqlite3_free_table(result);
+
+	return rows ? 0 : -1;
+}
+
+/* Whether the transcoder's profile says it can split its output into
+ * segment files during a single run. */
+int
+transcode_segments(const char *transcoder)
+{
+	struct transcode_profile_s *profile = transcode_get_profile(transcoder);
+
+	return profile ? profile->segments : 0;
+}
+
+/* Remember the probed output of a transcoder for a file and client. */
+void
+transcode_set_output(int64_t id, enum client_types client, const struct dlna_meta_s *out)
+{
+	sql_exec(db, "UPDATE TRANSCODE set MIME = %Q, DLNA_PN = %Q where ID = %lld and CLIENT = %d",
+	         out->mime, out->dlna_pn, (long long)id, client);
+}
+
+static void
+transcode_hash_str(uint32_t *hash, const char *str)
+{
+	if( str )
 	{
-		if (clients_info[i])
-		{
-			transcode_format_it = clients_info[i]->audio_codecs;
-			/* test for the reserved value "all" */
-			if ( transcode_format_it && strcmp(transcode_format_it->value, "all") == 0 )
-			{
-				lav_close(ctx);
-				return 1;
-			}
+		for( ; *str; str++ )
+			*hash = (*hash * 33) ^ (unsigned char)*str;
+	}
+	*hash = (*hash * 33) ^ ';';
+}
 
-			codec = avcodec_find_decoder(ac->codec_id);
-			while( transcode_format_it )
-			{
-				if ( strcmp(codec->name, transcode_format_it->value) == 0 )
-				{
-					lav_close(ctx);
-					return 1;
-				}
-				transcode_format_it = transcode_format_it->next;
-			}
-		}
+static void
+transcode_hash_list(uint32_t *hash, struct transcode_list_format_s *list)
+{
+	const char *p;
+
+	for( ; list; list = list->next )
+	{
+		for( p = list->value; *p; p++ )
+			*hash = (*hash * 33) ^ (unsigned char)*p;
+		*hash = (*hash * 33) ^ '/';
 	}
+	*hash = (*hash * 33) ^ ';';
+}
 
-	lav_close(ctx);
-	return 0;
+/* Read the transcoders' profiles, and discard persisted transcode
+ * decisions if the transcode configuration changed since they were made. */
+void
+transcode_check_config(void)
+{
+	struct transcode_info_s *info;
+	uint32_t hash = 5381;
+	char *old;
+	int i;
+
+	for( i = 0; client_types[i].name; i++ )
+	{
+		info = client_types[i].transcode_info;
+		if( !info )
+			continue;
+		hash = (hash * 33) ^ i;
+		transcode_hash_list(&hash, info->audio_codecs);
+		transcode_hash_list(&hash, info->video_codecs);
+		transcode_hash_list(&hash, info->video_containers);
+		transcode_hash_list(&hash, info->image_formats);
+		transcode_hash_str(&hash, info->audio_transcoder);
+		transcode_hash_str(&hash, info->video_transcoder);
+		transcode_hash_str(&hash, info->image_transcoder);
+		info->audio_profile = transcode_read_profile(info->audio_transcoder);
+		info->video_profile = transcode_read_profile(info->video_transcoder);
+		info->image_profile = transcode_read_profile(info->image_transcoder);
+	}
+
+	old = sql_get_text_field(db, "SELECT VALUE from SETTINGS where KEY = 'TRANSCODE_CONFIG'");
+	if( old && strtoul(old, NULL, 10) == hash )
+	{
+		sqlite3_free(old);
+		return;
+	}
+	if( old )
+		DPRINTF(E_INFO, L_TRANSCODE, "Transcode configuration changed, discarding cached decisions\n");
+	sqlite3_free(old);
+	sql_exec(db, "DELETE from TRANSCODE");
+	sql_exec(db, "DELETE from SETTINGS where KEY = 'TRANSCODE_CONFIG'");
+	sql_exec(db, "INSERT into SETTINGS values ('TRANSCODE_CONFIG', '%u')", hash);
 }
@@ -21,9 +21,11 @@
 
 enum client_types;
 struct AVFormatContext;
+struct dlna_meta_s;
 
 pid_t
-exec_transcode(char *transcoder, char *source_path, int offset, int end_offset, int *pipehandle);
+exec_transcode(char *transcoder, char *source_path, int offset, int end_offset,
+               char *segments, char *splits, int *pipehandle);
 
 pid_t
 exec_transcode_img(char *transcoder, char *source_path, char *dest_path);
@@ -37,4 +39,32 @@ needs_transcode_audio(const char* path, enum client_types client);
 int
 needs_transcode_video(const char* path, enum client_types client);
 
+int
+transcode_check_facts(char type, enum client_types client, const char *container,
+                      const char *video_codec, const char *audio_codec);
+
+int
+transcode_enabled(char type);
+
+char *
+transcode_get_transcoder(char type, enum client_types client);
+
+int
+transcode_probe(const char *path, char **container, char **video_codec, char **audio_codec);
+
+int
+transcode_decision(int64_t id, const char *path, const char *mime, enum client_types client);
+
+int
+transcode_get_output(int64_t id, enum client_types client, const char *transcoder, struct dlna_meta_s *out);
+
+int
+transcode_segments(const char *transcoder);
+
+void
+transcode_set_output(int64_t id, enum client_types client, const struct dlna_meta_s *out);
+
+void
+transcode_check_config(void);
+
 #endif /* __TRANSCODE_H__ */
@@ -0,0 +1,373 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "upnpglobalvars.h"
+#include "transcodecache.h"
+#include "utils.h"
+#include "log.h"
+
+/* Transcoder output is kept on disk below <db_path>/transcode_cache, one
+ * directory per source file, mtime and transcoder.  Each segment covers
+ * TRANSCODE_SEGMENT_MS of source time, so time seeks only need the segments
+ * they touch, and once all of them exist the output has a known size and can
+ * be served by byte range.  Only transcoders that split their output
+ * themselves are cached: the segments of one run join up seamlessly,
+ * while separate runs would each restart their timestamps and headers.
+ * Segment mtimes record their last use and drive the LRU eviction.
+ *
+ * Segments are committed by forked children, so the running size of the
+ * cache is kept in memory mapped shared before any fork.  The tree is only
+ * walked to seed that count and, once it passes the limit, to evict. */
+
+/* Only the server may add to the cache; anything else could plant content
+ * that is then streamed to clients */
+#define CACHE_DIR_MODE (S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH)
+
+struct cache_segment_s {
+	char path[PATH_MAX];
+	time_t used;
+	off_t size;
+};
+
+static volatile int64_t *cache_used = NULL;
+
+static uint64_t
+cache_hash(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--)
+	{
+		hash ^= *p++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+int
+transcode_cache_dir(const char *path, const char *transcoder, char *dir, size_t len)
+{
+	struct stat st;
+	uint64_t hash = 14695981039346656037ULL;
+	int64_t mtime;
+
+	if (!runtime_vars.transcode_cache_size || !transcoder)
+		return -1;
+	if (stat(path, &st) != 0)
+		return -1;
+	mtime = st.st_mtime;
+	hash = cache_hash(hash, path, strlen(path) + 1);
+	hash = cache_hash(hash, transcoder, strlen(transcoder) + 1);
+	hash = cache_hash(hash, &mtime, sizeof(mtime));
+
+	snprintf(dir, len, "%s/transcode_cache/%016llx", db_path, (unsigned long long)hash);
+	if (access(dir, F_OK) != 0 && make_dir(dir, CACHE_DIR_MODE) != 0)
+		return -1;
+
+	return 0;
+}
+
+int
+transcode_cache_open(const char *dir, int segment, off_t *size)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%d", dir, segment);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	*size = st.st_size;
+	utime(path, NULL);
+
+	return fd;
+}
+
+/* Returns the total size of the output once every segment is cached */
+off_t
+transcode_cache_complete(const char *dir, int segments)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	off_t total = 0;
+	int i;
+
+	for (i = 0; i < segments; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%d", dir, i);
+		if (stat(path, &st) != 0)
+			return -1;
+		total += st.st_size;
+	}
+
+	return segments ? total : -1;
+}
+
+/* A transcoder that splits its own output writes the pieces of one run as
+ * <pid>.<n>, numbered from 0; this gives the pattern to pass it. */
+void
+transcode_cache_pieces(const char *dir, char *pattern, size_t len)
+{
+	snprintf(pattern, len, "%s/%d.%%d", dir, (int)getpid());
+}
+
+/* The times, relative to start, at which a run from start to end splits
+ * its output into segments.  The last one is past the end, so that the
+ * final segment is cut there as well.  Returns a malloc'ed string. */
+char *
+transcode_cache_splits(int start, int end)
+{
+	char *splits, *p;
+	int bound;
+
+	splits = malloc((TRANSCODE_SEGMENTS(end - start + 1) + 2) * 16);
+	if (!splits)
+		return NULL;
+	p = splits;
+	for (bound = (start / TRANSCODE_SEGMENT_MS + 1) * TRANSCODE_SEGMENT_MS; ; bound += TRANSCODE_SEGMENT_MS)
+	{
+		p += sprintf(p, "%s%d.%03d", p == splits ? "" : ",",
+		             (bound - start) / 1000, (bound - start) % 1000);
+		if (bound > end)
+			break;
+	}
+
+	return splits;
+}
+
+/* Stores the pieces of a run that started in segment first.  Only pieces
+ * covering the segments from whole_from to whole_to are complete; of a run
+ * that was cut short the last piece is incomplete as well. */
+void
+transcode_cache_commit_pieces(const char *dir, int first, int whole_from, int whole_to, int ok)
+{
+	char piece[PATH_MAX], next[PATH_MAX];
+	int i, seg;
+
+	snprintf(piece, sizeof(piece), "%s/%d.%d", dir, (int)getpid(), 0);
+	for (i = 0; access(piece, F_OK) == 0; i++)
+	{
+		seg = first + i;
+		snprintf(next, sizeof(next), "%s/%d.%d", dir, (int)getpid(), i + 1);
+		transcode_cache_commit(piece, dir, seg, seg >= whole_from && seg <= whole_to &&
+		                                         (ok || access(next, F_OK) == 0));
+		strcpy(piece, next);
+	}
+}
+
+static int
+segment_cmp(const void *a, const void *b)
+{
+	const struct cache_segment_s *s1 = a, *s2 = b;
+
+	return (s1->used > s2->used) - (s1->used < s2->used);
+}
+
+/* Walks the finished segments, collecting them in segs when it is given,
+ * and returns their total size */
+static off_t
+cache_scan(struct cache_segment_s **segs, int *n)
+{
+	char root[PATH_MAX], dir[PATH_MAX], path[PATH_MAX];
+	struct cache_segment_s *tmp;
+	struct dirent *e, *f;
+	struct stat st;
+	DIR *rd, *dd;
+	off_t total = 0;
+	int alloc = 0;
+
+	if (segs)
+	{
+		*segs = NULL;
+		*n = 0;
+	}
+	snprintf(root, sizeof(root), "%s/transcode_cache", db_path);
+	rd = opendir(root);
+	if (!rd)
+		return 0;
+	while ((e = readdir(rd)))
+	{
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(dir, sizeof(dir), "%s/%s", root, e->d_name);
+		dd = opendir(dir);
+		if (!dd)
+			continue;
+		while ((f = readdir(dd)))
+		{
+			/* in-progress segments are named <n>.<pid> */
+			if (f->d_name[0] == '.' || strchr(f->d_name, '.'))
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", dir, f->d_name);
+			if (stat(path, &st) != 0)
+				continue;
+			total += st.st_size;
+			if (!segs)
+				continue;
+			if (*n == alloc)
+			{
+				tmp = realloc(*segs, (alloc ? alloc * 2 : 64) * sizeof(struct cache_segment_s));
+				if (!tmp)
+					continue;
+				*segs = tmp;
+				alloc = alloc ? alloc * 2 : 64;
+			}
+			strcpy((*segs)[*n].path, path);
+			(*segs)[*n].used = st.st_mtime;
+			(*segs)[*n].size = st.st_size;
+			(*n)++;
+		}
+		closedir(dd);
+	}
+	closedir(rd);
+
+	return total;
+}
+
+/* Caches created by earlier versions were writable by everyone */
+static void
+cache_restrict(void)
+{
+	char root[PATH_MAX], dir[PATH_MAX];
+	struct dirent *e;
+	DIR *rd;
+
+	snprintf(root, sizeof(root), "%s/transcode_cache", db_path);
+	rd = opendir(root);
+	if (!rd)
+		return;
+	chmod(root, CACHE_DIR_MODE);
+	while ((e = readdir(rd)))
+	{
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(dir, sizeof(dir), "%s/%s", root, e->d_name);
+		chmod(dir, CACHE_DIR_MODE);
+	}
+	closedir(rd);
+}
+
+int
+transcode_cache_init(void)
+{
+	void *p;
+
+	if (!runtime_vars.transcode_cache_size)
+		return 0;
+	cache_restrict();
+	p = mmap(NULL, sizeof(*cache_used), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		DPRINTF(E_WARN, L_TRANSCODE, "Unable to map the transcode cache size: %s\n", strerror(errno));
+		return -1;
+	}
+	cache_used = p;
+	*cache_used = cache_scan(NULL, NULL);
+
+	return 0;
+}
+
+off_t
+transcode_cache_usage(void)
+{
+	if (cache_used)
+		return *cache_used;
+	return cache_scan(NULL, NULL);
+}
+
+static void
+transcode_cache_evict(void)
+{
+	struct cache_segment_s *segs;
+	off_t total, limit;
+	int n, i;
+
+	limit = (off_t)runtime_vars.transcode_cache_size * 1024 * 1024;
+	total = cache_scan(&segs, &n);
+	if (total > limit)
+	{
+		qsort(segs, n, sizeof(struct cache_segment_s), segment_cmp);
+		for (i = 0; i < n && total > limit; i++)
+		{
+			DPRINTF(E_DEBUG, L_TRANSCODE, "Evicting cache segment %s\n", segs[i].path);
+			if (unlink(segs[i].path) != 0)
+				continue;
+			total -= segs[i].size;
+			/* drop the directory once its last segment is gone */
+			*strrchr(segs[i].path, '/') = '\0';
+			rmdir(segs[i].path);
+		}
+	}
+	free(segs);
+	/* the walk also corrects whatever the count lost to races */
+	if (cache_used)
+		*cache_used = total;
+}
+
+/* Segments are written under a temporary name and renamed into place when
+ * the transcoder finished them, so concurrent streams never see a partial
+ * segment and the last one to finish simply wins. */
+void
+transcode_cache_commit(const char *tmp, const char *dir, int segment, int ok)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	off_t old;
+
+	if (!ok)
+	{
+		unlink(tmp);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%d", dir, segment);
+	/* a concurrent stream may have stored the same segment already */
+	if (stat(path, &st) != 0)
+		st.st_size = 0;
+	old = st.st_size;
+	if (stat(tmp, &st) != 0)
+		st.st_size = 0;
+	if (rename(tmp, path) != 0)
+	{
+		DPRINTF(E_WARN, L_TRANSCODE, "Unable to store cache segment %s: %s\n",
+			path, strerror(errno));
+		unlink(tmp);
+		return;
+	}
+	if (cache_used)
+		__sync_fetch_and_add(cache_used, (int64_t)(st.st_size - old));
+	if (transcode_cache_usage() > (off_t)runtime_vars.transcode_cache_size * 1024 * 1024)
+		transcode_cache_evict();
+}
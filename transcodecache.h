@@ -0,0 +1,37 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TRANSCODECACHE_H__
+#define __TRANSCODECACHE_H__
+
+#include <sys/types.h>
+
+/* Source time covered by one cached segment, in milliseconds */
+#define TRANSCODE_SEGMENT_MS 60000
+
+#define TRANSCODE_SEGMENTS(duration) (((duration) + TRANSCODE_SEGMENT_MS - 1) / TRANSCODE_SEGMENT_MS)
+
+int transcode_cache_init(void);
+int transcode_cache_dir(const char *path, const char *transcoder, char *dir, size_t len);
+int transcode_cache_open(const char *dir, int segment, off_t *size);
+off_t transcode_cache_complete(const char *dir, int segments);
+void transcode_cache_commit(const char *tmp, const char *dir, int segment, int ok);
+void transcode_cache_pieces(const char *dir, char *pattern, size_t len);
+char *transcode_cache_splits(int start, int end);
+void transcode_cache_commit_pieces(const char *dir, int first, int whole_from, int whole_to, int ok);
+off_t transcode_cache_usage(void);
+
+#endif
@@ -0,0 +1,6 @@
+# Output produced by transcode_audio, so the server does not need to run
+# the transcoder to find out what it will send.
+mime=audio/mpeg
+dlna_pn=MP3
+# The transcoder can split its output into cache segments itself
+segments=yes
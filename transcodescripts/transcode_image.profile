@@ -0,0 +1,3 @@
+# Output produced by transcode_image (JPEG, at most 1920x1080)
+mime=image/jpeg
+dlna_pn=JPEG_LRG
@@ -0,0 +1,3 @@
+# Output produced by transcode_video-hardcodesub (PAL MPEG-2 program stream)
+mime=video/mpeg
+dlna_pn=MPEG_PS_PAL
@@ -0,0 +1,5 @@
+# Output produced by transcode_video (ffmpeg -target pal-dvd)
+mime=video/mpeg
+dlna_pn=MPEG_PS_PAL
+# The transcoder can split its output into cache segments itself
+segments=yes
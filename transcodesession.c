@@ -0,0 +1,360 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include "transcodesession.h"
+#include "log.h"
+
+#define SESSION_BUFFER_SIZE 65536
+
+/* Streams are served by forked children, so concurrent requests for the
+ * same transcoded output meet in a region mapped shared before any fork.
+ * The first request runs the transcoder and copies its output into the
+ * session's ring buffer; later ones attach as readers while the start of
+ * the output is still buffered.  The producer only overwrites data every
+ * reader has sent, and drops readers that hold it up for too long. */
+
+struct transcode_session_s {
+	int64_t id;
+	int client;
+	int offset;
+	int end_offset;
+	pid_t producer;		/* 0 when the session is unused */
+	int done;
+	int status;
+	uint64_t written;
+	pid_t reader[TRANSCODE_SESSION_READERS];
+	uint64_t readpos[TRANSCODE_SESSION_READERS];
+	int dropped[TRANSCODE_SESSION_READERS];
+	pthread_cond_t cond;
+	char *ring;
+};
+
+struct session_shm_s {
+	pthread_mutex_t lock;
+	struct transcode_session_s session[TRANSCODE_SESSIONS];
+};
+
+static struct session_shm_s *shm = NULL;
+static size_t shm_size = 0;
+
+int
+transcode_session_init(void)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	void *p;
+	int i;
+
+	shm_size = sizeof(struct session_shm_s) + (size_t)TRANSCODE_SESSIONS * TRANSCODE_SESSION_RING;
+	p = mmap(NULL, shm_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		DPRINTF(E_WARN, L_TRANSCODE, "Unable to map transcode sessions: %s\n", strerror(errno));
+		return -1;
+	}
+	shm = p;
+
+	/* a child may die holding the lock, so it has to be robust */
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shm->lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	for (i = 0; i < TRANSCODE_SESSIONS; i++)
+	{
+		pthread_cond_init(&shm->session[i].cond, &cattr);
+		shm->session[i].ring = (char *)(shm + 1) + (size_t)i * TRANSCODE_SESSION_RING;
+	}
+	pthread_condattr_destroy(&cattr);
+
+	return 0;
+}
+
+void
+transcode_session_free(void)
+{
+	if (!shm)
+		return;
+	munmap(shm, shm_size);
+	shm = NULL;
+}
+
+static void
+session_lock(void)
+{
+	if (pthread_mutex_lock(&shm->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&shm->lock);
+}
+
+static void
+session_wait(struct transcode_session_s *s)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 1;
+	if (pthread_cond_timedwait(&s->cond, &shm->lock, &ts) == EOWNERDEAD)
+		pthread_mutex_consistent(&shm->lock);
+}
+
+static int
+process_alive(pid_t pid)
+{
+	return (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/* Forgets readers that died and returns how many are left */
+static int
+session_readers(struct transcode_session_s *s)
+{
+	int i, n = 0;
+
+	for (i = 0; i < TRANSCODE_SESSION_READERS; i++)
+	{
+		if (!s->reader[i])
+			continue;
+		if (!process_alive(s->reader[i]))
+			s->reader[i] = 0;
+		else
+			n++;
+	}
+
+	return n;
+}
+
+struct transcode_session_s *
+transcode_session_attach(int64_t id, enum client_types client, int offset, int end_offset, int *slot)
+{
+	struct transcode_session_s *s, *unused = NULL;
+	int i, j;
+
+	if (!shm)
+		return NULL;
+
+	session_lock();
+	for (i = 0; i < TRANSCODE_SESSIONS; i++)
+	{
+		s = &shm->session[i];
+		if (s->producer && !s->done && !process_alive(s->producer))
+		{
+			s->done = 1;
+			s->status = -1;
+			pthread_cond_broadcast(&s->cond);
+		}
+		if (s->producer && s->done && !session_readers(s))
+			s->producer = 0;
+		if (!s->producer)
+		{
+			if (!unused)
+				unused = s;
+			continue;
+		}
+		if (s->done || s->id != id || s->client != client ||
+		    s->offset != offset || s->end_offset != end_offset)
+			continue;
+		/* the reader has to get the output from its first byte */
+		if (s->written >= TRANSCODE_SESSION_RING)
+			continue;
+		for (j = 0; j < TRANSCODE_SESSION_READERS; j++)
+		{
+			if (s->reader[j])
+				continue;
+			s->reader[j] = getpid();
+			s->readpos[j] = 0;
+			s->dropped[j] = 0;
+			pthread_mutex_unlock(&shm->lock);
+			DPRINTF(E_INFO, L_TRANSCODE, "Sharing transcoder of PID %d\n", (int)s->producer);
+			*slot = j;
+			return s;
+		}
+	}
+	if (unused)
+	{
+		s = unused;
+		s->id = id;
+		s->client = client;
+		s->offset = offset;
+		s->end_offset = end_offset;
+		s->producer = getpid();
+		s->done = 0;
+		s->status = 0;
+		s->written = 0;
+		memset(s->reader, 0, sizeof(s->reader));
+		*slot = -1;
+	}
+	pthread_mutex_unlock(&shm->lock);
+
+	return unused;
+}
+
+int
+transcode_session_write(struct transcode_session_s *s, const char *buf, size_t len)
+{
+	size_t chunk, pos, first;
+	uint64_t low;
+	time_t stalled = 0;
+	int i;
+
+	session_lock();
+	while (len > 0)
+	{
+		chunk = MIN(len, TRANSCODE_SESSION_RING / 4);
+		session_readers(s);
+		low = s->written;
+		for (i = 0; i < TRANSCODE_SESSION_READERS; i++)
+			if (s->reader[i] && !s->dropped[i])
+				low = MIN(low, s->readpos[i]);
+		if (s->written + chunk - low > TRANSCODE_SESSION_RING)
+		{
+			if (!stalled)
+				stalled = time(NULL);
+			else if (time(NULL) - stalled >= TRANSCODE_SESSION_STALL)
+			{
+				for (i = 0; i < TRANSCODE_SESSION_READERS; i++)
+				{
+					if (!s->reader[i] || s->dropped[i] ||
+					    s->written + chunk - s->readpos[i] <= TRANSCODE_SESSION_RING)
+						continue;
+					DPRINTF(E_WARN, L_TRANSCODE, "Dropping slow reader PID %d\n", (int)s->reader[i]);
+					s->dropped[i] = 1;
+				}
+				pthread_cond_broadcast(&s->cond);
+				stalled = 0;
+				continue;
+			}
+			session_wait(s);
+			continue;
+		}
+		stalled = 0;
+
+		pos = s->written % TRANSCODE_SESSION_RING;
+		first = MIN(chunk, TRANSCODE_SESSION_RING - pos);
+		memcpy(s->ring + pos, buf, first);
+		memcpy(s->ring, buf + first, chunk - first);
+		s->written += chunk;
+		buf += chunk;
+		len -= chunk;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&shm->lock);
+
+	return 0;
+}
+
+int
+transcode_session_readers(struct transcode_session_s *s)
+{
+	int n;
+
+	session_lock();
+	n = session_readers(s);
+	pthread_mutex_unlock(&shm->lock);
+
+	return n;
+}
+
+void
+transcode_session_finish(struct transcode_session_s *s, int status)
+{
+	session_lock();
+	s->done = 1;
+	s->status = status;
+	if (!session_readers(s))
+		s->producer = 0;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&shm->lock);
+}
+
+/* Sends the session output to sock until the producer is done.  Returns
+ * the producer's status, or -1 if this reader could not keep up. */
+int
+transcode_session_follow(struct transcode_session_s *s, int slot, int sock)
+{
+	char *buf;
+	size_t chunk, pos, first, off;
+	uint64_t readpos = 0;
+	ssize_t n = 0;
+	int status = -1;
+
+	buf = malloc(SESSION_BUFFER_SIZE);
+	session_lock();
+	while (buf)
+	{
+		if (s->dropped[slot])
+		{
+			DPRINTF(E_WARN, L_TRANSCODE, "Client could not keep up with the shared transcoder\n");
+			break;
+		}
+		if (s->written > readpos)
+		{
+			chunk = MIN(s->written - readpos, SESSION_BUFFER_SIZE);
+			pos = readpos % TRANSCODE_SESSION_RING;
+			first = MIN(chunk, TRANSCODE_SESSION_RING - pos);
+			memcpy(buf, s->ring + pos, first);
+			memcpy(buf + first, s->ring, chunk - first);
+			pthread_mutex_unlock(&shm->lock);
+
+			for (off = 0; off < chunk; off += n)
+			{
+				n = write(sock, buf + off, chunk - off);
+				if (n < 0 && errno == EAGAIN)
+				{
+					n = 0;
+					usleep(100000);
+				}
+				else if (n < 0)
+					break;
+			}
+
+			session_lock();
+			if (n < 0)
+				break;
+			readpos += chunk;
+			s->readpos[slot] = readpos;
+			pthread_cond_broadcast(&s->cond);
+			continue;
+		}
+		if (s->done)
+		{
+			status = s->status;
+			break;
+		}
+		if (!process_alive(s->producer))
+			break;
+		session_wait(s);
+	}
+	s->reader[slot] = 0;
+	if (s->done && !session_readers(s))
+		s->producer = 0;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&shm->lock);
+	free(buf);
+
+	return status;
+}
@@ -0,0 +1,40 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __TRANSCODESESSION_H__
+#define __TRANSCODESESSION_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "clients.h"
+
+#define TRANSCODE_SESSIONS 4		/* transcoders that can be shared at once */
+#define TRANSCODE_SESSION_READERS 8	/* extra connections per transcoder */
+#define TRANSCODE_SESSION_RING 4194304	/* 4MB of output kept for the readers */
+#define TRANSCODE_SESSION_STALL 10	/* seconds a reader may hold up the others */
+
+struct transcode_session_s;
+
+int transcode_session_init(void);
+void transcode_session_free(void);
+struct transcode_session_s *transcode_session_attach(int64_t id, enum client_types client,
+                                                     int offset, int end_offset, int *slot);
+int transcode_session_write(struct transcode_session_s *s, const char *buf, size_t len);
+int transcode_session_readers(struct transcode_session_s *s);
+void transcode_session_finish(struct transcode_session_s *s, int status);
+int transcode_session_follow(struct transcode_session_s *s, int slot, int sock);
+
+#endif
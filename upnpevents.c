@@ -63,6 +63,7 @@
 #include <errno.h>
 
 #include "upnpevents.h"
+#include "event.h"
 #include "minidlnapath.h"
 #include "upnpglobalvars.h"
 #include "upnpdescgen.h"
@@ -84,6 +85,7 @@ struct subscriber {
 struct upnp_event_notify {
 	LIST_ENTRY(upnp_event_notify) entries;
     int s;  /* socket */
+	struct event ev;
     enum { ECreated=1,
 	       EConnecting,
 	       ESending,
@@ -103,6 +105,10 @@ struct upnp_event_notify {
 /* prototypes */
 static void
 upnp_event_create_notify(struct subscriber * sub);
+static void
+upnp_event_notify_connect(struct upnp_event_notify * obj);
+static void
+upnp_event_process_notify(struct event *ev);
 
 /* Subscriber list */
 LIST_HEAD(listhead, subscriber) subscriberlist = { NULL };
@@ -217,6 +223,27 @@ upnp_event_var_change_notify(enum subscriber_service_enum service)
 	}
 }
 
+static void
+upnp_event_notify_free(struct upnp_event_notify * obj)
+{
+	event_del(&obj->ev);
+	if(obj->s >= 0) {
+		close(obj->s);
+	}
+	if(obj->sub)
+		obj->sub->notify = NULL;
+#if 0 /* Just let it time out instead of explicitly removing the subscriber */
+	/* remove also the subscriber from the list if there was an error */
+	if(obj->state == EError && obj->sub) {
+		LIST_REMOVE(obj->sub, entries);
+		free(obj->sub);
+	}
+#endif
+	free(obj->buffer);
+	LIST_REMOVE(obj, entries);
+	free(obj);
+}
+
 /* create and add the notify object to the list */
 static void
 upnp_event_create_notify(struct subscriber * sub)
@@ -248,6 +275,14 @@ upnp_event_create_notify(struct subscriber * sub)
 	if(sub)
 		sub->notify = obj;
 	LIST_INSERT_HEAD(&notifylist, obj, entries);
+	/* connect right away, the socket turns writable once it is done */
+	upnp_event_notify_connect(obj);
+	obj->ev.fd = obj->s;
+	obj->ev.rdwr = EVENT_WRITE;
+	obj->ev.process = upnp_event_process_notify;
+	obj->ev.data = obj;
+	if(obj->state != EConnecting || event_add(&obj->ev) != 0)
+		upnp_event_notify_free(obj);
 	return;
 error:
 	if(obj->s >= 0)
@@ -359,6 +394,9 @@ static void upnp_event_send(struct upnp_event_notify * obj)
 	while( obj->sent < obj->tosend ) {
 		i = send(obj->s, obj->buffer + obj->sent, obj->tosend - obj->sent, 0);
 		if(i<0) {
+			/* still registered for writing, carry on next time */
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
 			DPRINTF(E_WARN, L_HTTP, "%s: send(): %s\n", "upnp_event_send", strerror(errno));
 			obj->state = EError;
 			return;
@@ -390,13 +428,18 @@ static void upnp_event_recv(struct upnp_event_notify * obj)
 }
 
 static void
-upnp_event_process_notify(struct upnp_event_notify * obj)
+upnp_event_process_notify(struct event *ev)
 {
+	struct upnp_event_notify * obj = ev->data;
+
+	DPRINTF(E_DEBUG, L_HTTP, "%s: %p %d %d\n",
+	       "upnp_event_process_notify", obj, obj->state, obj->s);
 	switch(obj->state) {
 	case EConnecting:
 		/* now connected or failed to connect */
 		upnp_event_prepare(obj);
-		upnp_event_send(obj);
+		if(obj->state == ESending)
+			upnp_event_send(obj);
 		break;
 	case ESending:
 		upnp_event_send(obj);
@@ -404,84 +447,32 @@ upnp_event_process_notify(struct upnp_event_notify * obj)
 	case EWaitingForResponse:
 		upnp_event_recv(obj);
 		break;
-	case EFinished:
-		close(obj->s);
-		obj->s = -1;
-		break;
 	default:
 		DPRINTF(E_ERROR, L_HTTP, "upnp_event_process_notify: unknown state\n");
+		obj->state = EError;
 	}
-}
 
-void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int * max_fd)
-{
-	struct upnp_event_notify * obj;
-	for(obj = notifylist.lh_first; obj != NULL; obj = obj->entries.le_next) {
-		DPRINTF(E_DEBUG, L_HTTP, "upnpevents_selectfds: %p %d %d\n",
-		       obj, obj->state, obj->s);
-		if(obj->s >= 0) {
-			switch(obj->state) {
-			case ECreated:
-				upnp_event_notify_connect(obj);
-				if(obj->state != EConnecting)
-					break;
-			case EConnecting:
-			case ESending:
-				FD_SET(obj->s, writeset);
-				if(obj->s > *max_fd)
-					*max_fd = obj->s;
-				break;
-			case EWaitingForResponse:
-				FD_SET(obj->s, readset);
-				if(obj->s > *max_fd)
-					*max_fd = obj->s;
-				break;
-			default:
-				break;
-			}
-		}
+	switch(obj->state) {
+	case EWaitingForResponse:
+		if(ev->rdwr == EVENT_WRITE && event_mod(ev, EVENT_READ) != 0)
+			upnp_event_notify_free(obj);
+		break;
+	case EFinished:
+	case EError:
+		upnp_event_notify_free(obj);
+		break;
+	default:
+		break;
 	}
 }
 
-void upnpevents_processfds(fd_set *readset, fd_set *writeset)
+/* remove timeouted subscribers */
+void upnpevents_gc(void)
 {
-	struct upnp_event_notify * obj;
-	struct upnp_event_notify * next;
 	struct subscriber * sub;
 	struct subscriber * subnext;
 	time_t curtime;
-	for(obj = notifylist.lh_first; obj != NULL; obj = obj->entries.le_next) {
-		DPRINTF(E_DEBUG, L_HTTP, "%s: %p %d %d %d %d\n",
-		       "upnpevents_processfds", obj, obj->state, obj->s,
-		       FD_ISSET(obj->s, readset), FD_ISSET(obj->s, writeset));
-		if(obj->s >= 0) {
-			if(FD_ISSET(obj->s, readset) || FD_ISSET(obj->s, writeset))
-				upnp_event_process_notify(obj);
-		}
-	}
-	obj = notifylist.lh_first;
-	while(obj != NULL) {
-		next = obj->entries.le_next;
-		if(obj->state == EError || obj->state == EFinished) {
-			if(obj->s >= 0) {
-				close(obj->s);
-			}
-			if(obj->sub)
-				obj->sub->notify = NULL;
-#if 0 /* Just let it time out instead of explicitly removing the subscriber */
-			/* remove also the subscriber from the list if there was an error */
-			if(obj->state == EError && obj->sub) {
-				LIST_REMOVE(obj->sub, entries);
-				free(obj->sub);
-			}
-#endif
-			free(obj->buffer);
-			LIST_REMOVE(obj, entries);
-			free(obj);
-		}
-		obj = next;
-	}
-	/* remove timeouted subscribers */
+
 	curtime = time(NULL);
 	for(sub = subscriberlist.lh_first; sub != NULL; ) {
 		subnext = sub->entries.le_next;
@@ -492,4 +483,3 @@ void upnpevents_processfds(fd_set *readset, fd_set *writeset)
 		sub = subnext;
 	}
 }
-
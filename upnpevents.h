@@ -66,8 +66,7 @@ void upnpevents_removeSubscribers(void);
 
 int renewSubscription(const char * sid, int sidlen, int timeout);
 
-void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int * max_fd);
-void upnpevents_processfds(fd_set *readset, fd_set *writeset);
+void upnpevents_gc(void);
 
 #ifdef USE_MINIUPNPDCTL
 void write_events_details(int s);
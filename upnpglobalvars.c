@@ -89,7 +89,6 @@ char db_path[PATH_MAX] = {'\0'};
 char log_path[PATH_MAX] = {'\0'};
 struct media_dir_s * media_dirs = NULL;
 struct album_art_name_s * album_art_names = NULL;
-char *transcode_tempfile = NULL;
 short int scanning = 0;
 volatile short int quitting = 0;
 volatile uint32_t updateID = 0;
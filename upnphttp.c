@@ -79,6 +79,11 @@
 #include "getifaddr.h"
 #include "image_utils.h"
 #include "transcode.h"
+#include "filecache.h"
+#include "soapcache.h"
+#include "transcodecache.h"
+#include "transcodesession.h"
+#include "stream.h"
 #include "log.h"
 #include "sql.h"
 #include <libexif/exif-loader.h>
@@ -122,12 +127,19 @@ New_upnphttp(int s)
 		return NULL;
 	memset(ret, 0, sizeof(struct upnphttp));
 	ret->socket = s;
+	if (runtime_vars.keepalive_timeout > 0)
+		ret->expires = time(NULL) + runtime_vars.keepalive_timeout;
+	ret->ev.fd = s;
+	ret->ev.index = -1;
 	return ret;
 }
 
 void
 CloseSocket_upnphttp(struct upnphttp * h)
 {
+	/* a forked child may still hold the socket open, so epoll would
+	 * not drop it on close */
+	event_del(&h->ev);
 	if(close(h->socket) < 0)
 	{
 		DPRINTF(E_ERROR, L_HTTP, "CloseSocket_upnphttp: close(%d): %s\n", h->socket, strerror(errno));
@@ -136,6 +148,57 @@ CloseSocket_upnphttp(struct upnphttp * h)
 	h->state = 100;
 }
 
+/* Keep-alive: drop the request that was just answered and get ready for
+ * the next one, keeping whatever the client already pipelined behind it. */
+void
+Finish_upnphttp(struct upnphttp * h)
+{
+	int used;
+
+	if(!h->keepalive || h->state >= 100)
+	{
+		CloseSocket_upnphttp(h);
+		return;
+	}
+
+	used = h->req_contentoff;
+	if(h->req_command == EPost)
+		used += h->req_contentlen;
+	if(used < h->req_buflen)
+	{
+		h->req_buflen -= used;
+		memmove(h->req_buf, h->req_buf + used, h->req_buflen);
+		h->req_buf[h->req_buflen] = '\0';
+	}
+	else
+		h->req_buflen = 0;
+	free(h->res_buf);
+	h->res_buf = NULL;
+	h->res_buflen = 0;
+	h->res_buf_alloclen = 0;
+	h->req_contentlen = 0;
+	h->req_contentoff = 0;
+	h->req_command = EUnknown;
+	h->req_soapAction = NULL;
+	h->req_soapActionLen = 0;
+	h->req_Callback = NULL;
+	h->req_CallbackLen = 0;
+	h->req_NT = NULL;
+	h->req_NTLen = 0;
+	h->req_Timeout = 0;
+	h->req_SID = NULL;
+	h->req_SIDLen = 0;
+	h->req_RangeStart = 0;
+	h->req_RangeEnd = 0;
+	h->req_chunklen = 0;
+	h->reqflags = 0;
+	h->respflags = 0;
+	h->keepalive = 0;
+	h->req_count++;
+	h->expires = time(NULL) + runtime_vars.keepalive_timeout;
+	h->state = 0;
+}
+
 void
 Delete_upnphttp(struct upnphttp * h)
 {
@@ -251,6 +314,14 @@ ParseHttpHeaders(struct upnphttp * h)
 					h->req_Timeout = atoi(p+7);
 				}
 			}
+			else if(strncasecmp(line, "Connection", 10)==0)
+			{
+				p = colon + 1;
+				if(strcasestrc(p, "close", '\r'))
+					h->reqflags |= FLAG_CLOSE;
+				else if(strcasestrc(p, "keep-alive", '\r'))
+					h->reqflags |= FLAG_KEEPALIVE;
+			}
 			// Range: bytes=xxx-yyy
 			else if(strncasecmp(line, "Range", 5)==0)
 			{
@@ -289,23 +360,13 @@ ParseHttpHeaders(struct upnphttp * h)
 			}
 			else if(strncasecmp(line, "User-Agent", 10)==0)
 			{
-				int i;
 				/* Skip client detection if we already detected it. */
 				if( client )
 					goto next_header;
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EUserAgent)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
-				}
+				client = MatchClient(EUserAgent, p, '\r');
 			}
 			else if(strncasecmp(line, "X-AV-Client-Info", 16)==0)
 			{
@@ -316,16 +377,8 @@ ParseHttpHeaders(struct upnphttp * h)
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EXAVClientInfo)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
-				}
+				if ((i = MatchClient(EXAVClientInfo, p, '\r')))
+					client = i;
 			}
 			else if(strncasecmp(line, "Transfer-Encoding", 17)==0)
 			{
@@ -426,16 +479,8 @@ ParseHttpHeaders(struct upnphttp * h)
 				p = colon + 1;
 				while(isspace(*p))
 					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EFriendlyName)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
-				}
+				if ((i = MatchClient(EFriendlyName, p, '\r')))
+					client = i;
 			}
 			else if(strncasecmp(line, "uctt.upnp.org:", 14)==0)
 			{
@@ -506,6 +551,8 @@ Send400(struct upnphttp * h)
 		"<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>"
 		"<BODY><H1>Bad Request</H1>The request is invalid"
 		" for this HTTP version.</BODY></HTML>\r\n";
+	/* the request could not be framed, so neither can the next one */
+	h->keepalive = 0;
 	h->respflags = FLAG_HTML;
 	BuildResp2_upnphttp(h, 400, "Bad Request",
 	                    body400, sizeof(body400) - 1);
@@ -525,7 +572,7 @@ Send404(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 404, "Not Found",
 	                    body404, sizeof(body404) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* very minimalistic 406 error message */
@@ -540,7 +587,7 @@ Send406(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 406, "Not Acceptable",
 	                    body406, sizeof(body406) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* very minimalistic 416 error message */
@@ -555,7 +602,22 @@ Send416(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 416, "Requested Range Not Satisfiable",
 	                    body416, sizeof(body416) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
+}
+
+/* very minimalistic 503 error message */
+static void
+Send503(struct upnphttp * h)
+{
+	static const char body503[] =
+		"<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>"
+		"<BODY><H1>Service Unavailable</H1>The server is too busy"
+		" to send this file.</BODY></HTML>\r\n";
+	h->respflags = FLAG_HTML;
+	BuildResp2_upnphttp(h, 503, "Service Unavailable",
+	                    body503, sizeof(body503) - 1);
+	SendResp_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* very minimalistic 500 error message */
@@ -570,7 +632,7 @@ Send500(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 500, "Internal Server Errror",
 	                    body500, sizeof(body500) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* very minimalistic 501 error message */
@@ -585,7 +647,7 @@ Send501(struct upnphttp * h)
 	BuildResp2_upnphttp(h, 501, "Not Implemented",
 	                    body501, sizeof(body501) - 1);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* Sends the description generated by the parameter */
@@ -603,7 +665,7 @@ sendXMLdesc(struct upnphttp * h, char * (f)(int *))
 	}
 	BuildResp_upnphttp(h, desc, len);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 	free(desc);
 }
 
@@ -620,7 +682,7 @@ SendResp_readynas_admin(struct upnphttp * h)
 
 	BuildResp_upnphttp(h, body, l);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 #endif
 
@@ -635,9 +697,9 @@ SendResp_presentation(struct upnphttp * h)
 
 	h->respflags = FLAG_HTML;
 
-	a = sql_get_int_field(db, "SELECT count(*) from DETAILS where MIME glob 'a*'");
-	v = sql_get_int_field(db, "SELECT count(*) from DETAILS where MIME glob 'v*'");
-	p = sql_get_int_field(db, "SELECT count(*) from DETAILS where MIME glob 'i*'");
+	a = sql_get_int_field(sql_reader(), "SELECT count(*) from DETAILS where MIME glob 'a*'");
+	v = sql_get_int_field(sql_reader(), "SELECT count(*) from DETAILS where MIME glob 'v*'");
+	p = sql_get_int_field(sql_reader(), "SELECT count(*) from DETAILS where MIME glob 'i*'");
 	strcatf(&str,
 		"<HTML><HEAD><TITLE>" SERVER_NAME " " MINIDLNA_VERSION "</TITLE></HEAD>"
 		"<BODY><div style=\"text-align: center\">"
@@ -670,12 +732,15 @@ SendResp_presentation(struct upnphttp * h)
 	}
 	strcatf(&str, "</table>");
 
-	strcatf(&str, "<br>%d connection%s currently open<br>", number_of_children, (number_of_children == 1 ? "" : "s"));
+	strcatf(&str, "<br>%d connection%s currently open<br>", number_of_children + stream_count,
+	              (number_of_children + stream_count == 1 ? "" : "s"));
+	strcatf(&str, "<br>File cache: %lu hits, %lu misses<br>", file_cache_hits, file_cache_misses);
+	strcatf(&str, "Response cache: %lu hits, %lu misses<br>", soap_cache_hits, soap_cache_misses);
 	strcatf(&str, "</BODY></HTML>\r\n");
 
 	BuildResp_upnphttp(h, str.data, str.off);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* ProcessHTTPPOST_upnphttp()
@@ -702,7 +767,7 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 			BuildResp2_upnphttp(h, 400, "Bad Request",
 			                    err400str, sizeof(err400str) - 1);
 			SendResp_upnphttp(h);
-			CloseSocket_upnphttp(h);
+			Finish_upnphttp(h);
 		}
 	}
 	else
@@ -808,7 +873,7 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 		}
 	}
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 static void
@@ -827,7 +892,7 @@ ProcessHTTPUnSubscribe_upnphttp(struct upnphttp * h, const char * path)
 			BuildResp_upnphttp(h, 0, 0);
 	}
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 /* Parse and process Http Query 
@@ -879,6 +944,15 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 
 	ParseHttpHeaders(h);
 
+	/* HTTP/1.1 connections are persistent unless the client says otherwise,
+	 * HTTP/1.0 ones only when asked for */
+	if( runtime_vars.keepalive_timeout > 0 && !quitting &&
+	    h->req_count + 1 < runtime_vars.keepalive_requests &&
+	    !(h->reqflags & (FLAG_CLOSE|FLAG_CHUNKED)) )
+		h->keepalive = (strcmp(h->HttpVer, "HTTP/1.0") != 0) || (h->reqflags & FLAG_KEEPALIVE);
+	else
+		h->keepalive = 0;
+
 	/* see if we need to wait for remaining data */
 	if( (h->reqflags & FLAG_CHUNKED) )
 	{
@@ -1067,6 +1141,28 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 	}
 }
 
+/* Answers every complete request waiting in the buffer, which holds more
+ * than one when the client pipelines its requests. */
+static void
+process_requests(struct upnphttp * h)
+{
+	const char * endheaders;
+	int count;
+
+	while(h->state == 0 && h->req_buflen > 0)
+	{
+		/* search for the string "\r\n\r\n" */
+		endheaders = strstr(h->req_buf, "\r\n\r\n");
+		if(!endheaders)
+			break;
+		h->req_contentoff = endheaders - h->req_buf + 4;
+		h->req_contentlen = h->req_buflen - h->req_contentoff;
+		count = h->req_count;
+		ProcessHttpQuery_upnphttp(h);
+		if(h->state == 0 && h->req_count == count)
+			break;
+	}
+}
 
 void
 Process_upnphttp(struct upnphttp * h)
@@ -1086,13 +1182,14 @@ Process_upnphttp(struct upnphttp * h)
 		}
 		else if(n==0)
 		{
-			DPRINTF(E_WARN, L_HTTP, "HTTP Connection closed unexpectedly\n");
+			/* closing between two requests is fine */
+			if(h->req_buflen || !h->req_count)
+				DPRINTF(E_WARN, L_HTTP, "HTTP Connection closed unexpectedly\n");
 			h->state = 100;
 		}
 		else
 		{
 			int new_req_buflen;
-			const char * endheaders;
 			/* if 1st arg of realloc() is null,
 			 * realloc behaves the same as malloc() */
 			new_req_buflen = n + h->req_buflen + 1;
@@ -1112,14 +1209,6 @@ Process_upnphttp(struct upnphttp * h)
 			memcpy(h->req_buf + h->req_buflen, buf, n);
 			h->req_buflen += n;
 			h->req_buf[h->req_buflen] = '\0';
-			/* search for the string "\r\n\r\n" */
-			endheaders = strstr(h->req_buf, "\r\n\r\n");
-			if(endheaders)
-			{
-				h->req_contentoff = endheaders - h->req_buf + 4;
-				h->req_contentlen = h->req_buflen - h->req_contentoff;
-				ProcessHttpQuery_upnphttp(h);
-			}
 		}
 		break;
 	case 1:
@@ -1166,6 +1255,9 @@ Process_upnphttp(struct upnphttp * h)
 	default:
 		DPRINTF(E_WARN, L_HTTP, "Unexpected state: %d\n", h->state);
 	}
+	if(h->state < 100 && runtime_vars.keepalive_timeout > 0)
+		h->expires = time(NULL) + runtime_vars.keepalive_timeout;
+	process_requests(h);
 }
 
 /* with response code and response message
@@ -1179,16 +1271,24 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	static const char httpresphead[] =
 		"%s %d %s\r\n"
 		"Content-Type: %s\r\n"
-		"Connection: close\r\n"
-		"Content-Length: %d\r\n"
+		"Connection: %s\r\n"
 		"Server: " MINIDLNA_SERVER_STRING "\r\n";
 	time_t curtime = time(NULL);
 	char date[30];
 	int templen;
 	struct string_s res;
+	/* A body of unknown length is sent in chunks, or up to the
+	 * connection close for HTTP/1.0 clients. */
+	if(bodylen < 0)
+	{
+		if(strcmp(h->HttpVer, "HTTP/1.1") == 0)
+			h->respflags |= FLAG_CHUNKED;
+		else
+			h->keepalive = 0;
+	}
 	if(!h->res_buf)
 	{
-		templen = sizeof(httpresphead) + 256 + bodylen;
+		templen = sizeof(httpresphead) + 256 + MAX(bodylen, 0);
 		h->res_buf = (char *)malloc(templen);
 		h->res_buf_alloclen = templen;
 	}
@@ -1198,7 +1298,11 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	strcatf(&res, httpresphead, "HTTP/1.1",
 	              respcode, respmsg,
 	              (h->respflags&FLAG_HTML)?"text/html":"text/xml; charset=\"utf-8\"",
-							 bodylen);
+	              h->keepalive ? "keep-alive" : "close");
+	if(bodylen >= 0)
+		strcatf(&res, "Content-Length: %d\r\n", bodylen);
+	else if(h->respflags & FLAG_CHUNKED)
+		strcatf(&res, "Transfer-Encoding: chunked\r\n");
 	/* Additional headers */
 	if(h->respflags & FLAG_TIMEOUT) {
 		strcatf(&res, "Timeout: Second-");
@@ -1219,7 +1323,7 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	strcatf(&res, "EXT:\r\n");
 	strcatf(&res, "\r\n");
 	h->res_buflen = res.off;
-	if(h->res_buf_alloclen < (h->res_buflen + bodylen))
+	if(bodylen > 0 && h->res_buf_alloclen < (h->res_buflen + bodylen))
 	{
 		h->res_buf = (char *)realloc(h->res_buf, (h->res_buflen + bodylen));
 		h->res_buf_alloclen = h->res_buflen + bodylen;
@@ -1255,15 +1359,40 @@ SendResp_upnphttp(struct upnphttp * h)
 	if(n<0)
 	{
 		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
+		h->keepalive = 0;
 	}
 	else if(n < h->res_buflen)
 	{
 		/* TODO : handle correctly this case */
 		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %d)\n",
 						n, h->res_buflen);
+		h->keepalive = 0;
 	}
 }
 
+static int
+send_data(struct upnphttp * h, char * header, size_t size, int flags);
+
+/* Send part of a body announced with BuildHeader_upnphttp(h, ..., -1).
+ * An empty part ends the body. */
+int
+SendChunk_upnphttp(struct upnphttp * h, const char * data, int len)
+{
+	char buf[16];
+	int n;
+
+	if(!(h->respflags & FLAG_CHUNKED))
+		return len ? send_data(h, (char *)data, len, 0) : 0;
+
+	if(!len)
+		return send_data(h, "0\r\n\r\n", 5, 0);
+	n = snprintf(buf, sizeof(buf), "%x\r\n", len);
+	if(send_data(h, buf, n, MSG_MORE) != 0 ||
+	   send_data(h, (char *)data, len, MSG_MORE) != 0)
+		return 1;
+	return send_data(h, "\r\n", 2, MSG_MORE);
+}
+
 static int
 send_data(struct upnphttp * h, char * header, size_t size, int flags)
 {
@@ -1274,20 +1403,21 @@ send_data(struct upnphttp * h, char * header, size_t size, int flags)
 	{
 		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
 	} 
-	else if(n < h->res_buflen)
+	else if(n < size)
 	{
 		/* TODO : handle correctly this case */
 		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %d)\n",
-						n, h->res_buflen);
+						n, (int)size);
 	}
 	else
 	{
 		return 0;
 	}
+	h->keepalive = 0;
 	return 1;
 }
 
-static void
+static int
 send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
 {
 	off_t send_size;
@@ -1344,10 +1474,14 @@ send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
 		offset += ret;
 	}
 	free(buf);
+	if( offset <= end_offset )
+		h->keepalive = 0;
+
+	return (offset > end_offset) ? 0 : -1;
 }
 
 static void
-start_dlna_header(struct string_s *str, int respcode, const char *tmode, const char *mime)
+start_dlna_header(struct upnphttp *h, struct string_s *str, int respcode, const char *tmode, const char *mime)
 {
 	char date[30];
 	time_t now;
@@ -1355,39 +1489,62 @@ start_dlna_header(struct string_s *str, int respcode, const char *tmode, const c
 	now = time(NULL);
 	strftime(date, sizeof(date),"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&now));
 	strcatf(str, "HTTP/1.1 %d OK\r\n"
-	             "Connection: close\r\n"
+	             "Connection: %s\r\n"
 	             "Date: %s\r\n"
 	             "Server: " MINIDLNA_SERVER_STRING "\r\n"
 	             "EXT:\r\n"
 	             "realTimeInfo.dlna.org: DLNA.ORG_TLAG=*\r\n"
 	             "transferMode.dlna.org: %s\r\n"
 	             "Content-Type: %s\r\n",
-	             respcode, date, tmode, mime);
+	             respcode, h->keepalive ? "keep-alive" : "close", date, tmode, mime);
 }
 
-/* Mostly copied from Hiero's patch */
-static void
-send_file_transcode(char* transcoder, struct upnphttp * h, int offset, int end_offset, char *filename)
+/* Mostly copied from Hiero's patch
+ * The output is also split into segment files by the transcoder itself
+ * when segments is given.  Returns 0 when the transcoder ran to completion,
+ * 1 if the stream was complete but followed another connection's run, so
+ * no segment files were written, and -1 if the stream was cut short. */
+static int
+send_file_transcode(struct dlna_file_s *file, struct upnphttp * h, int offset, int end_offset,
+                    char *segments, char *splits)
 {
 	off_t send_size=0, total_byte_read=0, total_byte_send=0;
 	ssize_t read_stream_size=0;
 	char *buf;
 	int pid, pid_status, i, timeout;
+	int eof = 0, gone = 0, slot, status;
 	pid_t ret;
 	struct pollfd fds[1];
+	struct transcode_session_s *sess;
+
+	/* Another connection may already be transcoding the same thing */
+	sess = transcode_session_attach(file->id, file->client, offset, end_offset, &slot);
+	if (sess && slot >= 0)
+	{
+		status = transcode_session_follow(sess, slot, h->socket);
+		/* the cache is written by the connection running the transcoder */
+		return (status == 0 && segments) ? 1 : status;
+	}
 
 	DPRINTF(E_INFO, L_HTTP, "Starting transcoder\n");
 
-	pid = exec_transcode(transcoder, filename, offset, end_offset, &fds[0].fd);
+	pid = exec_transcode(file->transcoder, file->path, offset, end_offset, segments, splits, &fds[0].fd);
 	if (pid<0)
 	{
 		DPRINTF(E_ERROR, L_HTTP, "Cannot execute transcoder\n");
-		return;
+		if (sess)
+			transcode_session_finish(sess, -1);
+		return -1;
 	}
 
 	if ((buf = (char *)malloc(MAX_BUFFER_SIZE_TRANSCODE)) == NULL) {
 		DPRINTF(E_ERROR, L_HTTP, "Cannot allocate memory\n");
-		return;
+		close(fds[0].fd);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		if (sess)
+			transcode_session_finish(sess, -1);
+		return -1;
 	}
 
 	total_byte_read=0; total_byte_send=0;
@@ -1409,6 +1566,7 @@ send_file_transcode(char* transcoder, struct upnphttp * h, int offset, int end_o
 		read_stream_size = read(fds[0].fd, buf, MAX_BUFFER_SIZE_TRANSCODE); // read from PIPE
 		if (read_stream_size == 0) {
 			DPRINTF(E_INFO, L_HTTP, "Reached to EOF in PID:%d\n", (int)getpid());
+			eof = 1;
 			break; //EOF
 		}
 		if (read_stream_size < 0) {
@@ -1416,6 +1574,14 @@ send_file_transcode(char* transcoder, struct upnphttp * h, int offset, int end_o
 			break; //ERROR
 		}
 		total_byte_read += read_stream_size;
+		if (sess)
+			transcode_session_write(sess, buf, read_stream_size);
+		if (gone)
+		{
+			if (transcode_session_readers(sess))
+				continue;
+			break;
+		}
 		//DPRINTF(E_INFO, L_HTTP, "received %d bytes from FFMPEG in PID:%d\n", (int)read_stream_size, (int)getpid());
 		send_size = write(h->socket, buf, read_stream_size);
 		if ( send_size != -1 ) total_byte_send += send_size;
@@ -1430,7 +1596,13 @@ send_file_transcode(char* transcoder, struct upnphttp * h, int offset, int end_o
 		{
 			DPRINTF(E_DEBUG, L_HTTP, "Sendfile error :: error no. %d [%s]\n", errno, strerror(errno));
 			if( errno != EAGAIN )
+			{
+				gone = 1;
+				/* keep transcoding for the connections sharing it */
+				if (sess && transcode_session_readers(sess))
+					continue;
 				break;
+			}
 		}
 		/*else
 		{
@@ -1438,8 +1610,10 @@ send_file_transcode(char* transcoder, struct upnphttp * h, int offset, int end_o
 		}*/
 	}
 
-    close(fds[0].fd);
+	close(fds[0].fd);
 	free(buf);
+	if (sess)
+		transcode_session_finish(sess, (eof && total_byte_read > 0) ? 0 : -1);
 
 	kill(pid, SIGTERM);
 	for (i=0 ; i<10 ; i++) {
@@ -1456,6 +1630,119 @@ send_file_transcode(char* transcoder, struct upnphttp * h, int offset, int end_o
 		kill(pid, SIGKILL);
 	}
 	DPRINTF(E_INFO, L_HTTP, "Total bytes : read=%lld, send=%lld\n", total_byte_read, total_byte_send);
+
+	if (!eof || gone || total_byte_read == 0)
+		return -1;
+	return 0;
+}
+
+/* Transcodes from start to end in one run, with the transcoder splitting
+ * its output at the segment boundaries into the cache as it goes */
+static int
+send_transcode_run(struct dlna_file_s *file, struct upnphttp *h, const char *cache_dir, int start, int end)
+{
+	char pattern[PATH_MAX];
+	char *splits;
+	int first, last, ret;
+
+	first = start / TRANSCODE_SEGMENT_MS;
+	splits = transcode_cache_splits(start, end);
+	if( !splits )
+		return send_file_transcode(file, h, start, end, NULL, NULL);
+	transcode_cache_pieces(cache_dir, pattern, sizeof(pattern));
+	DPRINTF(E_DEBUG, L_HTTP, "Transcoding segments %d to %d of %s in one run\n",
+	        first, end / TRANSCODE_SEGMENT_MS, file->path);
+	ret = send_file_transcode(file, h, start, end, pattern, splits);
+	free(splits);
+	/* the segments the run only partly covered are not cached */
+	if( end + 1 >= file->duration )
+		last = TRANSCODE_SEGMENTS(file->duration) - 1;
+	else
+		last = (end + 1) / TRANSCODE_SEGMENT_MS - 1;
+	transcode_cache_commit_pieces(cache_dir, first,
+	                              start % TRANSCODE_SEGMENT_MS ? first + 1 : first, last, ret == 0);
+
+	return ret;
+}
+
+/* Time based transcoded stream.  With a cache directory, which only
+ * transcoders splitting their own output get, whole segments are served
+ * from disk when present, and everything between them is transcoded in a
+ * single run that fills the cache as it goes. */
+static void
+send_transcode_segments(struct dlna_file_s *file, struct upnphttp *h, const char *cache_dir, int start, int end)
+{
+	int seg, seg_start, seg_end;
+	int run_end, next, next_end;
+	int fd, ret;
+	off_t size;
+
+	if( !cache_dir )
+	{
+		send_file_transcode(file, h, start, end, NULL, NULL);
+		return;
+	}
+
+	while( start <= end )
+	{
+		seg = start / TRANSCODE_SEGMENT_MS;
+		seg_start = seg * TRANSCODE_SEGMENT_MS;
+		seg_end = MIN(seg_start + TRANSCODE_SEGMENT_MS, file->duration) - 1;
+		fd = -1;
+		if( start == seg_start && end >= seg_end )
+			fd = transcode_cache_open(cache_dir, seg, &size);
+		if( fd >= 0 )
+		{
+			DPRINTF(E_DEBUG, L_HTTP, "Serving cached segment %d of %s\n", seg, file->path);
+			ret = send_file(h, fd, 0, size - 1);
+			close(fd);
+		}
+		else
+		{
+			/* one run up to the next whole segment that is cached */
+			for( run_end = seg_end; run_end < end && run_end + 1 < file->duration; run_end = next_end )
+			{
+				next = (run_end + 1) / TRANSCODE_SEGMENT_MS;
+				next_end = MIN((next + 1) * TRANSCODE_SEGMENT_MS, file->duration) - 1;
+				if( end >= next_end && (fd = transcode_cache_open(cache_dir, next, &size)) >= 0 )
+				{
+					close(fd);
+					break;
+				}
+			}
+			seg_end = MIN(run_end, end);
+			ret = send_transcode_run(file, h, cache_dir, start, seg_end);
+		}
+		if( ret < 0 )
+			break;
+		start = seg_end + 1;
+	}
+}
+
+/* Byte range of a transcoded stream whose segments are all cached */
+static void
+send_transcode_cached(struct upnphttp *h, const char *cache_dir, int segments, off_t offset, off_t end_offset)
+{
+	off_t base = 0, size, last;
+	int seg, fd, ret = 0;
+
+	for( seg = 0; seg < segments && offset <= end_offset && ret == 0; seg++ )
+	{
+		fd = transcode_cache_open(cache_dir, seg, &size);
+		if( fd < 0 )
+		{
+			DPRINTF(E_WARN, L_HTTP, "Cache segment %d vanished from %s\n", seg, cache_dir);
+			break;
+		}
+		if( offset < base + size )
+		{
+			last = MIN(end_offset, base + size - 1);
+			ret = send_file(h, fd, offset - base, last - base);
+			offset = last + 1;
+		}
+		close(fd);
+		base += size;
+	}
 }
 
 static void
@@ -1504,7 +1791,7 @@ SendResp_icon(struct upnphttp * h, char * icon)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", mime);
+	start_dlna_header(h, &str, 200, "Interactive", mime);
 	strcatf(&str, "Content-Length: %d\r\n\r\n", size);
 
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
@@ -1512,7 +1799,7 @@ SendResp_icon(struct upnphttp * h, char * icon)
 		if( h->req_command != EHead )
 			send_data(h, data, size, 0);
 	}
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 static void
@@ -1534,7 +1821,7 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 
 	id = strtoll(object, NULL, 10);
 
-	path = sql_get_text_field(db, "SELECT PATH from ALBUM_ART where ID = '%lld'", id);
+	path = sql_get_text_param(sql_reader(), "SELECT PATH from ALBUM_ART where ID = ?", "I", (int64_t)id);
 	if( !path )
 	{
 		DPRINTF(E_WARN, L_HTTP, "ALBUM_ART ID %s not found, responding ERROR 404\n", object);
@@ -1556,7 +1843,7 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	start_dlna_header(h, &str, 200, "Interactive", "image/jpeg");
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN\r\n\r\n",
 	              (intmax_t)size);
@@ -1567,7 +1854,7 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 			send_file(h, fd, 0, size-1);
 	}
 	close(fd);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 static void
@@ -1582,7 +1869,7 @@ SendResp_caption(struct upnphttp * h, char * object)
 
 	id = strtoll(object, NULL, 10);
 
-	path = sql_get_text_field(db, "SELECT PATH from CAPTIONS where ID = %lld", id);
+	path = sql_get_text_param(sql_reader(), "SELECT PATH from CAPTIONS where ID = ?", "I", (int64_t)id);
 	if( !path )
 	{
 		DPRINTF(E_WARN, L_HTTP, "CAPTION ID %s not found, responding ERROR 404\n", object);
@@ -1604,7 +1891,7 @@ SendResp_caption(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "smi/caption");
+	start_dlna_header(h, &str, 200, "Interactive", "smi/caption");
 	strcatf(&str, "Content-Length: %jd\r\n\r\n", (intmax_t)size);
 
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
@@ -1613,7 +1900,7 @@ SendResp_caption(struct upnphttp * h, char * object)
 			send_file(h, fd, 0, size-1);
 	}
 	close(fd);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 static void
@@ -1634,7 +1921,7 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 	}
 
 	id = strtoll(object, NULL, 10);
-	path = sql_get_text_field(db, "SELECT PATH from DETAILS where ID = '%lld'", id);
+	path = sql_get_text_param(sql_reader(), "SELECT PATH from DETAILS where ID = ?", "I", (int64_t)id);
 	if( !path )
 	{
 		DPRINTF(E_WARN, L_HTTP, "DETAIL ID %s not found, responding ERROR 404\n", object);
@@ -1667,7 +1954,7 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 
 	INIT_STR(str, header);
 
-	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	start_dlna_header(h, &str, 200, "Interactive", "image/jpeg");
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1\r\n\r\n",
 	              (intmax_t)ed->size);
@@ -1678,7 +1965,7 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 			send_data(h, (char *)ed->data, ed->size, 0);
 	}
 	exif_data_unref(ed);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
 static void
@@ -1706,9 +1993,11 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	int scale = 1;
 	const char *tmode;
 
+	/* served by a child process, which takes the connection with it */
+	h->keepalive = 0;
 	id = strtoll(object, &saveptr, 10);
 	snprintf(buf, sizeof(buf), "SELECT PATH, RESOLUTION, ROTATION from DETAILS where ID = '%lld'", (long long)id);
-	ret = sql_get_table(db, buf, &result, &rows, NULL);
+	ret = sql_get_table(sql_reader(), buf, &result, &rows, NULL);
 	if( ret != SQLITE_OK )
 	{
 		Send500(h);
@@ -1830,12 +2119,12 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	INIT_STR(str, header);
 
 #if USE_FORK
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
+	if( newpid == 0 && (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
 		tmode = "Background";
 	else
 #endif
 		tmode = "Interactive";
-	start_dlna_header(&str, 200, tmode, "image/jpeg");
+	start_dlna_header(h, &str, 200, tmode, "image/jpeg");
 	strcatf(&str, "contentFeatures.dlna.org: %sDLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\r\n",
 	              dlna_pn, dlna_flags, 0);
 
@@ -1903,46 +2192,168 @@ resized_error:
 #endif
 }
 
+/* Decide whether the file has to be transcoded for this client and work out
+ * what will be sent.  This may probe the media file or run the transcoder, so
+ * it is only called once the connection has been handed to its own process.
+ * Returns the descriptor of an already transcoded image, or -1.  On error an
+ * HTTP error response has been sent and -2 is returned. */
+static int
+prepare_dlnafile(struct upnphttp *h, struct dlna_file_s *file)
+{
+	struct dlna_meta_s dlna_metadata = { 0, 0 };
+	uint32_t cflags = h->req_client ? h->req_client->type->flags : 0;
+	enum client_types ctype = file->client;
+	int transcode_pid;
+	int transcode_handle = -1;
+	int known;
+
+	/* non-zero value means the file needs to be transcoded */
+	file->transcoder = transcode_get_transcoder(file->mime[0], ctype);
+	if( !file->transcoder )
+		file->transcode = 0;
+	else if( file->transcode < 0 )
+		file->transcode = transcode_decision(file->id, file->path, file->mime, file->client);
+
+	if( file->transcode )
+	{
+		/* The output format is normally declared by the transcoder's
+		 * profile or known from an earlier probe of this file. */
+		known = (transcode_get_output(file->id, file->client, file->transcoder, &dlna_metadata) == 0);
+
+		if ( file->mime[0] != 'i' )
+		{
+			if ( !known )
+			{
+				DPRINTF(E_DEBUG, L_HTTP, "Executing transcode to probe its output\n");
+				transcode_pid = exec_transcode(file->transcoder, file->path, 0, file->duration > 0 ? file->duration : 1000, NULL, NULL, &transcode_handle);
+				if( transcode_pid < 0 )
+				{
+					Send500(h);
+					return -2;
+				}
+			}
+		}
+		else
+		{
+			char tmp[L_tmpnam];
+			DPRINTF(E_DEBUG, L_HTTP, "Executing transcode\n");
+			tmpnam(tmp);
+			file->transcode = 0;
+			transcode_pid = exec_transcode_img(file->transcoder, file->path, tmp);
+			if( transcode_pid < 0 )
+			{
+				free_dlna_metadata(&dlna_metadata);
+				Send500(h);
+				return -2;
+			}
+			waitpid(transcode_pid, NULL, 0);
+			/* try to open the resulting file. If that's not possible the transcoding probably failed */
+			transcode_handle = open(tmp, O_RDONLY);
+			if( transcode_handle < 0 ) {
+				DPRINTF(E_ERROR, L_HTTP, "Cannot open transcoded file %s, possibly a problem with transcoder\n", file->path);
+				free_dlna_metadata(&dlna_metadata);
+				Send500(h);
+				return -2;
+			}
+			/* the open descriptor is all we need to serve it */
+			unlink(tmp);
+		}
+
+		if( !known )
+		{
+			DPRINTF(E_DEBUG, L_HTTP, "Obtaining metadata\n");
+			if( file->mime[0] == 'i' )
+				dlna_metadata = get_dlna_metadata_image(transcode_handle);
+			else if( file->mime[0] == 'a' )
+				dlna_metadata = get_dlna_metadata_audio(transcode_handle);
+			else
+				dlna_metadata = get_dlna_metadata_video(transcode_handle);
+
+			if( file->mime[0] != 'i' )
+			{
+				close(transcode_handle); /* causes ffmpeg transcoder to exit, TODO: check if this is true for other transcoders, too */
+				transcode_handle = -1;
+				kill(transcode_pid, SIGKILL);
+			}
+			if( dlna_metadata.mime == NULL && dlna_metadata.dlna_pn == NULL ) {
+				DPRINTF(E_ERROR, L_HTTP, "Cannot obtain metadata.\n");
+				if( transcode_handle >= 0 )
+					close(transcode_handle);
+				Send500(h);
+				return -2;
+			}
+			transcode_set_output(file->id, file->client, &dlna_metadata);
+		}
+
+		if( dlna_metadata.mime != NULL )
+			strncpyt(file->mime, dlna_metadata.mime, sizeof(file->mime));
+		if( dlna_metadata.dlna_pn != NULL )
+			strncpyt(file->dlna_pn, dlna_metadata.dlna_pn, sizeof(file->dlna_pn));
+		free_dlna_metadata(&dlna_metadata);
+	}
+
+	if( file->dlna_pn[0] )
+		snprintf(file->dlna, sizeof(file->dlna), "DLNA.ORG_PN=%s;", file->dlna_pn);
+	else
+		file->dlna[0] = '\0';
+
+	/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
+	if( cflags & FLAG_SAMSUNG )
+	{
+		if( strcmp(file->mime+6, "x-matroska") == 0 )
+			strcpy(file->mime+8, "mkv");
+		/* Samsung TV's such as the A750 can natively support many
+		   Xvid/DivX AVI's however, the DLNA server needs the 
+		   mime type to say video/mpeg */
+		else if( ctype == ESamsungSeriesA && strcmp(file->mime+6, "x-msvideo") == 0 )
+			strcpy(file->mime+6, "mpeg");
+		/* Samsung TV's are able to play quicktime, but they expect MIME type of mp4 */
+		else if( strcmp(file->mime+6, "quicktime") == 0 )
+			strcpy(file->mime+6, "mp4");
+	}
+	/* ... and Sony BDP-S370 won't play MKV unless we pretend it's a DiVX file */
+	else if( ctype == ESonyBDP )
+	{
+		if( strcmp(file->mime+6, "x-matroska") == 0 ||
+		    strcmp(file->mime+6, "mpeg") == 0 )
+			strcpy(file->mime+6, "divx");
+	}
+
+	return transcode_handle;
+}
+
 static void
 SendResp_dlnafile(struct upnphttp *h, char *object)
 {
 	char header[1024];
 	struct string_s str;
-	char buf[128];
+	char buf[256];
 	char **result;
 	int rows, ret;
 	off_t total, size;
 	int64_t id;
 	int sendfh;
-	int transcode_pid;
-	int transcode_handle;
-	char *mime;
-	char *dlnapn;
-	struct dlna_meta_s dlna_metadata= { 0, 0 };
+	struct dlna_file_s file;
+	char cache_dir[PATH_MAX];
+	int cached = 0, segments = 0;
+	int engine, background = 0;
 	uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
 	uint32_t cflags = h->req_client ? h->req_client->type->flags : 0;
 	const char *tmode;
 	enum client_types ctype = h->req_client ? h->req_client->type->type : 0;
-	static struct { int64_t id;
-	                enum client_types client;
-	                char path[PATH_MAX];
-	                char mime[32];
-	                char dlna[96];
-	                int duration;
-	                int transcode;
-	                char *transcoder;
-	              } last_file = { 0, 0 };
 #if USE_FORK
 	pid_t newpid = 0;
 #endif
 
+	/* streams end with the connection, whoever ends up sending them */
+	h->keepalive = 0;
 	id = strtoll(object, NULL, 10);
 	if( cflags & FLAG_MS_PFS )
 	{
 		if( strstr(object, "?albumArt=true") )
 		{
 			char *art;
-			art = sql_get_text_field(db, "SELECT ALBUM_ART from DETAILS where ID = '%lld'", id);
+			art = sql_get_text_field(sql_reader(), "SELECT ALBUM_ART from DETAILS where ID = '%lld'", id);
 			if (art)
 			{
 				SendResp_albumArt(h, art);
@@ -1953,25 +2364,23 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			return;
 		}
 	}
-	if( id != last_file.id || ctype != last_file.client )
+	if( file_cache_get(id, ctype, &file) != 0 )
 	{
-		/* we need to remove transcode temporary file when the file is changed
-		   if this file is not deleted up here, it's deleted during minidlna shutdown */
-		if ( transcode_tempfile )
-		{
-			unlink(transcode_tempfile);
-			transcode_tempfile = NULL;
-		}
-
-		snprintf(buf, sizeof(buf), "SELECT PATH, MIME, DLNA_PN, DURATION from DETAILS where ID = '%lld'", (long long)id);
-		ret = sql_get_table(db, buf, &result, &rows, NULL);
+		/* A decision recorded for the current version of the file is
+		 * picked up here; otherwise it is made after forking, so that
+		 * probing cannot stall the main loop. */
+		snprintf(buf, sizeof(buf), "SELECT d.PATH, d.MIME, d.DLNA_PN, d.DURATION, t.TRANSCODE"
+		                           " from DETAILS d left join TRANSCODE t on (t.ID = d.ID"
+		                           " and t.CLIENT = %d and t.TIMESTAMP = d.TIMESTAMP)"
+		                           " where d.ID = '%lld'", ctype, (long long)id);
+		ret = sql_get_table(sql_reader(), buf, &result, &rows, NULL);
 		if( (ret != SQLITE_OK) )
 		{
 			DPRINTF(E_ERROR, L_HTTP, "Didn't find valid file for %lld!\n", (long long)id);
 			Send500(h);
 			return;
 		}
-		if( !rows || !result[4] )
+		if( !rows || !result[5] || !result[6] )
 		{
 			DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", object);
 			sqlite3_free_table(result);
@@ -1979,163 +2388,54 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			return;
 		}
 
-		/* Cache the result */
-		last_file.id = id;
-		last_file.client = ctype;
-		strncpy(last_file.path, result[4], sizeof(last_file.path)-1);
-		mime = result[5];
-		dlnapn = result[6];
+		memset(&file, 0, sizeof(file));
+		file.id = id;
+		file.client = ctype;
+		strncpyt(file.path, result[5], sizeof(file.path));
+		strncpyt(file.mime, result[6], sizeof(file.mime));
 		if( result[7] )
+			strncpyt(file.dlna_pn, result[7], sizeof(file.dlna_pn));
+		if( result[8] )
 		{
 			int h, m, s, ss;
-			sscanf(result[7], "%d:%d:%d.%d", &h, &m, &s, &ss);
-			last_file.duration = (3600*h + 60*m + s)*1000 + ss;
-		}
-
-		/* non-zero value means the file needs to be transcoded */
-		if ( *mime == 'i' ) /* image */
-		{
-			last_file.transcode = needs_transcode_image(last_file.path, client_types[last_file.client].type);
-			if (client_types[last_file.client].transcode_info && client_types[last_file.client].transcode_info->image_transcoder)
-				last_file.transcoder = client_types[last_file.client].transcode_info->image_transcoder;
-			else
-				last_file.transcoder = client_types[0].transcode_info->image_transcoder;
-		}
-		else if ( *mime == 'a' ) /* audio */
-		{
-			last_file.transcode = needs_transcode_audio(last_file.path, client_types[last_file.client].type);
-			if (client_types[last_file.client].transcode_info && client_types[last_file.client].transcode_info->audio_transcoder)
-				last_file.transcoder = client_types[last_file.client].transcode_info->audio_transcoder;
-			else
-				last_file.transcoder = client_types[0].transcode_info->audio_transcoder;
-		}
-		else if ( *mime == 'v' ) /* video */
-		{
-			last_file.transcode = needs_transcode_video(last_file.path, client_types[last_file.client].type);
-			if (client_types[last_file.client].transcode_info && client_types[last_file.client].transcode_info->video_transcoder)
-				last_file.transcoder = client_types[last_file.client].transcode_info->video_transcoder;
-			else
-				last_file.transcoder = client_types[0].transcode_info->video_transcoder;
+			sscanf(result[8], "%d:%d:%d.%d", &h, &m, &s, &ss);
+			file.duration = (3600*h + 60*m + s)*1000 + ss;
 		}
+		if( !transcode_get_transcoder(file.mime[0], ctype) )
+			file.transcode = 0;
 		else
-		{
-			last_file.transcode = 0;
-			last_file.transcoder = NULL;
-		}
-
-		if (last_file.transcode && last_file.transcoder)
-		{
-			DPRINTF(E_DEBUG, L_HTTP, "Executing transcode\n");
-			if ( *mime != 'i' )
-			{
-				transcode_pid = exec_transcode(last_file.transcoder, last_file.path, 0, last_file.duration > 0 ? last_file.duration : 1000, &transcode_handle);
-				if( transcode_pid < 0 )
-				{
-					Send500(h);
-					return;
-				}
-			}
-			else
-			{
-				char tmp[L_tmpnam];
-				tmpnam(tmp);
-				last_file.transcode = 0;
-				transcode_pid = exec_transcode_img(last_file.transcoder, last_file.path, tmp);
-				if( transcode_pid < 0 )
-				{
-					Send500(h);
-					return;
-				}
-				waitpid(transcode_pid, NULL, 0);
-				/* try to open the resulting file. If that's not possible the transcoding probably failed */
-				transcode_handle = open(tmp, O_RDONLY);
-				if( transcode_handle < 0 ) {
-					DPRINTF(E_ERROR, L_HTTP, "Cannot open transcoded file %s, possibly a problem with transcoder\n", last_file.path);
-					Send500(h);
-					return;
-				}
-				strcpy(last_file.path, tmp);
-				transcode_tempfile = last_file.path;
-			}
-
-			DPRINTF(E_DEBUG, L_HTTP, "Obtaining metadata\n");
-			if( *mime == 'i' )
-				dlna_metadata = get_dlna_metadata_image(transcode_handle);
-			else if( *mime == 'a' )
-				dlna_metadata = get_dlna_metadata_audio(transcode_handle);
-			else if( *mime == 'v' )
-				dlna_metadata = get_dlna_metadata_video(transcode_handle);
-			else
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Mime type is not image/audio/video. This should never happen.\n");
-				Send500(h);
-				return;
-			}
-			
-			close(transcode_handle); /* causes ffmpeg transcoder to exit, TODO: check if this is true for other transcoders, too */
-			if( dlna_metadata.mime == NULL && dlna_metadata.dlna_pn == NULL ) {
-				DPRINTF(E_ERROR, L_HTTP, "Cannot obtain metadata.\n");
-				Send500(h);
-				return;
-			}
-			else
-			{
-				if( dlna_metadata.mime != NULL )
-					mime = dlna_metadata.mime;
-				if( dlna_metadata.dlna_pn != NULL )
-					dlnapn = dlna_metadata.dlna_pn;
-			}
-			kill(transcode_pid, SIGKILL);
-		}
-
-		if( mime )
-			strncpy(last_file.mime, mime, sizeof(last_file.mime)-1);
-		if( dlnapn )
-			snprintf(last_file.dlna, sizeof(last_file.dlna), "DLNA.ORG_PN=%s;", dlnapn);
-		else
-			last_file.dlna[0] = '\0';
-
-		if( mime )
-		{
-			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
-			if( cflags & FLAG_SAMSUNG )
-			{
-				if( strcmp(last_file.mime+6, "x-matroska") == 0 )
-					strcpy(last_file.mime+8, "mkv");
-				/* Samsung TV's such as the A750 can natively support many
-				   Xvid/DivX AVI's however, the DLNA server needs the 
-				   mime type to say video/mpeg */
-				else if( ctype == ESamsungSeriesA && strcmp(last_file.mime+6, "x-msvideo") == 0 )
-					strcpy(last_file.mime+6, "mpeg");
-				/* Samsung TV's are able to play quicktime, but they expect MIME type of mp4 */
-				else if( strcmp(last_file.mime+6, "quicktime") == 0 )
-					strcpy(last_file.mime+6, "mp4");
-			}
-			/* ... and Sony BDP-S370 won't play MKV unless we pretend it's a DiVX file */
-			else if( ctype == ESonyBDP )
-			{
-				if( strcmp(last_file.mime+6, "x-matroska") == 0 ||
-				    strcmp(last_file.mime+6, "mpeg") == 0 )
-					strcpy(last_file.mime+6, "divx");
-			}
-		}
-		
+			file.transcode = result[9] ? atoi(result[9]) : -1;
 		sqlite3_free_table(result);
-	}
+		/* An undecided entry is left out, so that the decision the
+		 * child records in TRANSCODE is read back next time. */
+		if( file.transcode >= 0 )
+			file_cache_put(&file);
+	}
+	/* Files sent as they are can go to the streaming threads; anything
+	 * that may need the transcoder still gets a process of its own. */
+	engine = stream_active() && file.transcode == 0;
 #if USE_FORK
-	newpid = process_fork(h->req_client);
+	if( engine )
+		newpid = -1;
+	else
+		newpid = process_fork(h->req_client);
 	if( newpid > 0 )
 	{
 		CloseSocket_upnphttp(h);
 		return;
 	}
+	/* probing and transcoding must not run in the main loop */
+	if( newpid < 0 && !engine )
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Unable to fork to serve %s\n", file.path);
+		Send503(h);
+		return;
+	}
 #endif
 
-	DPRINTF(E_INFO, L_HTTP, "Serving DetailID: %lld [%s]\n", (long long)id, last_file.path);
-
 	if( h->reqflags & FLAG_XFERSTREAMING )
 	{
-		if( strncmp(last_file.mime, "image", 5) == 0 )
+		if( strncmp(file.mime, "image", 5) == 0 )
 		{
 			DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Streaming with an image!\n");
 			Send406(h);
@@ -2150,7 +2450,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			Send400(h);
 			goto error;
 		}
-		if( strncmp(last_file.mime, "image", 5) != 0 )
+		if( strncmp(file.mime, "image", 5) != 0 )
 		{
 			DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Interactive without an image!\n");
 			/* Samsung TVs (well, at least the A950) do this for some reason,
@@ -2163,23 +2463,54 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		}
 	}
 
-	sendfh = open(last_file.path, O_RDONLY);
+	sendfh = prepare_dlnafile(h, &file);
+	if( sendfh == -2 )
+		goto error;
+
+	DPRINTF(E_INFO, L_HTTP, "Serving DetailID: %lld [%s]\n", (long long)id, file.path);
+
+	if( sendfh < 0 )
+		sendfh = open(file.path, O_RDONLY);
 	if( sendfh < 0 ) {
-		DPRINTF(E_ERROR, L_HTTP, "Error opening %s\n", last_file.path);
+		DPRINTF(E_ERROR, L_HTTP, "Error opening %s\n", file.path);
 		Send404(h);
 		goto error;
 	}
 	size = lseek(sendfh, 0, SEEK_END);
 	lseek(sendfh, 0, SEEK_SET);
 
+	/* Once every segment of a transcode is cached its size is known and
+	 * it can be served by byte range like a native file.  That needs the
+	 * segments to come from one run, so only transcoders that split their
+	 * output themselves are cached. */
+	if( file.transcode && file.duration > 0 && transcode_segments(file.transcoder) &&
+	    transcode_cache_dir(file.path, file.transcoder, cache_dir, sizeof(cache_dir)) == 0 )
+	{
+		segments = TRANSCODE_SEGMENTS(file.duration);
+		size = transcode_cache_complete(cache_dir, segments);
+		cached = (size >= 0);
+		if( !cached )
+			size = 0;
+	}
+	else
+		cache_dir[0] = '\0';
+
 	INIT_STR(str, header);
 
+	/* Only the process or thread sending this stream may be reniced,
+	 * never the main loop */
+	if( h->reqflags & FLAG_XFERBACKGROUND )
+	{
+		if( engine )
+			background = stream_background();
 #if USE_FORK
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
-		tmode = "Background";
-	else
+		else if( newpid == 0 )
+			background = (setpriority(PRIO_PROCESS, 0, 19) == 0);
 #endif
-	if( strncmp(last_file.mime, "image", 5) == 0 ) {
+	}
+	if( background )
+		tmode = "Background";
+	else if( strncmp(file.mime, "image", 5) == 0 ) {
 		tmode = "Interactive";
 		dlna_flags |= DLNA_FLAG_TM_I;
 	}
@@ -2188,20 +2519,20 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		dlna_flags |= DLNA_FLAG_TM_S;
 	}
 
-	start_dlna_header(&str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
+	start_dlna_header(h, &str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, file.mime);
 
 	/* FLAG_TIMESEEK support partially based on Hiero's patch */
-	/* the transcoded files does not support ranges */
-	if ( (h->reqflags & FLAG_TIMESEEK) || ((h->reqflags & FLAG_RANGE) && !last_file.transcode) )
+	/* the transcoded files does not support ranges until fully cached */
+	if ( (h->reqflags & FLAG_TIMESEEK) || ((h->reqflags & FLAG_RANGE) && (!file.transcode || cached)) )
 	{
 		if ( (h->reqflags & FLAG_TIMESEEK) )
 		{
-			if( !h->req_RangeEnd || h->req_RangeEnd == last_file.duration )
+			if( !h->req_RangeEnd || h->req_RangeEnd == file.duration )
 			{
-				h->req_RangeEnd = last_file.duration-1;
+				h->req_RangeEnd = file.duration-1;
 			}
 
-			if( h->req_RangeEnd >= last_file.duration )
+			if( h->req_RangeEnd >= file.duration )
 			{
 				DPRINTF(E_WARN, L_HTTP, "Specified range was outside file boundaries!\n");
 				Send416(h);
@@ -2210,13 +2541,13 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			}
 
 			strcatf(&str, "X-AvailableSeekRange : 1 npt=0.0-%jd.%jd\r\n",
-			              (last_file.duration-1)/1000,  (last_file.duration-1)%1000);
+			              (file.duration-1)/1000,  (file.duration-1)%1000);
 			strcatf(&str, "TimeSeekRange.dlna.org : npt=%jd.%jd-%jd.%jd/%d.%d\r\n",
 			              h->req_RangeStart/1000,   h->req_RangeStart%1000,
 			              h->req_RangeEnd/1000,     h->req_RangeEnd%1000,
-			              last_file.duration/1000,  last_file.duration%1000);
+			              file.duration/1000,  file.duration%1000);
 		}
-		if( (h->reqflags & FLAG_RANGE) && !last_file.transcode )
+		if( (h->reqflags & FLAG_RANGE) && (!file.transcode || cached) )
 		{
 			if( !h->req_RangeEnd || h->req_RangeEnd == size )
 			{
@@ -2246,10 +2577,10 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			goto error;
 		}
 	}
-	else if ( last_file.transcode )
+	else if ( file.transcode && !cached )
 	{
 		h->req_RangeStart = 0;
-		h->req_RangeEnd = last_file.duration-1;
+		h->req_RangeEnd = file.duration-1;
 	}
 	else
 	{
@@ -2262,26 +2593,65 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 
 	if( h->reqflags & FLAG_CAPTION )
 	{
-		if( sql_get_int_field(db, "SELECT ID from CAPTIONS where ID = '%lld'", (long long)id) > 0 )
+		if( sql_get_int_param(sql_reader(), "SELECT ID from CAPTIONS where ID = ?", "I", (int64_t)id) > 0 )
 			strcatf(&str, "CaptionInfo.sec: http://%s:%d/Captions/%lld.srt\r\n",
 			              lan_addr[h->iface].str, runtime_vars.port, (long long)id);
 	}
 
 	strcatf(&str, "Accept-Ranges: %s\r\n"
 	              "contentFeatures.dlna.org: %sDLNA.ORG_OP=%02X;DLNA.ORG_CI=%X;DLNA.ORG_FLAGS=%08X%024X\r\n\r\n",
-	              last_file.transcode ? "none" : "bytes",
-	              last_file.dlna,
-	              last_file.transcode ? 0x10 : 0x01, /* 01 = only byte seek, 10 = time based, 11 = both, 00 = none */
-	              last_file.transcode ? 0x1 : 0x0, /* 1 = transcoded, 0 = native */
+	              (file.transcode && !cached) ? "none" : "bytes",
+	              file.dlna,
+	              file.transcode ? (cached ? 0x11 : 0x10) : 0x01, /* 01 = only byte seek, 10 = time based, 11 = both, 00 = none */
+	              file.transcode ? 0x1 : 0x0, /* 1 = transcoded, 0 = native */
 	              dlna_flags, 0);
 
 	/*DPRINTF(E_DEBUG, L_HTTP, "RESPONSE:\n%s\n", str.data);*/
+	if( engine && !file.transcode )
+	{
+		if( stream_start(h->socket, str.data, str.off, sendfh, h->req_RangeStart,
+		                 h->req_command == EHead ? -1 : h->req_RangeEnd, background) == 0 )
+		{
+			/* the socket and the file now belong to the streaming threads */
+			event_del(&h->ev);
+			h->socket = -1;
+			h->state = 100;
+			return;
+		}
+		/* never send a whole file from the main loop */
+#if USE_FORK
+		newpid = process_fork(h->req_client);
+		if( newpid > 0 )
+		{
+			close(sendfh);
+			CloseSocket_upnphttp(h);
+			return;
+		}
+		if( newpid == 0 )
+		{
+			if( background )
+				setpriority(PRIO_PROCESS, 0, 19);
+		}
+		else
+#endif
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Unable to stream %s\n", file.path);
+			close(sendfh);
+			Send503(h);
+			return;
+		}
+	}
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
 	{
  		if( h->req_command != EHead ) {
-			if (last_file.transcode)
+			if (file.transcode && cached && !(h->reqflags & FLAG_TIMESEEK))
+			{
+				send_transcode_cached(h, cache_dir, segments, h->req_RangeStart, h->req_RangeEnd);
+			}
+			else if (file.transcode)
 			{
-				send_file_transcode(last_file.transcoder, h, h->req_RangeStart, h->req_RangeEnd, last_file.path);
+				send_transcode_segments(&file, h, cache_dir[0] ? cache_dir : NULL,
+				                        h->req_RangeStart, h->req_RangeEnd);
 			}
 			else
 			{
@@ -2290,7 +2660,6 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		}
 	}
 	close(sendfh);
-	free_dlna_metadata(&dlna_metadata);
 
 	CloseSocket_upnphttp(h);
 error:
@@ -53,6 +53,7 @@
 #include <sys/queue.h>
 
 #include "minidlnatypes.h"
+#include "event.h"
 #include "config.h"
 
 /* server: HTTP header returned in all HTTP responses : */
@@ -62,6 +63,7 @@
  states :
   0 - waiting for data to read
   1 - waiting for HTTP Post Content.
+  2 - waiting for chunked content.
   ...
   >= 100 - to be deleted
 */
@@ -76,9 +78,13 @@ enum httpCommands {
 
 struct upnphttp {
 	int socket;
+	struct event ev;		/* registration with the main loop */
 	struct in_addr clientaddr;	/* client address */
 	int iface;
 	int state;
+	int keepalive;		/* connection stays open after this response */
+	int req_count;		/* requests answered on this connection */
+	time_t expires;		/* idle connections are closed after this */
 	char HttpVer[16];
 	/* request */
 	char * req_buf;
@@ -127,6 +133,8 @@ struct upnphttp {
 #define FLAG_XFERINTERACTIVE    0x00002000
 #define FLAG_XFERBACKGROUND     0x00004000
 #define FLAG_CAPTION            0x00008000
+#define FLAG_KEEPALIVE          0x00010000
+#define FLAG_CLOSE              0x00020000
 
 #ifndef MSG_MORE
 #define MSG_MORE 0
@@ -140,6 +148,12 @@ New_upnphttp(int);
 void
 CloseSocket_upnphttp(struct upnphttp *);
 
+/* Finish_upnphttp()
+ * called once a response is complete: keeps the connection
+ * open for the next request when possible, closes it otherwise */
+void
+Finish_upnphttp(struct upnphttp *);
+
 /* Delete_upnphttp() */
 void
 Delete_upnphttp(struct upnphttp *);
@@ -150,7 +164,8 @@ Process_upnphttp(struct upnphttp *);
 
 /* BuildHeader_upnphttp()
  * build the header for the HTTP Response
- * also allocate the buffer for body data */
+ * also allocate the buffer for body data
+ * a negative bodylen announces a body sent with SendChunk_upnphttp() */
 void
 BuildHeader_upnphttp(struct upnphttp * h, int respcode,
                      const char * respmsg,
@@ -179,5 +194,10 @@ Send501(struct upnphttp *);
 void
 SendResp_upnphttp(struct upnphttp *);
 
+/* SendChunk_upnphttp()
+ * send part of a body of unknown length, an empty one ends it */
+int
+SendChunk_upnphttp(struct upnphttp *, const char *, int);
+
 #endif
 
@@ -60,9 +60,11 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "upnpglobalvars.h"
 #include "utils.h"
+#include "soapcache.h"
 #include "upnphttp.h"
 #include "upnpsoap.h"
 #include "containers.h"
@@ -124,23 +126,23 @@ SoapError(struct upnphttp * h, int errCode, const char * errDesc)
 	bodylen = snprintf(body, sizeof(body), resp, errCode, errDesc);
 	BuildResp2_upnphttp(h, 500, "Internal Server Error", body, bodylen);
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
 }
 
+static const char beforebody[] =
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	"<s:Body>";
+
+static const char afterbody[] =
+	"</s:Body>"
+	"</s:Envelope>\r\n";
+
 static void
 BuildSendAndCloseSoapResp(struct upnphttp * h,
                           const char * body, int bodylen)
 {
-	static const char beforebody[] =
-		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
-		"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-		"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-		"<s:Body>";
-
-	static const char afterbody[] =
-		"</s:Body>"
-		"</s:Envelope>\r\n";
-
 	if (!body || bodylen < 0)
 	{
 		Send500(h);
@@ -160,7 +162,67 @@ BuildSendAndCloseSoapResp(struct upnphttp * h,
 	h->res_buflen += sizeof(afterbody) - 1;
 
 	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+	Finish_upnphttp(h);
+}
+
+/* Browse and Search results are sent as they are built, a buffer at a
+ * time, so a big result neither has to fit in memory nor waits for the
+ * last row.  A result that fits in one buffer still goes out whole, with
+ * its length. */
+static int
+StreamSoapResp(struct Response *args)
+{
+	struct upnphttp *h = args->h;
+	struct string_s *str = args->str;
+
+	if (!args->streaming)
+	{
+		BuildHeader_upnphttp(h, 200, "OK", -1);
+		SendResp_upnphttp(h);
+		args->streaming = 1;
+		if (SendChunk_upnphttp(h, beforebody, sizeof(beforebody) - 1) != 0)
+			return -1;
+	}
+	if (SendChunk_upnphttp(h, str->data, str->off) != 0)
+		return -1;
+	str->off = 0;
+
+	return 0;
+}
+
+static void
+SendSoapResp(struct Response *args)
+{
+	struct upnphttp *h = args->h;
+	struct string_s *str = args->str;
+
+	if (!args->streaming)
+	{
+		BuildSendAndCloseSoapResp(h, str->data, str->off);
+		return;
+	}
+	strcatf(str, "%s", afterbody);
+	if (StreamSoapResp(args) == 0)
+		SendChunk_upnphttp(h, NULL, 0);
+	Finish_upnphttp(h);
+}
+
+/* Everything a Browse or Search response depends on besides the database,
+ * which the response cache checks through updateID. */
+static char *
+soap_cache_key(const char *action, const char *id, const char *what,
+               const char *sort, int start, int count, const struct Response *args)
+{
+	char *key;
+
+	if (!runtime_vars.soap_cache_size)
+		return NULL;
+	if (xasprintf(&key, "%s\n%s\n%s\n%s\n%d\n%d\n%d\n%u\n%u\n%d", action, id,
+	              what ? what : "", sort ? sort : "", start, count,
+	              args->client, args->flags, args->filter, args->iface) < 0)
+		return NULL;
+
+	return key;
 }
 
 static void
@@ -737,17 +799,47 @@ add_res(char *size, char *duration, char *bitrate, char *sampleFrequency,
 	                          runtime_vars.port, detailID, ext);
 }
 
+#define MAGIC_COUNT_CACHE 16
+#define MAGIC_COUNT_TTL 60	/* seconds, the recent items queries depend on the time */
+
+/* Counts of the magic containers that are defined by a query, reused while
+ * the content database has not changed */
+static struct {
+	uint32_t update_id;
+	time_t expires;
+	int count;
+} magic_counts[MAGIC_COUNT_CACHE];
+
+/* How long the response being rendered may be cached, 0 until updateID
+ * changes; responses with time based counts in them expire */
+static int response_ttl;
+
 static int
 get_child_count(const char *object, struct magic_container_s *magic)
 {
-	int ret;
+	int ret, i;
+	time_t now;
 
 	if (magic && magic->child_count)
-		ret = sql_get_int_field(db, "SELECT count(*) from %s", magic->child_count);
+	{
+		response_ttl = MAGIC_COUNT_TTL;
+		i = magic - magic_containers;
+		now = time(NULL);
+		if (i >= 0 && i < MAGIC_COUNT_CACHE && magic_counts[i].expires > now &&
+		    magic_counts[i].update_id == updateID)
+			return magic_counts[i].count;
+		ret = sql_get_int_field(sql_reader(), "SELECT count(*) from %s", magic->child_count);
+		if (ret >= 0 && i >= 0 && i < MAGIC_COUNT_CACHE)
+		{
+			magic_counts[i].update_id = updateID;
+			magic_counts[i].expires = now + MAGIC_COUNT_TTL;
+			magic_counts[i].count = ret;
+		}
+	}
 	else if (magic && magic->objectid && *(magic->objectid))
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", *(magic->objectid));
+		ret = sql_get_int_param(sql_reader(), "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?", "s", *(magic->objectid));
 	else
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", object);
+		ret = sql_get_int_param(sql_reader(), "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?", "s", object);
 
 	return (ret > 0) ? ret : 0;
 }
@@ -756,7 +848,7 @@ static int
 object_exists(const char *object)
 {
 	int ret;
-	ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%q'",
+	ret = sql_get_int_param(sql_reader(), "SELECT count(*) from OBJECTS where OBJECT_ID = ?", "s",
 				strcmp(object, "*") == 0 ? "0" : object);
 	return (ret > 0);
 }
@@ -764,7 +856,10 @@ object_exists(const char *object)
 #define COLUMNS "o.DETAIL_ID, o.CLASS," \
                 " d.SIZE, d.TITLE, d.DURATION, d.BITRATE, d.SAMPLERATE, d.ARTIST," \
                 " d.ALBUM, d.GENRE, d.COMMENT, d.CHANNELS, d.TRACK, d.DATE, d.RESOLUTION," \
-                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC "
+                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC," \
+                " o.CHILD_COUNT," \
+                " (SELECT 1 from CAPTIONS where ID = o.DETAIL_ID)," \
+                " (SELECT SEC from BOOKMARKS where ID = o.DETAIL_ID) "
 #define SELECT_COLUMNS "SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, " COLUMNS
 
 #define NON_ZERO(x) (x && atoi(x))
@@ -777,7 +872,9 @@ callback(void *args, int argc, char **argv, char **azColName)
 	char *id = argv[0], *parent = argv[1], *refID = argv[2], *detailID = argv[3], *class = argv[4], *size = argv[5], *title = argv[6],
 	     *duration = argv[7], *bitrate = argv[8], *sampleFrequency = argv[9], *artist = argv[10], *album = argv[11],
 	     *genre = argv[12], *comment = argv[13], *nrAudioChannels = argv[14], *track = argv[15], *date = argv[16], *resolution = argv[17],
-	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *mime = argv[21], *album_art = argv[22], *rotate = argv[23];
+	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *mime = argv[21], *album_art = argv[22], *rotate = argv[23],
+	     *child_count = argv[25], *has_captions = argv[26], *bookmark = argv[27];
+	struct magic_container_s *magic;
 	char dlna_buf[128];
 	const char *ext;
 	struct string_s *str = passed_args->str;
@@ -786,32 +883,17 @@ callback(void *args, int argc, char **argv, char **azColName)
 	/* Make sure we have at least 8KB left of allocated memory to finish the response. */
 	if( str->off > (str->size - 8192) )
 	{
-#if MAX_RESPONSE_SIZE > 0
-		if( (str->size+DEFAULT_RESP_SIZE) <= MAX_RESPONSE_SIZE )
+		if( StreamSoapResp(passed_args) != 0 )
 		{
-#endif
-			str->data = realloc(str->data, (str->size+DEFAULT_RESP_SIZE));
-			if( str->data )
-			{
-				str->size += DEFAULT_RESP_SIZE;
-				DPRINTF(E_DEBUG, L_HTTP, "UPnP SOAP response enlarged to %lu. [%d results so far]\n",
-					(unsigned long)str->size, passed_args->returned);
-			}
-			else
-			{
-				DPRINTF(E_ERROR, L_HTTP, "UPnP SOAP response was too big, and realloc failed!\n");
-				return -1;
-			}
-#if MAX_RESPONSE_SIZE > 0
-		}
-		else
-		{
-			DPRINTF(E_ERROR, L_HTTP, "UPnP SOAP response cut short, to not exceed the max response size [%lld]!\n", (long long int)MAX_RESPONSE_SIZE);
+			DPRINTF(E_ERROR, L_HTTP, "UPnP SOAP response aborted, client gone [%d results sent]\n",
+				passed_args->returned);
 			return -1;
 		}
-#endif
+		DPRINTF(E_DEBUG, L_HTTP, "UPnP SOAP response streamed [%d results so far]\n",
+			passed_args->returned);
 	}
 	passed_args->returned++;
+	passed_args->flags &= ~FLAG_HAS_CAPTIONS;
 
 	if( strncmp(class, "item", 4) == 0 )
 	{
@@ -856,7 +938,7 @@ callback(void *args, int argc, char **argv, char **azColName)
 			if( (passed_args->flags & FLAG_CAPTION_RES) ||
 			    (passed_args->filter & (FILTER_SEC_CAPTION_INFO_EX|FILTER_PV_SUBTITLE)) )
 			{
-				if( sql_get_int_field(db, "SELECT ID from CAPTIONS where ID = '%s'", detailID) > 0 )
+				if( has_captions )
 					passed_args->flags |= FLAG_HAS_CAPTIONS;
 			}
 			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
@@ -938,7 +1020,7 @@ callback(void *args, int argc, char **argv, char **azColName)
 		if( passed_args->filter & FILTER_SEC_DCM_INFO ) {
 			/* Get bookmark */
 			ret = strcatf(str, "&lt;sec:dcmInfo&gt;CREATIONDATE=0,FOLDER=%s,BM=%d&lt;/sec:dcmInfo&gt;",
-			              title, sql_get_int_field(db, "SELECT SEC from BOOKMARKS where ID = '%s'", detailID));
+			              title, bookmark ? atoi(bookmark) : 0);
 		}
 		if( artist ) {
 			if( (*mime == 'v') && (passed_args->filter & FILTER_UPNP_ACTOR) ) {
@@ -1112,12 +1194,15 @@ callback(void *args, int argc, char **argv, char **azColName)
 	}
 	else if( strncmp(class, "container", 9) == 0 )
 	{
+		magic = check_magic_container(id, passed_args->flags);
 		ret = strcatf(str, "&lt;container id=\"%s\" parentID=\"%s\" restricted=\"1\" ", id, parent);
 		if( passed_args->filter & FILTER_SEARCHABLE ) {
-			ret = strcatf(str, "searchable=\"%d\" ", check_magic_container(id, passed_args->flags) ? 0 : 1);
+			ret = strcatf(str, "searchable=\"%d\" ", magic ? 0 : 1);
 		}
 		if( passed_args->filter & FILTER_CHILDCOUNT ) {
-			ret = strcatf(str, "childCount=\"%d\"", get_child_count(id, check_magic_container(id, passed_args->flags)));
+			/* magic containers count something else than their own children */
+			ret = strcatf(str, "childCount=\"%d\"",
+			              (magic || !child_count) ? get_child_count(id, magic) : atoi(child_count));
 		}
 		/* If the client calls for BrowseMetadata on root, we have to include our "upnp:searchClass"'s, unless they're filtered out */
 		if( passed_args->requested == 1 && strcmp(id, "0") == 0 && (passed_args->filter & FILTER_UPNP_SEARCHCLASS) ) {
@@ -1171,6 +1256,148 @@ callback(void *args, int argc, char **argv, char **azColName)
 	return 0;
 }
 
+/* Paging with "limit StartingIndex, RequestedCount" makes SQLite produce
+ * and throw away every row before StartingIndex, so scrolling through a
+ * big container costs O(n^2).  Past the first page, the ordered object
+ * IDs of the whole result are recorded once in a cursor instead, and each
+ * following page seeks its slice of them by primary key.  Cursors live
+ * until the content changes, or CURSOR_TTL for the time based containers. */
+#define CURSOR_COUNT	4
+#define CURSOR_MIN_ROWS	500
+#define CURSOR_TTL	300
+#define CURSOR_MAX_PAGE	1000	/* the page's IDs are ordered by their position in a list */
+
+struct cursor_s {
+	char *from;		/* FROM ... ORDER BY clause of the result */
+	unsigned int update_id;
+	time_t expires;
+	int64_t *ids;
+	int count;
+};
+
+static struct cursor_s cursors[CURSOR_COUNT];
+static int cursor_next = 0;
+
+static void
+free_cursor(struct cursor_s *c)
+{
+	free(c->from);
+	free(c->ids);
+	memset(c, 0, sizeof(*c));
+}
+
+static struct cursor_s *
+get_cursor(const char *from)
+{
+	struct cursor_s *c = NULL;
+	sqlite3 *reader = sql_reader();
+	sqlite3_stmt *stmt;
+	time_t now = time(NULL);
+	char *sql;
+	int i, ret, size = 0;
+
+	for (i = 0; i < CURSOR_COUNT; i++)
+	{
+		if (!cursors[i].from || strcmp(cursors[i].from, from) != 0)
+			continue;
+		c = &cursors[i];
+		if (c->update_id == updateID && c->expires > now)
+			return c;
+		break;
+	}
+	if (!c)
+	{
+		c = &cursors[cursor_next];
+		cursor_next = (cursor_next + 1) % CURSOR_COUNT;
+	}
+	free_cursor(c);
+
+	sql = sqlite3_mprintf("SELECT o.ID %s", from);
+	ret = sqlite3_prepare_v2(reader, sql, -1, &stmt, NULL);
+	if (ret != SQLITE_OK)
+	{
+		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", sqlite3_errmsg(reader), sql);
+		sqlite3_free(sql);
+		return NULL;
+	}
+	sqlite3_free(sql);
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if (c->count == size)
+		{
+			int64_t *ids;
+			size = size ? size * 2 : 1024;
+			ids = realloc(c->ids, size * sizeof(*ids));
+			if (!ids)
+				break;
+			c->ids = ids;
+		}
+		c->ids[c->count++] = sqlite3_column_int64(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	if (ret != SQLITE_DONE)
+	{
+		free_cursor(c);
+		return NULL;
+	}
+	c->from = strdup(from);
+	c->update_id = updateID;
+	c->expires = now + CURSOR_TTL;
+
+	return c;
+}
+
+/* The where and order by clauses selecting a page of the result described
+ * by from, or NULL to page with limit.  Unbounded pages (RequestedCount 0)
+ * and huge ones are left to limit, since ordering by position in the ID
+ * list costs a scan of that list per row. */
+static char *
+cursor_page(const char *from, int start, int count)
+{
+	struct cursor_s *c;
+	struct string_s ids;
+	char *page;
+	int i, end;
+
+	if (count <= 0 || count > CURSOR_MAX_PAGE)
+		return NULL;
+	c = get_cursor(from);
+	if (!c)
+		return NULL;
+	end = (count > c->count - start) ? c->count : start + count;
+	if (start >= end)
+		return sqlite3_mprintf("where 0");
+
+	ids.size = (end - start) * 21 + 2;
+	ids.data = malloc(ids.size);
+	if (!ids.data)
+		return NULL;
+	ids.off = 0;
+	for (i = start; i < end; i++)
+		strcatf(&ids, ",%lld", (long long)c->ids[i]);
+	page = sqlite3_mprintf("where o.ID in (%s) order by instr('%s,', ',' || o.ID || ',')",
+	                       ids.data + 1, ids.data);
+	free(ids.data);
+
+	return page;
+}
+
+/* Sort ties last by a unique key, so that pages fetched with limit and
+ * through a cursor agree on the order */
+static char *
+order_tiebreak(char *orderBy, const char *key)
+{
+	char *order = NULL;
+
+	if (orderBy)
+		xasprintf(&order, "%s, %s", orderBy, key);
+	else
+		xasprintf(&order, "order by %s", key);
+	free(orderBy);
+
+	return order;
+}
+
 static void
 BrowseContentDirectory(struct upnphttp * h, const char * action)
 {
@@ -1193,10 +1420,13 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	const char *parentid_sql = "o.PARENT_ID";
 	const char *refid_sql = "o.REF_ID";
 	char where[256] = "";
-	char *orderBy = NULL;
+	char *orderBy = NULL, *from, *page = NULL;
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
+	char *key = NULL;
+	const char *cached;
+	int len;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
@@ -1252,6 +1482,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	args.client = h->req_client ? h->req_client->type->type : 0;
 	args.flags = h->req_client ? h->req_client->type->flags : 0;
 	args.str = &str;
+	args.h = h;
 	DPRINTF(E_DEBUG, L_HTTP, "Browsing ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
 	                         " * Count: %d\n"
@@ -1262,6 +1493,15 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 				ObjectID, RequestedCount, StartingIndex,
 	                        BrowseFlag, Filter, SortCriteria);
 
+	key = soap_cache_key(action, ObjectID, BrowseFlag, SortCriteria,
+	                     StartingIndex, RequestedCount, &args);
+	if( key && (cached = soap_cache_get(key, &len)) )
+	{
+		BuildSendAndCloseSoapResp(h, cached, len);
+		goto browse_error;
+	}
+	response_ttl = 0;
+
 	if( strcmp(BrowseFlag+6, "Metadata") == 0 )
 	{
 		const char *id = ObjectID;
@@ -1280,7 +1520,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 				      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
 				      " where OBJECT_ID = '%q';",
 				      objectid_sql, parentid_sql, refid_sql, id);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+		ret = sqlite3_exec(sql_reader(), sql, callback, (void *) &args, &zErrMsg);
 		totalMatches = args.returned;
 	}
 	else
@@ -1348,13 +1588,33 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			goto browse_error;
 		}
 
-		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
-		                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where %s %s limit %d, %d;",
-				      objectid_sql, parentid_sql, refid_sql,
-				      where, THISORNUL(orderBy), StartingIndex, RequestedCount);
+		orderBy = order_tiebreak(orderBy, "o.ID");
+		from = sqlite3_mprintf("from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                       " where %s %s", where, THISORNUL(orderBy));
+		if (StartingIndex > 0 && totalMatches >= CURSOR_MIN_ROWS)
+			page = cursor_page(from, StartingIndex, RequestedCount);
+		if (page)
+			sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
+			                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID) %z;",
+			                      objectid_sql, parentid_sql, refid_sql, page);
+		else
+			sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
+			                      "%s limit %d, %d;",
+			                      objectid_sql, parentid_sql, refid_sql,
+			                      from, StartingIndex, RequestedCount);
+		sqlite3_free(from);
 		DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+		ret = sqlite3_exec(sql_reader(), sql, callback, (void *) &args, &zErrMsg);
+	}
+	if( (ret != SQLITE_OK) && args.streaming )
+	{
+		/* too late for a SOAP error, the response can only be cut */
+		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\n", THISORNUL(zErrMsg));
+		sqlite3_free(zErrMsg);
+		sqlite3_free(sql);
+		h->keepalive = 0;
+		Finish_upnphttp(h);
+		goto browse_error;
 	}
 	if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
 	{
@@ -1379,9 +1639,12 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:BrowseResponse>",
 	                    args.returned, totalMatches, updateID);
-	BuildSendAndCloseSoapResp(h, str.data, str.off);
+	if( key && !args.streaming )
+		soap_cache_put(key, str.data, str.off, response_ttl);
+	SendSoapResp(&args);
 browse_error:
 	ClearNameValueList(&data);
+	free(key);
 	free(orderBy);
 	free(str.data);
 }
@@ -1398,18 +1661,159 @@ charcat(struct string_s *str, char c)
 	str->off += 1;
 }
 
+
+/* Kind of full text index db_create_fts() could build, if any */
+enum fts_type {
+	FTS_NONE,
+	FTS_TRIGRAM,
+	FTS_FTS5,
+	FTS_FTS4
+};
+
+static enum fts_type
+search_fts_type(void)
+{
+	enum fts_type fts = FTS_NONE;
+	char *sql;
+
+	sql = sql_get_text_param(sql_reader(), "SELECT sql from sqlite_master where name = 'DETAILS_FTS'", "");
+	if (!sql)
+		return FTS_NONE;
+	if (strcasestr(sql, "trigram"))
+		fts = FTS_TRIGRAM;
+	else if (strcasestr(sql, "fts5"))
+		fts = FTS_FTS5;
+	else if (strcasestr(sql, "fts4"))
+		fts = FTS_FTS4;
+	sqlite3_free(sql);
+
+	return fts;
+}
+
+/* Route "<column> contains <literal>" through the full text index, in
+ * place of the LIKE that scans every row.  The column name written at
+ * criteria offset off is replaced by a match on the DETAILS IDs, leaving
+ * the ordering and paging of the results to the outer query.  Returns how
+ * much of s was consumed, 0 to fall back to LIKE. */
+static int
+search_fts(struct string_s *criteria, int off, const char *s, enum fts_type fts, int negate)
+{
+	char term[256], column[16];
+	struct string_s str = { term, 0, sizeof(term) };
+	const char *p = s;
+	char *phrase, *match;
+	int len, chars, i;
+
+	/* d.<COLUMN> followed by nothing but blanks */
+	if (off < 0 || strncmp(criteria->data + off, "d.", 2) != 0)
+		return 0;
+	len = criteria->off - off - 2;
+	for (i = 0; i < len && isupper(criteria->data[off + 2 + i]); i++)
+		;
+	if (i == 0 || i >= sizeof(column))
+		return 0;
+	memcpy(column, criteria->data + off + 2, i);
+	column[i] = '\0';
+	for (; i < len; i++)
+		if (!isspace(criteria->data[off + 2 + i]))
+			return 0;
+
+	/* The literal, with the escapes parse_search_criteria() knows */
+	while (isspace(*p))
+		p++;
+	if (*p == '"')
+		p += 1;
+	else if (strncmp(p, "&quot;", 6) == 0)
+		p += 6;
+	else
+		return 0;
+	for (;;)
+	{
+		if (*p == '\0')
+			return 0;
+		if (*p == '"')
+		{
+			p += 1;
+			break;
+		}
+		if (strncmp(p, "&quot;", 6) == 0)
+		{
+			p += 6;
+			break;
+		}
+		if (strncmp(p, "\\&quot;", 7) == 0)
+		{
+			strcatf(&str, "&amp;quot;");
+			p += 7;
+		}
+		else if (strncmp(p, "&apos;", 6) == 0)
+		{
+			charcat(&str, '\'');
+			p += 6;
+		}
+		else
+			charcat(&str, *p++);
+	}
+	if (str.off >= str.size)
+		return 0;
+	/* words match by prefix, a trailing blank would ask for another */
+	if (fts != FTS_TRIGRAM)
+		while (str.off > 0 && isspace(term[str.off - 1]))
+			str.off--;
+	if (str.off == 0)
+		return 0;
+	term[str.off] = '\0';
+
+	/* trigrams need three characters to match anything */
+	for (chars = 0, i = 0; term[i]; i++)
+		if ((term[i] & 0xC0) != 0x80)
+			chars++;
+	if (fts == FTS_TRIGRAM && chars < 3)
+		return 0;
+
+	/* a quoted phrase, matched by prefix with word tokenizers */
+	str.data = phrase = malloc(2 * str.off + 8);
+	str.size = 2 * str.off + 8;
+	str.off = 0;
+	charcat(&str, '"');
+	for (i = 0; term[i]; i++)
+	{
+		if (term[i] == '"')
+			charcat(&str, '"');
+		charcat(&str, term[i]);
+	}
+	strcatf(&str, fts == FTS_FTS4 ? "*\"" : fts == FTS_FTS5 ? "\"*" : "\"");
+	match = sqlite3_mprintf("%Q", phrase);
+	free(phrase);
+
+	criteria->off = off;
+	strcatf(criteria, "o.DETAIL_ID %sin (SELECT rowid from DETAILS_FTS where %s match %s",
+	        negate ? "not " : "", column, match);
+	/* untagged files are titled after their name */
+	if (strcmp(column, "TITLE") == 0)
+		strcatf(criteria, " union SELECT rowid from DETAILS_FTS where FILENAME match %s", match);
+	charcat(criteria, ')');
+	sqlite3_free(match);
+
+	return p - s;
+}
+
 static inline char *
-parse_search_criteria(const char *str, char *sep)
+parse_search_criteria(const char *str, char *sep, enum fts_type fts)
 {
 	struct string_s criteria;
-	int len;
-	int literal = 0, like = 0;
+	int len, n;
+	int literal = 0, like = 0, fts_off = -1;
 	const char *s;
 
 	if (!str)
 		return strdup("1 = 1");
 
 	len = strlen(str) + 32;
+	/* room for the full text lookups replacing each contains */
+	if (fts != FTS_NONE)
+		for (s = str; (s = strstr(s, "ontains")); s++)
+			len += 5 * strlen(s) + 192;
 	criteria.data = malloc(len);
 	criteria.size = len;
 	criteria.off = 0;
@@ -1544,6 +1948,11 @@ parse_search_criteria(const char *str, char *sep)
 			case 'c':
 				if (strncmp(s, "contains", 8) == 0)
 				{
+					if (fts && (n = search_fts(&criteria, fts_off, s + 8, fts, 0)))
+					{
+						s += 8 + n;
+						continue;
+					}
 					strcatf(&criteria, "like");
 					s += 8;
 					like = 2;
@@ -1553,7 +1962,19 @@ parse_search_criteria(const char *str, char *sep)
 					charcat(&criteria, *s);
 				break;
 			case 'd':
-				if (strncmp(s, "derivedfrom", 11) == 0)
+				if (strncmp(s, "doesNotContain", 14) == 0)
+				{
+					if (fts && (n = search_fts(&criteria, fts_off, s + 14, fts, 1)))
+					{
+						s += 14 + n;
+						continue;
+					}
+					strcatf(&criteria, "not like");
+					s += 14;
+					like = 2;
+					continue;
+				}
+				else if (strncmp(s, "derivedfrom", 11) == 0)
 				{
 					strcatf(&criteria, "like");
 					s += 11;
@@ -1568,12 +1989,14 @@ parse_search_criteria(const char *str, char *sep)
 				}
 				else if (strncmp(s, "dc:title", 8) == 0)
 				{
+					fts_off = criteria.off;
 					strcatf(&criteria, "d.TITLE");
 					s += 8;
 					continue;
 				}
 				else if (strncmp(s, "dc:creator", 10) == 0)
 				{
+					fts_off = criteria.off;
 					strcatf(&criteria, "d.CREATOR");
 					s += 10;
 					continue;
@@ -1610,24 +2033,28 @@ parse_search_criteria(const char *str, char *sep)
 				}
 				else if (strncmp(s, "upnp:actor", 10) == 0)
 				{
+					fts_off = criteria.off;
 					strcatf(&criteria, "d.ARTIST");
 					s += 10;
 					continue;
 				}
 				else if (strncmp(s, "upnp:artist", 11) == 0)
 				{
+					fts_off = criteria.off;
 					strcatf(&criteria, "d.ARTIST");
 					s += 11;
 					continue;
 				}
 				else if (strncmp(s, "upnp:album", 10) == 0)
 				{
+					fts_off = criteria.off;
 					strcatf(&criteria, "d.ALBUM");
 					s += 10;
 					continue;
 				}
 				else if (strncmp(s, "upnp:genre", 10) == 0)
 				{
+					fts_off = criteria.off;
 					strcatf(&criteria, "d.GENRE");
 					s += 10;
 					continue;
@@ -1668,7 +2095,7 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 			CONTENT_DIRECTORY_SCHEMAS;
 	struct magic_container_s *magic;
 	char *zErrMsg = NULL;
-	char *sql, *ptr;
+	char *sql, *ptr, *page = NULL;
 	struct Response args;
 	struct string_s str;
 	int totalMatches;
@@ -1680,6 +2107,9 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
+	char *key = NULL;
+	const char *cached;
+	int len;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
@@ -1723,6 +2153,7 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	args.client = h->req_client ? h->req_client->type->type : 0;
 	args.flags = h->req_client ? h->req_client->type->flags : 0;
 	args.str = &str;
+	args.h = h;
 	DPRINTF(E_DEBUG, L_HTTP, "Searching ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
 	                         " * Count: %d\n"
@@ -1733,7 +2164,19 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 				ContainerID, RequestedCount, StartingIndex,
 	                        SearchCriteria, Filter, SortCriteria);
 
+	key = soap_cache_key(action, ContainerID, SearchCriteria, SortCriteria,
+	                     StartingIndex, RequestedCount, &args);
+	if( key && (cached = soap_cache_get(key, &len)) )
+	{
+		BuildSendAndCloseSoapResp(h, cached, len);
+		goto search_error;
+	}
+	response_ttl = 0;
+
 	magic = check_magic_container(ContainerID, args.flags);
+	/* the recent items searches depend on the time as well */
+	if (magic && magic->child_count)
+		response_ttl = MAGIC_COUNT_TTL;
 	if (magic && magic->objectid && *(magic->objectid))
 		ContainerID = *(magic->objectid);
 
@@ -1744,10 +2187,10 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	    GETFLAG(DLNA_STRICT_MASK) )
 		groupBy[0] = '\0';
 
-	where = parse_search_criteria(SearchCriteria, sep);
+	where = parse_search_criteria(SearchCriteria, sep, search_fts_type());
 	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s\n", where);
 
-	totalMatches = sql_get_int_field(db, "SELECT (select count(distinct DETAIL_ID)"
+	totalMatches = sql_get_int_field(sql_reader(), "SELECT (select count(distinct DETAIL_ID)"
 	                                     " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
 	                                     " where (OBJECT_ID glob '%q%s') and (%s))"
 	                                     " + "
@@ -1779,34 +2222,66 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 		goto search_error;
 	}
 
-	sql = sqlite3_mprintf( SELECT_COLUMNS
-	                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                      " where OBJECT_ID glob '%q%s' and (%s) %s "
-	                      "%z %s"
-	                      " limit %d, %d",
-	                      ContainerID, sep, where, groupBy,
-	                      (*ContainerID == '*') ? NULL :
-	                      sqlite3_mprintf("UNION ALL " SELECT_COLUMNS
-	                                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                                      " where OBJECT_ID = '%q' and (%s) ", ContainerID, where),
-	                      orderBy, StartingIndex, RequestedCount);
+	/* one row per DETAIL_ID when grouped; both keys are result columns,
+	 * as the UNION needs */
+	orderBy = order_tiebreak(orderBy, groupBy[0] ? "o.DETAIL_ID" : "o.OBJECT_ID");
+	if (*ContainerID == '*' && StartingIndex > 0 && totalMatches >= CURSOR_MIN_ROWS)
+	{
+		char *from = sqlite3_mprintf("from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                             " where OBJECT_ID glob '%q%s' and (%s) %s %s",
+		                             ContainerID, sep, where, groupBy, orderBy);
+		page = cursor_page(from, StartingIndex, RequestedCount);
+		sqlite3_free(from);
+	}
+	if (page)
+		sql = sqlite3_mprintf(SELECT_COLUMNS
+		                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID) %z",
+		                      page);
+	else
+		sql = sqlite3_mprintf( SELECT_COLUMNS
+		                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                      " where OBJECT_ID glob '%q%s' and (%s) %s "
+		                      "%z %s"
+		                      " limit %d, %d",
+		                      ContainerID, sep, where, groupBy,
+		                      (*ContainerID == '*') ? NULL :
+		                      sqlite3_mprintf("UNION ALL " SELECT_COLUMNS
+		                                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                                      " where OBJECT_ID = '%q' and (%s) ", ContainerID, where),
+		                      orderBy, StartingIndex, RequestedCount);
 	DPRINTF(E_DEBUG, L_HTTP, "Search SQL: %s\n", sql);
-	ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+	ret = sqlite3_exec(sql_reader(), sql, callback, (void *) &args, &zErrMsg);
 	if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
 	{
 		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
 		sqlite3_free(zErrMsg);
 	}
 	sqlite3_free(sql);
+	if( (ret != SQLITE_OK) && args.streaming )
+	{
+		/* too late for a SOAP error, the response can only be cut */
+		h->keepalive = 0;
+		Finish_upnphttp(h);
+		goto search_error;
+	}
+	if( ret != SQLITE_OK )
+	{
+		/* send what we have, but do not keep it */
+		free(key);
+		key = NULL;
+	}
 	ret = strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
 	                    "<NumberReturned>%u</NumberReturned>\n"
 	                    "<TotalMatches>%u</TotalMatches>\n"
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:SearchResponse>",
 	                    args.returned, totalMatches, updateID);
-	BuildSendAndCloseSoapResp(h, str.data, str.off);
+	if( key && !args.streaming )
+		soap_cache_put(key, str.data, str.off, response_ttl);
+	SendSoapResp(&args);
 search_error:
 	ClearNameValueList(&data);
+	free(key);
 	free(orderBy);
 	free(where);
 	free(str.data);
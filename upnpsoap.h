@@ -22,7 +22,6 @@
 #define __UPNPSOAP_H__
 
 #define DEFAULT_RESP_SIZE 131072
-#define MAX_RESPONSE_SIZE 2097152
 
 #define CONTENT_DIRECTORY_SCHEMAS \
 	" xmlns:dc=\"http://purl.org/dc/elements/1.1/\"" \
@@ -43,6 +42,8 @@ struct Response
 	uint32_t filter;
 	uint32_t flags;
 	enum client_types client;
+	struct upnphttp *h;
+	int streaming;		/* the response is being sent in parts */
 };
 
 /* ExecuteSoapAction():
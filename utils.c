@@ -135,7 +135,7 @@ strcasestrc(const char *s, const char *p, const char t)
 	slen = endptr - s;
 	while (slen >= plen)
 	{
-		if (*s == *p && strncasecmp(s+1, p+1, plen-1) == 0)
+		if (tolower((unsigned char)*s) == tolower((unsigned char)*p) && strncasecmp(s+1, p+1, plen-1) == 0)
 			return (char*)s;
 		s++;
 		slen--;